@@ -2,8 +2,14 @@
 
 // Includes
 #include "esp_err.h"
+#include <stdbool.h>
+#include <stdint.h>
 
 // Functions
 esp_err_t js_audio_init(void);
+void js_audio_refresh_tracks(void);
+void js_audio_open_emergency_track(void);
+int js_audio_track_count(void);
 void js_audio_play_pause_song(uint8_t song_index);
-void js_audio_play_pause_emergency_audio(void);
\ No newline at end of file
+void js_audio_play_pause_emergency_audio(void);
+bool js_audio_is_emergency_playing(void);
\ No newline at end of file
@@ -6,14 +6,34 @@
 #include "esp_check.h"
 #include "esp_log.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "freertos/task.h"
+#include <dirent.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+// Local Includes
+#include "js_dlog.h"
+#include "js_events.h"
+#include "js_state.h"
 
 // Defines
 #define TAG "js_audio"
+#define AUDIO_DIR "/fs"
+#define MAX_TRACKS JS_MAX_TRACKS
+#define TRACK_PATH_MAX 64
+#define EMERGENCY_TRACK "help_16k_adpcm_6db.wav"
+#define EMERGENCY_PATH AUDIO_DIR "/" EMERGENCY_TRACK
+#define EMERGENCY_IO_BUF 1024 // stdio buffer for the emergency track, one ADPCM block
+#define TRACK_LIST_PATH AUDIO_DIR "/tracks.lst" // Uploaded track paths in index order, one per line
+#define PLAY_TASK_STACK 4096
+#define PLAY_TASK_PRIORITY 10
+#define MAX_BLOCK_BYTES 1024                              // IMA ADPCM block size the tracks are made with
+#define MAX_BLOCK_SAMPLES (1 + (MAX_BLOCK_BYTES - 4) * 2) // Decoded samples per block
 
 // Types
 typedef struct
@@ -33,7 +53,8 @@ typedef struct
     int step_index;
 } ima_state_t;
 
-static const char *audio_tracks[] = {
+// Built-in tracks keep indexes 0-3 so existing alarms don't change. Uploaded tracks are added after them.
+static const char *default_tracks[] = {
     "/fs/FrEliseWoo59_120s_16k_adpcm_01.wav",
     // "/fs/FrEliseWoo59_3s_16k_adpcm_01.wav",
     "/fs/BeethovenNo5_120s_16k_adpcm_00.wav",
@@ -41,6 +62,9 @@ static const char *audio_tracks[] = {
     "/fs/Groovin_120s_16k_adpcm_3db.wav",
     "/fs/OldTimeRockAndRoll_120s_16k_adpcm_6db.wav",
 };
+#define DEFAULT_TRACK_COUNT (sizeof(default_tracks) / sizeof(default_tracks[0]))
+static char audio_tracks[MAX_TRACKS][TRACK_PATH_MAX];
+static int audio_track_count = 0;
 
 // Forward Declarations
 static bool _is_song_playing = false;
@@ -50,9 +74,35 @@ static int16_t ima_decode_nibble(uint8_t nibble, ima_state_t *st);
 static bool parse_wav_header(FILE *f, wav_info_t *info);
 static void audio_play_task(void *arg);
 static void emergency_play_task(void *arg);
+static void play_song(uint32_t song_index);
+static void play_emergency(void);
+// Both players are created once at init and wait for a track, so starting one never needs the heap
+static TaskHandle_t s_song_task = NULL;
+static TaskHandle_t s_emergency_task = NULL;
+static StaticTask_t s_song_task_mem;
+static StaticTask_t s_emergency_task_mem;
+static StackType_t s_song_task_stack[PLAY_TASK_STACK];
+static StackType_t s_emergency_task_stack[PLAY_TASK_STACK];
+static uint8_t s_song_blk[MAX_BLOCK_BYTES];
+static int16_t s_song_pcm[MAX_BLOCK_SAMPLES];
+static uint8_t s_emergency_blk[MAX_BLOCK_BYTES];
+static int16_t s_emergency_pcm[MAX_BLOCK_SAMPLES];
 static bool is_emergency_audio_playing = false;
 static bool _stop_emergency_audio_requested = false;
+// The emergency track stays open from boot with a static stdio buffer, so starting it never opens a file
+static FILE *s_emergency_file = NULL;
+static char s_emergency_io[EMERGENCY_IO_BUF];
+// Song and emergency start/stop come from different lanes (audio and safety), this keeps each toggle whole
+static SemaphoreHandle_t s_audio_lock = NULL;
+static StaticSemaphore_t s_audio_lock_mem;
+// One player on the I2S channel at a time, the emergency player waits here for a stopping song to let go
+static SemaphoreHandle_t s_i2s_lock = NULL;
+static StaticSemaphore_t s_i2s_lock_mem;
 static void stop_audio(void); // Stop the audio playback with silence
+static void publish_audio_state(void);
+static int compare_paths(const void *a, const void *b);
+static int load_track_list(char paths[][TRACK_PATH_MAX], int max);
+static void save_track_list(char paths[][TRACK_PATH_MAX], int count);
 
 /** Initialize JS Audio
  * Init the I2S interface for audio output
@@ -60,6 +110,8 @@ static void stop_audio(void); // Stop the audio playback with silence
 esp_err_t js_audio_init(void) {
     esp_err_t ret = ESP_FAIL;
     ESP_LOGI(TAG, "js_audio_init...");
+    s_audio_lock = xSemaphoreCreateMutexStatic(&s_audio_lock_mem); // First, js_audio_refresh_tracks() needs it
+    s_i2s_lock = xSemaphoreCreateMutexStatic(&s_i2s_lock_mem);
 
     /* I2S config */
     i2s_chan_config_t chan_cfg = I2S_CHANNEL_DEFAULT_CONFIG(I2S_NUM_0, I2S_ROLE_MASTER);
@@ -82,6 +134,19 @@ esp_err_t js_audio_init(void) {
     ESP_GOTO_ON_ERROR(i2s_channel_init_std_mode(tx_chan, &std_cfg), error, TAG, "Failed to initialize I2S channel");
     ESP_GOTO_ON_ERROR(i2s_channel_enable(tx_chan), error, TAG, "Failed to enable I2S channel");
 
+    // The players (static, they wait for a notification)
+    s_song_task = xTaskCreateStatic(audio_play_task, "audio_play_task", PLAY_TASK_STACK, NULL, PLAY_TASK_PRIORITY,
+                                    s_song_task_stack, &s_song_task_mem);
+    s_emergency_task = xTaskCreateStatic(emergency_play_task, "emergency_play_task", PLAY_TASK_STACK, NULL, PLAY_TASK_PRIORITY,
+                                         s_emergency_task_stack, &s_emergency_task_mem);
+    ESP_GOTO_ON_FALSE(s_song_task && s_emergency_task, ESP_ERR_NO_MEM, error, TAG, "Failed to create the audio tasks");
+
+    // Start with the built-in tracks until the file system is mounted and js_audio_refresh_tracks is called
+    for (int i = 0; i < DEFAULT_TRACK_COUNT; i++) {
+        strlcpy(audio_tracks[i], default_tracks[i], TRACK_PATH_MAX);
+    }
+    audio_track_count = DEFAULT_TRACK_COUNT;
+
     // Return OK
     return ESP_OK;
 
@@ -90,25 +155,152 @@ error:
 }
 
 /* ************************** Global Functions ************************** */
+/**
+ * Rebuild the track list from the file system
+ * Built-in tracks first (fixed indexes), then the uploads in the order they first arrived. That order is kept in
+ * TRACK_LIST_PATH so a new upload never moves the index an alarm points at. A deleted upload keeps its index
+ * (and plays nothing) until it's uploaded again or the index is needed for a new track.
+ */
+void js_audio_refresh_tracks(void) {
+    static char uploads[MAX_TRACKS - DEFAULT_TRACK_COUNT][TRACK_PATH_MAX]; // Static to keep it off the caller stack
+    static char added[MAX_TRACKS][TRACK_PATH_MAX];
+    const int max_uploads = MAX_TRACKS - DEFAULT_TRACK_COUNT;
+    int upload_count = load_track_list(uploads, max_uploads);
+    int added_count = 0;
+
+    DIR *dir = opendir(AUDIO_DIR);
+    if (!dir) {
+        ESP_LOGE(TAG, "Failed to open %s", AUDIO_DIR);
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && added_count < MAX_TRACKS) {
+        const char *name = entry->d_name;
+        size_t len = strlen(name);
+        if (len < 5 || strcmp(name + len - 4, ".wav") != 0) continue; // Skips .tmp uploads too
+        if (strcmp(name, EMERGENCY_TRACK) == 0) continue;
+
+        char path[TRACK_PATH_MAX];
+        if (snprintf(path, sizeof(path), AUDIO_DIR "/%s", name) >= (int)sizeof(path)) continue;
+
+        bool known = false;
+        for (int i = 0; i < DEFAULT_TRACK_COUNT; i++) {
+            if (strcmp(path, default_tracks[i]) == 0) known = true;
+        }
+        for (int i = 0; i < upload_count; i++) {
+            if (strcmp(path, uploads[i]) == 0) known = true;
+        }
+        if (known) continue;
+
+        strlcpy(added[added_count++], path, TRACK_PATH_MAX);
+    }
+    closedir(dir);
+
+    // New uploads go on the end (sorted by name when there are several, e.g. the first boot with this list),
+    // then into the index of a deleted one once the list is full
+    qsort(added, added_count, TRACK_PATH_MAX, compare_paths);
+    for (int i = 0; i < added_count; i++) {
+        int index = upload_count < max_uploads ? upload_count++ : -1;
+        for (int j = 0; index < 0 && j < upload_count; j++) {
+            if (access(uploads[j], F_OK) != 0) index = j;
+        }
+        if (index < 0) {
+            ESP_LOGW(TAG, "No track index left for %s", added[i]);
+            continue;
+        }
+        strlcpy(uploads[index], added[i], TRACK_PATH_MAX);
+    }
+    if (added_count > 0) save_track_list(uploads, upload_count);
+
+    // Swap the new list in under the lock, a song can be starting on another task
+    xSemaphoreTake(s_audio_lock, portMAX_DELAY);
+    for (int i = 0; i < upload_count; i++) {
+        strlcpy(audio_tracks[DEFAULT_TRACK_COUNT + i], uploads[i], TRACK_PATH_MAX);
+    }
+    audio_track_count = DEFAULT_TRACK_COUNT + upload_count;
+    xSemaphoreGive(s_audio_lock);
+
+    for (int i = 0; i < DEFAULT_TRACK_COUNT; i++) {
+        ESP_LOGI(TAG, "Track %d: %s%s", i, default_tracks[i], access(default_tracks[i], F_OK) == 0 ? "" : " (missing)");
+    }
+    for (int i = 0; i < upload_count; i++) {
+        ESP_LOGI(TAG, "Track %d: %s%s", DEFAULT_TRACK_COUNT + i, uploads[i], access(uploads[i], F_OK) == 0 ? "" : " (missing)");
+    }
+}
+
+/**
+ * Open the emergency track once the file system is mounted and keep it open, so starting it only rewinds it.
+ * It's built in (uploads can't replace it), so this only runs at boot.
+ */
+void js_audio_open_emergency_track(void) {
+    xSemaphoreTake(s_audio_lock, portMAX_DELAY);
+    if (!s_emergency_file) {
+        s_emergency_file = fopen(EMERGENCY_PATH, "rb");
+        if (s_emergency_file) {
+            setvbuf(s_emergency_file, s_emergency_io, _IOFBF, sizeof(s_emergency_io));
+        } else {
+            ESP_LOGE(TAG, "Failed to open file: %s", EMERGENCY_PATH);
+        }
+    }
+    xSemaphoreGive(s_audio_lock);
+}
+
+int js_audio_track_count(void) {
+    xSemaphoreTake(s_audio_lock, portMAX_DELAY);
+    int count = audio_track_count;
+    xSemaphoreGive(s_audio_lock);
+    return count;
+}
+
+/** True from the emergency start until its player has stopped, the source js_state's audio is derived from */
+bool js_audio_is_emergency_playing(void) {
+    return is_emergency_audio_playing;
+}
+
 /** Play the audio file with passed in path */
 void js_audio_play_pause_song(uint8_t song_index) {
-    ESP_LOGI(TAG, "js_audio_play_pause_song with index: %u", song_index);
-
-    if (_is_song_playing) {
-        ESP_LOGI(TAG, "Stopping audio playback");
+    JS_DLOGI(TAG, "js_audio_play_pause_song with index: %u", song_index);
+    if (!s_song_task) return; // js_audio_init() failed
+
+    xSemaphoreTake(s_audio_lock, portMAX_DELAY);
+    if (!_is_song_playing && song_index >= audio_track_count) {
+        ESP_LOGE(TAG, "Invalid song index: %u (have %d tracks)", song_index, audio_track_count);
+    } else if (!_is_song_playing && is_emergency_audio_playing) {
+        ESP_LOGW(TAG, "Emergency audio playing, not starting track %u", song_index);
+    } else if (_is_song_playing) {
+        JS_DLOGI(TAG, "Stopping audio playback");
         _is_song_playing = false;
         _stop_requested = true;
     } else {
-        ESP_LOGI(TAG, "Starting audio play task for file: %s", audio_tracks[song_index]);
+        JS_DLOGI(TAG, "Starting audio track %u", song_index); // The list can change before this prints, so no name
         _is_song_playing = true;
         _stop_requested = false;
-        xTaskCreate(audio_play_task, "audio_play_task", 4096, (void *)audio_tracks[song_index], 10, NULL);
+        publish_audio_state();
+        xTaskNotify(s_song_task, song_index, eSetValueWithOverwrite);
     }
+    xSemaphoreGive(s_audio_lock);
 }
 
+// Plays the track it's notified with (the index), one at a time
 static void audio_play_task(void *arg) {
-    const char *path = (const char *)arg;
-    ESP_LOGI(TAG, "Playing audio file: %s", path);
+    for (;;) {
+        uint32_t song_index;
+        xTaskNotifyWait(0, 0, &song_index, portMAX_DELAY);
+        if (song_index >= MAX_TRACKS) continue;
+        xSemaphoreTake(s_i2s_lock, portMAX_DELAY);
+        play_song(song_index);
+        xSemaphoreGive(s_i2s_lock);
+    }
+}
+
+static void play_song(uint32_t song_index) {
+    // Copy the path since the track list can be refreshed while playing
+    char path[TRACK_PATH_MAX];
+    xSemaphoreTake(s_audio_lock, portMAX_DELAY);
+    strlcpy(path, audio_tracks[song_index], sizeof(path));
+    xSemaphoreGive(s_audio_lock);
+    JS_DLOGI(TAG, "Playing audio track %lu", song_index); // path is on the stack, the name is logged at the end
 
     // Open the file
     FILE *f = fopen(path, "rb");
@@ -123,14 +315,15 @@ static void audio_play_task(void *arg) {
         ESP_LOGE(TAG, "Bad WAV header");
         goto cleanup;
     }
-    ESP_LOGI(TAG, "fmt=%u ch=%u sr=%lu bps=%u align=%u data=%lu+%lu",
+    JS_DLOGI(TAG, "fmt=%u ch=%u sr=%lu bps=%u align=%u data=%lu+%lu",
              wi.audio_format, wi.channels, (unsigned long)wi.sample_rate,
              wi.bits_per_sample, wi.block_align,
              wi.data_offset, (unsigned long)wi.data_size);
 
     // Validate the header
-    if (wi.audio_format != 0x0011 || wi.channels != 1 || wi.sample_rate != 16000 || wi.bits_per_sample != 4) {
-        ESP_LOGE(TAG, "Unsupported WAV (need IMA ADPCM mono 16kHz 4-bit)");
+    if (wi.audio_format != 0x0011 || wi.channels != 1 || wi.sample_rate != 16000 || wi.bits_per_sample != 4 ||
+        wi.block_align < 5 || wi.block_align > MAX_BLOCK_BYTES) {
+        ESP_LOGE(TAG, "Unsupported WAV (need IMA ADPCM mono 16kHz 4-bit, blocks up to %d bytes)", MAX_BLOCK_BYTES);
         goto cleanup;
     }
 
@@ -144,10 +337,8 @@ static void audio_play_task(void *arg) {
     i2s_channel_enable(tx_chan);
 
     const int block_bytes = wi.block_align;
-    const int samples_per_block = 1 + (block_bytes - 4) * 2;
-
-    uint8_t *blk = malloc(block_bytes);
-    int16_t *pcm = malloc(samples_per_block * sizeof(int16_t));
+    uint8_t *blk = s_song_blk;
+    int16_t *pcm = s_song_pcm;
 
     while (1) {
         if (_stop_requested) break;
@@ -178,50 +369,62 @@ static void audio_play_task(void *arg) {
         i2s_channel_write(tx_chan, pcm, out_samples * sizeof(int16_t), &written, portMAX_DELAY);
     }
 
-    free(pcm);
-    free(blk);
-
     ESP_LOGI(TAG, "Finished playing audio file: %s", path);
 
 cleanup:
     stop_audio(); // Make sure the audio is stopped properly
+    xSemaphoreTake(s_audio_lock, portMAX_DELAY);
     _stop_requested = false;
     _is_song_playing = false;
+    publish_audio_state();
+    xSemaphoreGive(s_audio_lock);
     if (f) fclose(f);
-    vTaskDelete(NULL); // Delete self when done
 }
 
 void js_audio_play_pause_emergency_audio(void) {
-    ESP_LOGI(TAG, "js_audio_play_pause_emergency_audio called");
+    JS_DLOGI(TAG, "js_audio_play_pause_emergency_audio called");
+    if (!s_emergency_task) return; // js_audio_init() failed
 
+    xSemaphoreTake(s_audio_lock, portMAX_DELAY);
     if (is_emergency_audio_playing) {
-        ESP_LOGI(TAG, "Stopping emergency audio playback");
+        JS_DLOGI(TAG, "Stopping emergency audio playback");
         _stop_emergency_audio_requested = true;
     } else {
-        ESP_LOGI(TAG, "Starting emergency audio play task");
-        // Stop any regular audio that's playing
+        JS_DLOGI(TAG, "Starting emergency audio play task");
+        // Stop any regular audio that's playing, the emergency player waits for it to let go of the I2S channel
         if (_is_song_playing) {
-            ESP_LOGI(TAG, "Stopping regular audio playback before starting emergency audio");
+            JS_DLOGI(TAG, "Stopping regular audio playback before starting emergency audio");
             _stop_requested = true;
-            vTaskDelay(pdMS_TO_TICKS(100)); // Give some time for the regular audio task to stop
         }
         is_emergency_audio_playing = true;
         _stop_emergency_audio_requested = false;
-        xTaskCreate(emergency_play_task, "emergency_play_task", 4096, NULL, 10, NULL);
+        publish_audio_state();
+        xTaskNotifyGive(s_emergency_task);
     }
+    xSemaphoreGive(s_audio_lock);
 }
 
-// Play help_16k_adpcm_6db.wav on loop until stopped
+// Plays the emergency track each time it's notified
 static void emergency_play_task(void *arg) {
-    const char *path = "/fs/help_16k_adpcm_6db.wav";
-    ESP_LOGI(TAG, "Playing emergency audio file: %s", path);
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        xSemaphoreTake(s_i2s_lock, portMAX_DELAY); // At most one block while a song stops
+        play_emergency();
+        xSemaphoreGive(s_i2s_lock);
+    }
+}
 
-    // Open the file
-    FILE *f = fopen(path, "rb");
+// Play help_16k_adpcm_6db.wav on loop until stopped
+static void play_emergency(void) {
+    JS_DLOGI(TAG, "Playing emergency audio file: " EMERGENCY_PATH);
+
+    // Already open (js_audio_refresh_tracks), start from the top
+    FILE *f = s_emergency_file;
     if (!f) {
-        ESP_LOGE("AUDIO", "Failed to open file: %s", path);
+        ESP_LOGE("AUDIO", "Emergency track not open: %s", EMERGENCY_PATH);
         goto cleanup;
     }
+    rewind(f);
 
     // Read the WAV header and fill in the wav_info_t structure
     wav_info_t wi;
@@ -229,14 +432,15 @@ static void emergency_play_task(void *arg) {
         ESP_LOGE(TAG, "Bad WAV header");
         goto cleanup;
     }
-    ESP_LOGI(TAG, "fmt=%u ch=%u sr=%lu bps=%u align=%u data=%lu+%lu",
+    JS_DLOGI(TAG, "fmt=%u ch=%u sr=%lu bps=%u align=%u data=%lu+%lu",
              wi.audio_format, wi.channels, (unsigned long)wi.sample_rate,
              wi.bits_per_sample, wi.block_align,
              wi.data_offset, (unsigned long)wi.data_size);
 
     // Validate the header
-    if (wi.audio_format != 0x0011 || wi.channels != 1 || wi.sample_rate != 16000 || wi.bits_per_sample != 4) {
-        ESP_LOGE(TAG, "Unsupported WAV (need IMA ADPCM mono 16kHz 4-bit)");
+    if (wi.audio_format != 0x0011 || wi.channels != 1 || wi.sample_rate != 16000 || wi.bits_per_sample != 4 ||
+        wi.block_align < 5 || wi.block_align > MAX_BLOCK_BYTES) {
+        ESP_LOGE(TAG, "Unsupported WAV (need IMA ADPCM mono 16kHz 4-bit, blocks up to %d bytes)", MAX_BLOCK_BYTES);
         goto cleanup;
     }
 
@@ -253,10 +457,8 @@ static void emergency_play_task(void *arg) {
         i2s_channel_enable(tx_chan);
 
         const int block_bytes = wi.block_align;
-        const int samples_per_block = 1 + (block_bytes - 4) * 2;
-
-        uint8_t *blk = malloc(block_bytes);
-        int16_t *pcm = malloc(samples_per_block * sizeof(int16_t));
+        uint8_t *blk = s_emergency_blk;
+        int16_t *pcm = s_emergency_pcm;
 
         // Play the audio
         while (1) {
@@ -287,17 +489,24 @@ static void emergency_play_task(void *arg) {
             size_t written = 0;
             i2s_channel_write(tx_chan, pcm, out_samples * sizeof(int16_t), &written, portMAX_DELAY);
         }
-
-        free(pcm);
-        free(blk);
     }
 
 cleanup:
     stop_audio(); // Make sure the audio is stopped properly
+    xSemaphoreTake(s_audio_lock, portMAX_DELAY);
     _stop_emergency_audio_requested = false;
     is_emergency_audio_playing = false;
-    if (f) fclose(f);
-    vTaskDelete(NULL); // Delete self when done
+    publish_audio_state();
+    xSemaphoreGive(s_audio_lock);
+}
+
+// Derive js_state's audio from the two flags, call with s_audio_lock held so no flag changes in between
+static void publish_audio_state(void) {
+    if (is_emergency_audio_playing) {
+        js_state_set_audio(JS_AUDIO_EMERGENCY);
+    } else {
+        js_state_set_audio(_is_song_playing ? JS_AUDIO_SONG : JS_AUDIO_IDLE);
+    }
 }
 
 /* ********************* Local I2S/Audio Codex Functions ********************* */
@@ -358,6 +567,44 @@ static void stop_audio(void) {
     }
 }
 
+// qsort helper for the track paths
+static int compare_paths(const void *a, const void *b) {
+    return strcmp((const char *)a, (const char *)b);
+}
+
+// Read the upload order saved by save_track_list(), returns how many were read (0 before the first upload)
+static int load_track_list(char paths[][TRACK_PATH_MAX], int max) {
+    FILE *f = fopen(TRACK_LIST_PATH, "r");
+    if (!f) return 0;
+
+    int count = 0;
+    while (count < max && fgets(paths[count], TRACK_PATH_MAX, f)) {
+        paths[count][strcspn(paths[count], "\n")] = '\0';
+        if (paths[count][0]) count++;
+    }
+    fclose(f);
+    return count;
+}
+
+// Write the upload order to a temp file and rename it over the old list, so a reset never leaves half a list
+static void save_track_list(char paths[][TRACK_PATH_MAX], int count) {
+    FILE *f = fopen(TRACK_LIST_PATH ".tmp", "w");
+    if (!f) {
+        ESP_LOGE(TAG, "Failed to save the track list");
+        return;
+    }
+
+    bool ok = true;
+    for (int i = 0; i < count; i++) {
+        if (fprintf(f, "%s\n", paths[i]) < 0) ok = false;
+    }
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(TRACK_LIST_PATH ".tmp", TRACK_LIST_PATH) != 0) {
+        ESP_LOGE(TAG, "Failed to save the track list");
+        remove(TRACK_LIST_PATH ".tmp");
+    }
+}
+
 // Helper function to convert little-endian 16-bit value to host byte order
 static uint16_t read_le16(FILE *f) {
     uint8_t b[2];
@@ -6,22 +6,34 @@
 #include "esp_check.h"
 #include "esp_log.h"
 #include "freertos/FreeRTOS.h"
-#include "freertos/task.h"
 #include <stdio.h>
 
 // Local Includes
 #include "js_adc.h"
+#include "js_events.h"
 #include "js_leds.h"
+#include "js_sched.h"
+#include "js_state.h"
 
 // Defines
 #define TAG "js_battery"
 #define PIN_PWR_IN GPIO_NUM_3
 #define BRIGHTNESS 10
+#define SHOW_PERIOD_MS 500           // Blink rate
+#define SHOW_TIMEOUT_RUNS 10         // Stop showing after ~5s when not charging, to save power
+#define SAMPLE_PERIOD_MS (10 * 1000) // Refresh the state store (charger changes are sampled at once)
+#define NO_JOB -1
 
 // Forward Declarations
 static void input_pin_isr(void *arg);
-static void show_battery_state_task(void *arg);
-static bool _show_battery_state = true;
+static void sample_job(void *arg);
+static void show_start_job(void *arg);
+static void show_battery_state_job(void *arg);
+static void on_battery_changed(js_state_field_t field, void *arg);
+static volatile bool _show_battery_state = false;
+static bool s_was_charging = false;
+static js_sched_id_t s_show_job = NO_JOB; // Only scheduled while showing
+static int s_show_runs = 0;
 static void show_battery_voltage(int voltage);
 
 /** Initialize JS Battery
@@ -44,8 +56,17 @@ esp_err_t js_battery_init(void) {
     // Install the ISR
     ESP_GOTO_ON_ERROR(gpio_isr_handler_add(PIN_PWR_IN, input_pin_isr, NULL), error, TAG, "Failed to add ISR handler");
 
-    // Task to show the battery state
-    xTaskCreate(show_battery_state_task, "show_battery_state_task", 2048, NULL, 10, NULL);
+    // Set the initial battery state
+    sample_job(NULL);
+    js_state_get_battery(NULL, &s_was_charging);
+
+    // Show the battery on a charger change, and sample in the background
+    ESP_GOTO_ON_ERROR(js_state_subscribe(JS_STATE_BIT(JS_STATE_BATTERY), on_battery_changed, NULL), error, TAG, "Failed to subscribe to the battery state");
+    ESP_GOTO_ON_ERROR(js_sched_every("battery", SAMPLE_PERIOD_MS, sample_job, NULL, NULL), error, TAG, "Failed to schedule the battery job");
+
+    // Show the battery state once at boot
+    js_set_show_battery_state(true);
+
     // Return OK
     return ESP_OK;
 
@@ -56,79 +77,83 @@ error:
 /* ************************** Global Functions ************************** */
 void js_set_show_battery_state(bool show) {
     _show_battery_state = show;
+    if (show) js_sched_after("battery_show", 0, show_start_job, NULL, NULL); // Hiding is picked up by the show job
 }
 
-int js_battery_read_voltage(void) {
-    return js_adc_battery_voltage();
+// Sample the charger and battery now (JS_EVENT_CHARGER_CHANGED). The ADC is only read from js_sched.
+void js_battery_update(void) {
+    js_sched_after("battery_sample", 0, sample_job, NULL, NULL);
 }
 
-bool js_battery_is_charging(void) {
-    return gpio_get_level(PIN_PWR_IN);
-}
 /* ************************** Local Functions ************************** */
-// Input Pin ISR
+// Input Pin ISR: the charger was plugged in or out, have it sampled
 static void input_pin_isr(void *arg) {
-    _show_battery_state = true;
-
-    // Read the pin state
-    // if (gpio_get_level(PIN_PWR_IN)) {
-    //     // ESP_LOGI(TAG, "Battery is charging");
-    //     _battery_charger_state = JS_BATTERY_CHARGER_STATE_CHARGING;
-    // } else {
-    //     // ESP_LOGI(TAG, "Battery is discharging");
-    //     _battery_charger_state = JS_BATTERY_CHARGER_STATE_DISCHARGING;
-    // }
+    js_events_post(JS_EVENT_CHARGER_CHANGED, NULL, 0);
 }
 
-// Show the battery state task
-static void show_battery_state_task(void *arg) {
-    // Set the inital battery state
-    // battery_state = gpio_get_level(PIN_PWR_IN) ? JS_BATTERY_STATE_CHARGING : JS_BATTERY_STATE_DISCHARGING;
-    bool is_charging = gpio_get_level(PIN_PWR_IN);
-    bool LED_was_on = false;
-    int show_battery_timeout_counter = 0;
-    int battery_voltage = js_adc_battery_voltage();
-
-    for (;;) {
-        // Delay for blinking and to avoid spamming logs
-        vTaskDelay(pdMS_TO_TICKS(500));
-
-        // If we shouldn't show the battery state, just clear LEDs and skip
-        if (!_show_battery_state) {
-            js_leds_clear();
-            continue;
-        }
+// Read the charging state and battery voltage into the state store (every 10s and on charger change, from js_sched)
+static void sample_job(void *arg) {
+    js_state_set_battery(js_adc_battery_voltage(), gpio_get_level(PIN_PWR_IN));
+}
 
-        // Check the charging state and battery voltage
-        is_charging = gpio_get_level(PIN_PWR_IN);
-        battery_voltage = js_adc_battery_voltage();
-
-        // If not charging
-        if (!is_charging) {
-            // Show the battery voltage
-            show_battery_voltage(battery_voltage);
-            if (show_battery_timeout_counter++ > 10) { // After 5 seconds, stop showing the battery state to save power
-                _show_battery_state = false;
-                show_battery_timeout_counter = 0;
-            }
-            continue;
-        }
+// Battery state published, show it if the charger was plugged in or out
+static void on_battery_changed(js_state_field_t field, void *arg) {
+    bool charging;
+    js_state_get_battery(NULL, &charging);
+    if (charging == s_was_charging) return;
+    s_was_charging = charging;
+    js_set_show_battery_state(true);
+}
 
-        // If charging and was off, turn led ON
-        if (!LED_was_on) {
-            show_battery_voltage(battery_voltage);
-            LED_was_on = true;
-            continue;
-        }
+// Start (or restart the timeout of) the battery display, with a fresh sample (from js_sched)
+static void show_start_job(void *arg) {
+    if (!_show_battery_state) return;
+    sample_job(NULL);
+    s_show_runs = 0;
+    if (s_show_job == NO_JOB) js_sched_every("battery_show", SHOW_PERIOD_MS, show_battery_state_job, NULL, &s_show_job);
+}
+
+// Show the battery state (every 500ms while showing, from js_sched)
+static void show_battery_state_job(void *arg) {
+    static bool LED_was_on = false;
+
+    // Done showing, clear the LEDs and stop until the next show
+    if (!_show_battery_state) {
+        js_leds_clear();
+        js_sched_cancel(s_show_job);
+        s_show_job = NO_JOB;
+        LED_was_on = false;
+        return;
+    }
 
-        // If fully charged, keep LED on
-        if (battery_voltage > 4100) {
-            show_battery_voltage(battery_voltage);
-        } else {
-            // Toggle off
-            js_leds_clear();
-            LED_was_on = false;
+    int battery_voltage;
+    bool is_charging;
+    js_state_get_battery(&battery_voltage, &is_charging);
+
+    // If not charging
+    if (!is_charging) {
+        // Show the battery voltage
+        show_battery_voltage(battery_voltage);
+        if (s_show_runs++ > SHOW_TIMEOUT_RUNS) { // After 5 seconds, stop showing the battery state to save power
+            _show_battery_state = false;
         }
+        return;
+    }
+
+    // If charging and was off, turn led ON
+    if (!LED_was_on) {
+        show_battery_voltage(battery_voltage);
+        LED_was_on = true;
+        return;
+    }
+
+    // If fully charged, keep LED on
+    if (battery_voltage > 4100) {
+        show_battery_voltage(battery_voltage);
+    } else {
+        // Toggle off
+        js_leds_clear();
+        LED_was_on = false;
     }
 }
 
@@ -2,16 +2,12 @@
 
 // Includes
 #include "esp_err.h"
-
-// BLE States
-typedef enum {
-    BLE_STATE_DISCONNECTED,
-    BLE_STATE_PAIRING,
-    BLE_STATE_CONNECTED,
-} ble_state_t;
+#include <stdint.h>
 
 // Functions
 esp_err_t js_ble_init(void);
 esp_err_t js_ble_start_advertising(void);
-ble_state_t js_ble_get_state(void);
-esp_err_t js_ble_stop(void);
\ No newline at end of file
+esp_err_t js_ble_stop(void);
+esp_err_t js_ble_start_emergency(int64_t press_us);
+esp_err_t js_ble_stop_emergency(void);
+void js_ble_update_status_adv(void);
\ No newline at end of file
@@ -1,10 +1,28 @@
 #pragma once
+#include "esp_err.h"
 #include "host/ble_gatt.h"
+#include "sdkconfig.h"
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+// Phones that can be connected at the same time
+#define JS_BLE_MAX_CONNECTIONS CONFIG_BT_NIMBLE_MAX_CONNECTIONS
+
 // Passing handles between js_ble.c and js_ble_gatt.c
 const struct ble_gatt_svc_def *js_ble_get_gatt_svcs(void);
-void js_ble_gatt_set_conn_handle(uint16_t conn_handle);
+void js_ble_gatt_on_subscribe(uint16_t conn_handle, uint16_t attr_handle, bool notify);
+void js_ble_gatt_on_disconnect(uint16_t conn_handle);
+void js_ble_request_fast_link(uint16_t conn_handle);
+bool js_ble_in_host_task(void); // Running on the NimBLE host task (which must never block)
+
+// Per-connection byte counters (reported by js_ble.c on disconnect)
+void js_ble_conn_add_rx(uint16_t conn_handle, size_t len);
+void js_ble_conn_add_tx(uint16_t conn_handle, size_t len);
+
+// Send a notify payload on the notify characteristic to every subscribed phone
+esp_err_t js_ble_notify(const char *s);
 
-// Send a notify payload on the notify characteristic
-esp_err_t js_ble_notify(const char *s);
\ No newline at end of file
+// Send a notify payload to one phone (the response to its command). JS_REPLY_NONE is a no-op.
+// Responses longer than one notification are split into '+' prefixed segments (see js_ble_gatt.c).
+esp_err_t js_ble_notify_conn(uint16_t conn_handle, const char *s);
\ No newline at end of file
@@ -0,0 +1,13 @@
+#pragma once
+#include "esp_err.h"
+#include "host/ble_gatt.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Log characteristic value handle (set by NimBLE when the GATT table is registered)
+extern uint16_t js_ble_log_val_handle;
+
+// Functions
+esp_err_t js_ble_log_init(void);
+int js_ble_log_access_cb(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+void js_ble_log_on_subscribe(uint16_t conn_handle, uint16_t attr_handle, bool notify);
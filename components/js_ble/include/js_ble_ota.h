@@ -0,0 +1,5 @@
+#pragma once
+#include "host/ble_gatt.h"
+
+// OTA service definition for registration in js_ble.c
+const struct ble_gatt_svc_def *js_ble_ota_get_svcs(void);
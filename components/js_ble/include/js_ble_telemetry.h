@@ -0,0 +1,14 @@
+#pragma once
+#include "esp_err.h"
+#include "host/ble_gatt.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Telemetry characteristic value handle (set by NimBLE when the GATT table is registered)
+extern uint16_t js_ble_telemetry_val_handle;
+
+// Functions
+esp_err_t js_ble_telemetry_init(void);
+int js_ble_telemetry_access_cb(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+void js_ble_telemetry_on_subscribe(uint16_t conn_handle, uint16_t attr_handle, bool notify);
+void js_ble_telemetry_kick(void); // Send a snapshot now (state changed)
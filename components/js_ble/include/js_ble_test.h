@@ -0,0 +1,10 @@
+#pragma once
+#include "esp_err.h"
+#include "host/ble_gatt.h"
+#include <stdint.h>
+
+// Throughput test service (only built with CONFIG_JS_BLE_THROUGHPUT_TEST)
+const struct ble_gatt_svc_def *js_ble_test_get_svcs(void);
+esp_err_t js_ble_test_init(void);
+void js_ble_test_on_notify_tx(uint16_t conn_handle);
+void js_ble_test_on_disconnect(uint16_t conn_handle);
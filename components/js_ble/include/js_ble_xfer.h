@@ -0,0 +1,71 @@
+#pragma once
+#include "esp_err.h"
+#include "host/ble_gatt.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Bulk transfer engine shared by the BLE services that stream data into flash (OTA, audio files)
+ *
+ * Control characteristic (write + notify), phone -> device:
+ *   BEGIN  [0x01][u32 size][u32 crc32][arg...]  Start, or resume if size/crc32/arg match the open session
+ *   END    [0x02]                               Verify the CRC32 and finish
+ *   ABORT  [0x03]
+ *   STATUS [0x04]
+ * Data characteristic (write without response), phone -> device:
+ *   [u32 offset][payload]             or, for sinks with chunk_crc set:
+ *   [u32 offset][u16 crc16][payload]  CRC-16/CCITT-FALSE (poly 0x1021, init 0xFFFF) of the payload
+ * Device -> phone (notified on the control characteristic), all little endian:
+ *   [0x81][status][u32 resume offset][u16 window bytes][u16 max payload bytes]  BEGIN response
+ *   [0x82][status]                    END response
+ *   [0x83][status]                    ABORT response
+ *   [0x84][status][u32 written]       STATUS response
+ *   [0x90][status][u32 written]       ACK every half window of packets written to flash
+ *   [0x91][status][u32 expected]      NACK on a gap, bad chunk CRC or when out of buffers, resend from expected
+ * The phone keeps at most "window bytes" beyond the last ACK in flight. The device buffers one packet per slot, so
+ * the window assumes full "max payload" packets. ACKs come every half window of packets.
+ */
+
+// Control opcodes
+#define JS_XFER_OP_BEGIN 0x01
+#define JS_XFER_OP_END 0x02
+#define JS_XFER_OP_ABORT 0x03
+#define JS_XFER_OP_STATUS 0x04
+
+// Responses
+#define JS_XFER_RSP_BEGIN 0x81
+#define JS_XFER_RSP_END 0x82
+#define JS_XFER_RSP_ABORT 0x83
+#define JS_XFER_RSP_STATUS 0x84
+#define JS_XFER_RSP_ACK 0x90
+#define JS_XFER_RSP_NACK 0x91
+
+// Max bytes of the BEGIN arg (e.g. a file name)
+#define JS_XFER_ARG_MAX 48
+
+// Status codes
+typedef enum {
+    JS_XFER_OK,
+    JS_XFER_ERR_BUSY,       // Another transfer is running
+    JS_XFER_ERR_INVALID,    // Bad request (size, arg, ...)
+    JS_XFER_ERR_NO_SESSION, // END/STATUS without a BEGIN
+    JS_XFER_ERR_CRC,        // Whole image CRC32 or chunk CRC16 mismatch
+    JS_XFER_ERR_WRITE,      // Sink failed to write/finish
+    JS_XFER_ERR_NO_BUFFER,  // Dropped because all buffers were in use
+} js_xfer_status_t;
+
+// Where the data ends up. Called from the transfer task, never the NimBLE host task.
+typedef struct {
+    const char *name;
+    bool chunk_crc; // Data packets carry a CRC16 of the payload
+    esp_err_t (*begin)(uint32_t size, const uint8_t *arg, size_t arg_len);
+    esp_err_t (*write)(const uint8_t *data, size_t len);
+    esp_err_t (*finish)(void);
+    void (*abort)(void);
+} js_ble_xfer_sink_t;
+
+// Functions
+esp_err_t js_ble_xfer_init(void);
+int js_ble_xfer_control(const js_ble_xfer_sink_t *sink, uint16_t conn_handle, uint16_t ctrl_val_handle, struct os_mbuf *om);
+int js_ble_xfer_data(const js_ble_xfer_sink_t *sink, uint16_t conn_handle, struct os_mbuf *om);
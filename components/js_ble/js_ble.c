@@ -1,37 +1,183 @@
 // Self Include
 #include "js_ble.h"
+#include "js_ble_files.h"
 #include "js_ble_gatt.h"
+#include "js_ble_log.h"
+#include "js_ble_ota.h"
+#include "js_ble_telemetry.h"
+#include "js_ble_xfer.h"
+#if CONFIG_JS_BLE_THROUGHPUT_TEST
+#include "js_ble_test.h"
+#endif
 
 // Includes
+#include "esp_app_desc.h"
 #include "esp_check.h"
 #include "esp_err.h"
 #include "esp_log.h"
+#include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
 #include "host/ble_hs.h"
 #include "host/util/util.h"
 #include "nimble/nimble_port.h"
 #include "nimble/nimble_port_freertos.h"
 #include "services/gap/ble_svc_gap.h"
 #include "services/gatt/ble_svc_gatt.h"
+#include <stdio.h>
+#include <string.h>
+
+// Includes for events
+#include "esp_event.h"
+#include "esp_timer.h"
+#include "js_dlog.h"
+#include "js_events.h"
+#include "js_state.h"
 
 // Defines
 #define TAG "js_ble"
 
+// Advertising schedule: fast burst for discovery, then slow until the overall timeout
+#define ADV_FAST_ITVL_MIN_MS 30
+#define ADV_FAST_ITVL_MAX_MS 60
+#define ADV_FAST_DURATION_MS (30 * 1000)
+#define ADV_SLOW_ITVL_MIN_MS 1000
+#define ADV_SLOW_ITVL_MAX_MS 1200
+#define ADV_TIMEOUT_MS (3 * 60 * 1000) // Give up after this and post JS_EVENT_BLE_ADV_TIMEOUT
+#define ADV_DIRECTED_DURATION_MS 1280  // High duty cycle directed advertising is capped at 1.28s by the spec
+#define MAX_BONDED_PEERS CONFIG_BT_NIMBLE_MAX_BONDS
+#define REQUEST_QUEUE_LEN 8 // Start/stop requests from the app waiting for the host task
+
+// Emergency advertising: very fast so nearby phones see it at once, then backing off to save battery
+#define EMERGENCY_FAST_ITVL_MS 20 // Shortest allowed for connectable advertising
+#define EMERGENCY_FAST_DURATION_MS (30 * 1000)
+#define EMERGENCY_MEDIUM_ITVL_MS 100
+#define EMERGENCY_MEDIUM_DURATION_MS (5 * 60 * 1000)
+#define EMERGENCY_SLOW_ITVL_MS 1000 // Until the emergency is stopped
+#define EMERGENCY_FRAME_TYPE 0x01
+#define EMERGENCY_FLAG_ACTIVE 0x01
+
+// Manufacturer data frames (advertising and scan response)
+#define MFG_COMPANY_ID 0xFFFF // Bluetooth SIG ID reserved for testing, replace with an assigned ID
+#define STATUS_FRAME_TYPE 0x02
+#define STATUS_FLAG_CHARGING 0x01
+
+// Fast link for bulk transfers (units of 1.25ms / 10ms)
+#define FAST_CONN_ITVL_MIN 6          // 7.5ms
+#define FAST_CONN_ITVL_MAX 12         // 15ms
+#define FAST_CONN_SUPERVISION_TMO 400 // 4s
+#define MAX_TX_OCTETS 251             // LE Data Length Extension
+#define MAX_TX_TIME 2120
+
+// Advertising phases
+typedef enum {
+    ADV_PHASE_IDLE,
+    ADV_PHASE_DIRECTED, // Directed to the last bonded phone (fast reconnect)
+    ADV_PHASE_FAST,
+    ADV_PHASE_SLOW,
+    ADV_PHASE_EMERGENCY, // Emergency alert, replaces the normal schedule until stopped
+} adv_phase_t;
+
+// Requests from the app lanes, carried out on the host task (see post_request)
+typedef enum {
+    REQ_START_ADVERTISING,
+    REQ_STOP,
+    REQ_START_EMERGENCY,
+    REQ_STOP_EMERGENCY,
+} ble_request_op_t;
+
+typedef struct {
+    ble_request_op_t op;
+    int64_t press_us; // REQ_START_EMERGENCY
+} ble_request_t;
+
+// Discovery-to-connected latency stats
+typedef struct {
+    uint32_t count;
+    int64_t min_ms;
+    int64_t max_ms;
+    int64_t total_ms;
+} connect_stats_t;
+
+// Connected phone and its traffic (for the per-connection report on disconnect)
+typedef struct {
+    uint16_t handle;
+    int64_t connected_us;
+    uint32_t rx_bytes;        // Writes from the phone
+    uint32_t tx_bytes;        // Notifications to the phone
+    int32_t heap_cost;        // Free heap drop from the advertising start to the connect
+    uint32_t heap_at_connect; // Free heap right after connecting
+    int64_t adv_latency_ms;   // Advertising start to connect, recorded once encrypted (-1 = none pending)
+} conn_info_t;
+
+// NimBLE NVS bond store (no public header)
+void ble_store_config_init(void);
+
 // Forward Declarations
 static bool _stack_is_ready = false;
+static TaskHandle_t s_host_task = NULL;
 static uint8_t s_own_addr_type;
+static adv_phase_t s_adv_phase = ADV_PHASE_IDLE;
+static int64_t s_adv_schedule_start_us = 0; // Start of the current schedule (for the overall timeout)
+static bool s_stop_requested = false;       // Set by js_ble_stop so a disconnect doesn't restart advertising
+static bool s_whitelist_only = false;       // Reconnect mode: only bonded phones may connect
+static ble_addr_t s_direct_peer;            // Target of the directed advertising phase
+static ble_addr_t s_last_peer;              // Last bonded phone that connected (preferred for directed advertising)
+static bool s_has_last_peer = false;
+static ble_addr_t s_bonded_peers[MAX_BONDED_PEERS]; // Identity addresses bonded when the schedule started
+static int s_num_bonded = 0;
+static connect_stats_t s_connect_stats[2]; // [0] = new phones, [1] = bonded phones
+static conn_info_t s_conns[JS_BLE_MAX_CONNECTIONS];
+static portMUX_TYPE s_conn_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t s_heap_at_adv_start = 0; // Baseline for the RAM cost of a new connection
+static bool s_emergency_active = false;
+static bool s_adv_before_emergency = false; // Normal advertising was running when the emergency started (resume it after)
+static int64_t s_emergency_start_us = 0;
+static int64_t s_emergency_press_us = 0; // Button press time, cleared once the first advertisement latency is logged
+static uint16_t s_emergency_counter = 0; // Increments per emergency so phones can tell alerts apart
+// Everything above that's about advertising is only touched on the host task, the app's requests queue up for it
+static QueueHandle_t s_requests = NULL;
+static StaticQueue_t s_requests_mem;
+static uint8_t s_requests_storage[REQUEST_QUEUE_LEN * sizeof(ble_request_t)];
+static struct ble_npl_event s_request_ev;
+static esp_err_t post_request(ble_request_op_t op, int64_t press_us);
+static void on_request_event(struct ble_npl_event *ev);
+static void do_start_advertising(void);
+static void do_stop(void);
+static void do_start_emergency(int64_t press_us);
+static void do_stop_emergency(void);
 //
 static void on_stack_ready(void);
-static void start_advertising(void);
+static void start_advertising(bool reconnect);
+static void start_adv_phase(adv_phase_t phase);
+static void start_emergency_adv(void);
+static int set_adv_fields(const uint8_t *mfg_data, uint8_t mfg_data_len);
+#if CONFIG_JS_BLE_STATUS_ADV
+static int set_status_rsp_fields(void);
+#endif
+static void on_adv_complete(int reason);
+static int load_bonded_peers(ble_addr_t *peers, int max_peers);
+static bool is_bonded_peer(const ble_addr_t *addr);
+static void record_connect_latency(int64_t latency_ms, bool bonded);
+static void conn_add(uint16_t conn_handle);
+static void conn_remove(uint16_t conn_handle);
+static int64_t conn_take_adv_latency(uint16_t conn_handle);
+static int conn_count(void);
+static conn_info_t *conn_find(uint16_t conn_handle);
+static void publish_ble_state(void);
 // Connection tasks
 static int gap_event_cb(struct ble_gap_event *event, void *arg);
 static void ble_host_task(void *param);
-static uint16_t ble_conn_handle = BLE_HS_CONN_HANDLE_NONE;
 
 /** Initialize the BLE Stack */
 esp_err_t js_ble_init(void) {
     esp_err_t ret = ESP_FAIL;
     ESP_LOGI(TAG, "js_ble_init...");
 
+    // 0 is a valid connection handle, so mark the slots empty
+    for (int i = 0; i < JS_BLE_MAX_CONNECTIONS; i++) s_conns[i].handle = BLE_HS_CONN_HANDLE_NONE;
+
     // Initialize the default NimBLE stack drivers
     nimble_port_init();
     ble_svc_gap_init();
@@ -40,10 +186,47 @@ esp_err_t js_ble_init(void) {
     // Set the device name (this will show up when scanning for BLE devices)
     ble_svc_gap_device_name_set("JiveStick");
 
-    // Configure the GATT server with the custom service and characteristic in js_ble_gatt.c
-    const struct ble_gatt_svc_def *gatt_svcs = js_ble_get_gatt_svcs();
-    ESP_GOTO_ON_FALSE(ble_gatts_count_cfg(gatt_svcs) == 0, ESP_ERR_INVALID_STATE, error, TAG, "Invalid GATT configuration");
-    ESP_GOTO_ON_FALSE(ble_gatts_add_svcs(gatt_svcs) == 0, ESP_ERR_INVALID_STATE, error, TAG, "Failed to add GATT services");
+    // Security: Just Works bonding with the keys persisted in NVS (CONFIG_BT_NIMBLE_NVS_PERSIST)
+    ble_hs_cfg.sm_io_cap = BLE_HS_IO_NO_INPUT_OUTPUT;
+    ble_hs_cfg.sm_bonding = 1;
+    ble_hs_cfg.sm_mitm = 0;
+    ble_hs_cfg.sm_sc = 1;
+    ble_hs_cfg.sm_our_key_dist = BLE_SM_PAIR_KEY_DIST_ENC | BLE_SM_PAIR_KEY_DIST_ID;
+    ble_hs_cfg.sm_their_key_dist = BLE_SM_PAIR_KEY_DIST_ENC | BLE_SM_PAIR_KEY_DIST_ID;
+    ble_hs_cfg.store_status_cb = ble_store_util_status_rr;
+    ble_store_config_init();
+
+    // Configure the GATT server with the custom service in js_ble_gatt.c, OTA in js_ble_ota.c, file upload in js_ble_files.c
+    const struct ble_gatt_svc_def *all_svcs[] = {
+        js_ble_get_gatt_svcs(),
+        js_ble_ota_get_svcs(),
+        js_ble_files_get_svcs(),
+#if CONFIG_JS_BLE_THROUGHPUT_TEST
+        js_ble_test_get_svcs(),
+#endif
+    };
+    for (int i = 0; i < sizeof(all_svcs) / sizeof(all_svcs[0]); i++) {
+        ESP_GOTO_ON_FALSE(ble_gatts_count_cfg(all_svcs[i]) == 0, ESP_ERR_INVALID_STATE, error, TAG, "Invalid GATT configuration");
+        ESP_GOTO_ON_FALSE(ble_gatts_add_svcs(all_svcs[i]) == 0, ESP_ERR_INVALID_STATE, error, TAG, "Failed to add GATT services");
+    }
+
+    // Bulk transfer engine (buffers + flash writer task) used by OTA
+    ESP_GOTO_ON_ERROR(js_ble_xfer_init(), error, TAG, "Failed to start transfer engine");
+
+    // Telemetry task (idle until a phone subscribes)
+    ESP_GOTO_ON_ERROR(js_ble_telemetry_init(), error, TAG, "Failed to start telemetry");
+
+    // Log stream task and vprintf hook (lines are only copied while a phone is subscribed)
+    ESP_GOTO_ON_ERROR(js_ble_log_init(), error, TAG, "Failed to start log stream");
+
+#if CONFIG_JS_BLE_THROUGHPUT_TEST
+    // Throughput test source task (idle until started)
+    ESP_GOTO_ON_ERROR(js_ble_test_init(), error, TAG, "Failed to start throughput test");
+#endif
+
+    // Start/stop requests from the app lanes, handed to the host task
+    s_requests = xQueueCreateStatic(REQUEST_QUEUE_LEN, sizeof(ble_request_t), s_requests_storage, &s_requests_mem);
+    ble_npl_event_init(&s_request_ev, on_request_event, NULL);
 
     // When the BLE stack is ready, it will call on_stack_ready which sets _stack_is_ready to true
     ble_hs_cfg.sync_cb = on_stack_ready;
@@ -56,76 +239,233 @@ error:
     return ret;
 }
 
-// Handle request to start advertising (called from main app when BLE stack is ready)
+/**
+ * Start/stop requests from the app. The advertising state is also changed by the GAP callbacks on the NimBLE host
+ * task, so these only queue the request and the host task carries it out, one change at a time. They never wait,
+ * so the safety lane can call them.
+ */
 esp_err_t js_ble_start_advertising(void) {
+    return post_request(REQ_START_ADVERTISING, 0);
+}
+
+// Disconnect and stop advertising (called from main app when requested)
+esp_err_t js_ble_stop(void) {
+    return post_request(REQ_STOP, 0);
+}
+
+/**
+ * Emergency: switch to emergency advertising and alert connected phones.
+ * press_us is the button press time, for the press-to-first-advertisement latency.
+ */
+esp_err_t js_ble_start_emergency(int64_t press_us) {
+    return post_request(REQ_START_EMERGENCY, press_us);
+}
+
+// Emergency over: stop the alert advertising and tell connected phones
+esp_err_t js_ble_stop_emergency(void) {
+    return post_request(REQ_STOP_EMERGENCY, 0);
+}
+
+/**
+ * Ask for the fastest link the phone allows before a bulk transfer.
+ * The phone can refuse any of these, so failures are only logged.
+ */
+void js_ble_request_fast_link(uint16_t conn_handle) {
+    struct ble_gap_upd_params params = {
+        .itvl_min = FAST_CONN_ITVL_MIN,
+        .itvl_max = FAST_CONN_ITVL_MAX,
+        .latency = 0,
+        .supervision_timeout = FAST_CONN_SUPERVISION_TMO,
+    };
+    int rc = ble_gap_update_params(conn_handle, &params);
+    if (rc != 0) ESP_LOGW(TAG, "Conn params update failed: %d", rc);
+
+    rc = ble_gap_set_prefered_le_phy(conn_handle, BLE_GAP_LE_PHY_2M_MASK, BLE_GAP_LE_PHY_2M_MASK, BLE_GAP_LE_PHY_CODED_ANY);
+    if (rc != 0) ESP_LOGW(TAG, "2M PHY request failed: %d", rc);
+
+    rc = ble_gap_set_data_len(conn_handle, MAX_TX_OCTETS, MAX_TX_TIME);
+    if (rc != 0) ESP_LOGW(TAG, "Data length update failed: %d", rc);
+}
+
+
+/* ******************************** Host Task Requests ****************************** */
+// Queue a request and wake the host task for it (the event is only queued once however many requests are waiting)
+static esp_err_t post_request(ble_request_op_t op, int64_t press_us) {
     if (!_stack_is_ready) {
-        ESP_LOGW(TAG, "BLE stack not ready, cannot start advertising");
+        ESP_LOGW(TAG, "BLE stack not ready");
         return ESP_ERR_INVALID_STATE;
     }
 
-    ble_state_t state = js_ble_get_state();
-    if (state == BLE_STATE_CONNECTED) {
-        ESP_LOGW(TAG, "Already connected, cannot start advertising");
-        return ESP_ERR_INVALID_STATE;
+    ble_request_t req = {.op = op, .press_us = press_us};
+    if (xQueueSend(s_requests, &req, 0) != pdTRUE) {
+        ESP_LOGE(TAG, "BLE request queue full, request %d dropped", op);
+        return ESP_ERR_NO_MEM;
+    }
+    ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &s_request_ev);
+    return ESP_OK;
+}
+
+// Host task: carry out every waiting request in the order they were made
+static void on_request_event(struct ble_npl_event *ev) {
+    ble_request_t req;
+    while (xQueueReceive(s_requests, &req, 0) == pdTRUE) {
+        switch (req.op) {
+        case REQ_START_ADVERTISING:
+            do_start_advertising();
+            break;
+        case REQ_STOP:
+            do_stop();
+            break;
+        case REQ_START_EMERGENCY:
+            do_start_emergency(req.press_us);
+            break;
+        case REQ_STOP_EMERGENCY:
+            do_stop_emergency();
+            break;
+        }
+        publish_ble_state();
+    }
+}
+
+static void do_start_advertising(void) {
+    // Another phone can connect while one is already connected, as long as there's a free slot
+    if (conn_count() >= JS_BLE_MAX_CONNECTIONS) {
+        ESP_LOGW(TAG, "All %d connections in use, cannot start advertising", JS_BLE_MAX_CONNECTIONS);
+        return;
+    }
+
+    // The button opens reconnect mode up to new phones, restarting the schedule without the whitelist
+    if (ble_gap_adv_active() && s_whitelist_only && !s_emergency_active) {
+        ble_gap_adv_stop(); // Stopping doesn't raise ADV_COMPLETE
+        s_adv_phase = ADV_PHASE_IDLE;
     }
 
-    if (state == BLE_STATE_PAIRING) {
+    if (ble_gap_adv_active() || s_emergency_active) {
         ESP_LOGW(TAG, "Already advertising, cannot start advertising again");
-        return ESP_ERR_INVALID_STATE;
+        return;
     }
 
-    // Start advertising logic here
-    start_advertising();
-    return ESP_OK;
+    // Start the advertising schedule (directed to a known phone first if there is one)
+    s_stop_requested = false;
+    start_advertising(false);
 }
 
-// Disconnect and stop advertising (called from main app when requested)
-esp_err_t js_ble_stop(void) {
-    // If currently connected, disconnect
-    if (ble_conn_handle != BLE_HS_CONN_HANDLE_NONE) {
-        int rc = ble_gap_terminate(ble_conn_handle, BLE_ERR_REM_USER_CONN_TERM);
-        if (rc != 0) {
-            ESP_LOGE(TAG, "Failed to terminate connection: %d", rc);
-            return ESP_FAIL;
-        }
+static void do_stop(void) {
+    // Don't restart advertising when the disconnect comes through
+    s_stop_requested = true;
+    if (!s_emergency_active) s_adv_phase = ADV_PHASE_IDLE;
+
+    // Disconnect every connected phone
+    for (int i = 0; i < JS_BLE_MAX_CONNECTIONS; i++) {
+        uint16_t conn_handle = s_conns[i].handle;
+        if (conn_handle == BLE_HS_CONN_HANDLE_NONE) continue;
+        int rc = ble_gap_terminate(conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+        if (rc != 0) ESP_LOGE(TAG, "Failed to terminate connection %u: %d", conn_handle, rc);
     }
 
-    // If currently advertising, stop advertising
-    if (ble_gap_adv_active()) {
+    // If currently advertising, stop advertising (an emergency alert keeps going until the emergency is stopped)
+    if (ble_gap_adv_active() && !s_emergency_active) {
         int rc = ble_gap_adv_stop();
         if (rc != 0) {
             ESP_LOGE(TAG, "Failed to stop advertising: %d", rc);
-            return ESP_FAIL;
+            return;
         }
     }
+    ESP_LOGI(TAG, "BLE stopped and disconnected"); // Connected until the disconnects come through
+}
 
-    ESP_LOGI(TAG, "BLE stopped and disconnected");
-    return ESP_OK;
+static void do_start_emergency(int64_t press_us) {
+    // A second press while the alert runs keeps what was saved the first time
+    if (!s_emergency_active) s_adv_before_emergency = ble_gap_adv_active();
+    s_emergency_active = true;
+    s_emergency_counter++;
+    s_emergency_start_us = esp_timer_get_time();
+    s_emergency_press_us = press_us;
+
+    // Replace whatever advertising is running (stopping doesn't raise ADV_COMPLETE)
+    if (ble_gap_adv_active()) ble_gap_adv_stop();
+    start_emergency_adv();
+
+    // Tell the phones that are already connected
+    char alert[16];
+    snprintf(alert, sizeof(alert), "E:1,%u", s_emergency_counter);
+    js_ble_notify(alert);
 }
 
-// Check the BLE state
-ble_state_t js_ble_get_state(void) {
-    if (ble_gap_adv_active()) return BLE_STATE_PAIRING;
+static void do_stop_emergency(void) {
+    if (!s_emergency_active) return;
+
+    s_emergency_active = false;
+    if (ble_gap_adv_active()) ble_gap_adv_stop();
+    s_adv_phase = ADV_PHASE_IDLE;
+    ESP_LOGI(TAG, "Emergency %u ended after %lld s", s_emergency_counter, (esp_timer_get_time() - s_emergency_start_us) / 1000000);
 
-    if (ble_conn_handle != BLE_HS_CONN_HANDLE_NONE) return BLE_STATE_CONNECTED;
+    char alert[16];
+    snprintf(alert, sizeof(alert), "E:0,%u", s_emergency_counter);
+    js_ble_notify(alert);
 
-    return BLE_STATE_DISCONNECTED;
+    // Back to the normal schedule if it was running before, unless the user stopped BLE since
+    if (s_adv_before_emergency && !s_stop_requested && conn_count() < JS_BLE_MAX_CONNECTIONS) start_advertising(false);
+    s_adv_before_emergency = false;
 }
 
 /* **************************** Connecting/Disconnecting *************************** */
-// Start BLE advertising with the custom service UUID
-static void start_advertising(void) {
-    struct ble_hs_adv_fields fields = {0};
-    fields.flags = BLE_HS_ADV_F_DISC_GEN | BLE_HS_ADV_F_BREDR_UNSUP; // Discoverable and BR/EDR unsupported (BLE only)
+/**
+ * Start a new advertising schedule: directed (if bonded), fast burst, slow, then timeout.
+ * In reconnect mode only bonded phones on the whitelist are allowed to connect, and only until the fast burst ends.
+ *
+ * Phones connect from resolvable private addresses, while the whitelist and the directed target hold identity
+ * addresses. NimBLE puts each bonded phone's IRK (distributed while pairing) in the controller resolving list,
+ * restoring them from NVS when the stack syncs, and the controller resolves the address before the whitelist check.
+ */
+static void start_advertising(bool reconnect) {
+    s_adv_schedule_start_us = esp_timer_get_time();
+    s_heap_at_adv_start = esp_get_free_heap_size();
+
+    // Load the bonded phones into the controller whitelist
+    ble_addr_t *peers = s_bonded_peers;
+    int num_peers = load_bonded_peers(peers, MAX_BONDED_PEERS);
+    s_num_bonded = num_peers;
+    s_whitelist_only = false;
+    if (num_peers > 0) {
+        // Device privacy mode: also accept a bonded phone that connects from its identity address
+        for (int i = 0; i < num_peers; i++) ble_gap_set_priv_mode(&peers[i], BLE_GAP_PRIVATE_MODE_DEVICE);
+
+        int rc = ble_gap_wl_set(peers, num_peers);
+        if (rc != 0)
+            ESP_LOGW(TAG, "Failed to set whitelist: %d", rc);
+        else
+            s_whitelist_only = reconnect;
+    }
 
-    // Set the device name in the advertising data
-    const char *name = ble_svc_gap_device_name(); // Set in js_ble_init -> ble_svc_gap_device_name_set("JiveStick");
-    fields.name = (uint8_t *)name;
-    fields.name_len = strlen(name);
-    fields.name_is_complete = 1;
+    // No known phones, go straight to discoverable advertising
+    if (num_peers == 0) {
+        start_adv_phase(ADV_PHASE_FAST);
+        return;
+    }
+
+    // Prefer the last phone that connected, otherwise the most recently bonded one
+    s_direct_peer = peers[num_peers - 1];
+    for (int i = 0; s_has_last_peer && i < num_peers; i++) {
+        if (ble_addr_cmp(&peers[i], &s_last_peer) == 0) {
+            s_direct_peer = s_last_peer;
+            break;
+        }
+    }
+
+    // That phone is already connected (advertising for a second phone), so skip straight to discoverable
+    struct ble_gap_conn_desc desc;
+    if (ble_gap_conn_find_by_addr(&s_direct_peer, &desc) == 0) {
+        start_adv_phase(ADV_PHASE_FAST);
+        return;
+    }
+    start_adv_phase(ADV_PHASE_DIRECTED);
+}
 
+// Start BLE advertising for one phase of the schedule
+static void start_adv_phase(adv_phase_t phase) {
     // Set the advertising fields to NimBLE
-    int rc = ble_gap_adv_set_fields(&fields);
+    int rc = set_adv_fields(NULL, 0);
     if (rc != 0) {
         ESP_LOGE(TAG, "Failed to set advertising fields: %d", rc);
         return;
@@ -136,14 +476,352 @@ static void start_advertising(void) {
     adv.conn_mode = BLE_GAP_CONN_MODE_UND; // connectable
     adv.disc_mode = BLE_GAP_DISC_MODE_GEN; // discoverable
 
-    // Start advertising with defined callback for GAP events
-    rc = ble_gap_adv_start(BLE_OWN_ADDR_PUBLIC, NULL, BLE_HS_FOREVER,
+    // Pick the interval and how long this phase runs for
+    int32_t duration_ms;
+    int64_t elapsed_ms = (esp_timer_get_time() - s_adv_schedule_start_us) / 1000;
+    int32_t remaining_ms = ADV_TIMEOUT_MS - (int32_t)elapsed_ms;
+    if (remaining_ms <= 0) {
+        // Post the timeout here rather than through on_adv_complete(), which would start the next phase and end up back here
+        JS_DLOGI(TAG, "Advertising timed out");
+        s_adv_phase = ADV_PHASE_IDLE;
+        js_events_post(JS_EVENT_BLE_ADV_TIMEOUT, NULL, 0);
+        return;
+    }
+
+    if (phase == ADV_PHASE_DIRECTED) {
+        adv.conn_mode = BLE_GAP_CONN_MODE_DIR; // connectable by the target phone only
+        adv.disc_mode = BLE_GAP_DISC_MODE_NON;
+        adv.high_duty_cycle = 1;
+        duration_ms = remaining_ms < ADV_DIRECTED_DURATION_MS ? remaining_ms : ADV_DIRECTED_DURATION_MS;
+    } else if (phase == ADV_PHASE_FAST) {
+        adv.itvl_min = BLE_GAP_ADV_ITVL_MS(ADV_FAST_ITVL_MIN_MS);
+        adv.itvl_max = BLE_GAP_ADV_ITVL_MS(ADV_FAST_ITVL_MAX_MS);
+        duration_ms = remaining_ms < ADV_FAST_DURATION_MS ? remaining_ms : ADV_FAST_DURATION_MS;
+    } else {
+        adv.itvl_min = BLE_GAP_ADV_ITVL_MS(ADV_SLOW_ITVL_MIN_MS);
+        adv.itvl_max = BLE_GAP_ADV_ITVL_MS(ADV_SLOW_ITVL_MAX_MS);
+        duration_ms = remaining_ms;
+    }
+
+    // Reconnect mode: the controller drops connection requests from phones not on the whitelist
+    adv.filter_policy = s_whitelist_only ? BLE_HCI_ADV_FILT_CONN : BLE_HCI_ADV_FILT_NONE;
+
+    // Start advertising with defined callback for GAP events (BLE_GAP_EVENT_ADV_COMPLETE fires when duration ends)
+    // Directed advertising goes to the phone's current private address, which the controller only derives from its IRK
+    // when our own address is an RPA type (the phone resolves ours with the IRK we gave it while pairing)
+    const ble_addr_t *direct_addr = phase == ADV_PHASE_DIRECTED ? &s_direct_peer : NULL;
+    uint8_t own_addr_type = phase == ADV_PHASE_DIRECTED ? BLE_OWN_ADDR_RPA_PUBLIC_DEFAULT : BLE_OWN_ADDR_PUBLIC;
+    rc = ble_gap_adv_start(own_addr_type, direct_addr, duration_ms,
                            &adv, gap_event_cb, NULL);
 
-    if (rc != 0)
+    if (rc != 0) {
         ESP_LOGE(TAG, "adv_start rc=%d", rc);
-    else
-        ESP_LOGI(TAG, "Advertising...");
+        s_adv_phase = ADV_PHASE_IDLE;
+        if (phase == ADV_PHASE_DIRECTED) start_adv_phase(ADV_PHASE_FAST); // Fall back to undirected
+        return;
+    }
+
+    s_adv_phase = phase;
+    static const char *phase_names[] = {"idle", "directed", "fast", "slow", "emergency"};
+    JS_DLOGI(TAG, "Advertising (%s%s) for %ld ms...", phase_names[phase], s_whitelist_only ? ", whitelist" : "", (long)duration_ms);
+}
+
+/**
+ * Emergency advertising for the current back-off step: 20ms for 30s, 100ms for 5 min, then 1s until stopped.
+ * Called again when each step ends and after connects/disconnects, so it picks up where the schedule is.
+ * Manufacturer data: [company id (LE)][frame type][flags][counter (LE)]
+ */
+static void start_emergency_adv(void) {
+    int64_t elapsed_ms = (esp_timer_get_time() - s_emergency_start_us) / 1000;
+    uint16_t itvl_ms;
+    int32_t duration_ms;
+    if (elapsed_ms < EMERGENCY_FAST_DURATION_MS) {
+        itvl_ms = EMERGENCY_FAST_ITVL_MS;
+        duration_ms = EMERGENCY_FAST_DURATION_MS - elapsed_ms;
+    } else if (elapsed_ms < EMERGENCY_FAST_DURATION_MS + EMERGENCY_MEDIUM_DURATION_MS) {
+        itvl_ms = EMERGENCY_MEDIUM_ITVL_MS;
+        duration_ms = EMERGENCY_FAST_DURATION_MS + EMERGENCY_MEDIUM_DURATION_MS - elapsed_ms;
+    } else {
+        itvl_ms = EMERGENCY_SLOW_ITVL_MS;
+        duration_ms = BLE_HS_FOREVER;
+    }
+
+    uint8_t mfg_data[] = {
+        MFG_COMPANY_ID & 0xFF, MFG_COMPANY_ID >> 8,
+        EMERGENCY_FRAME_TYPE,
+        EMERGENCY_FLAG_ACTIVE,
+        s_emergency_counter & 0xFF, s_emergency_counter >> 8};
+    int rc = set_adv_fields(mfg_data, sizeof(mfg_data));
+    if (rc != 0) {
+        ESP_LOGE(TAG, "Failed to set emergency advertising fields: %d", rc);
+        return;
+    }
+
+    // Connectable so a phone can connect for details, unless every connection is in use
+    struct ble_gap_adv_params adv = {0};
+    adv.conn_mode = conn_count() < JS_BLE_MAX_CONNECTIONS ? BLE_GAP_CONN_MODE_UND : BLE_GAP_CONN_MODE_NON;
+    adv.disc_mode = BLE_GAP_DISC_MODE_GEN;
+    adv.itvl_min = BLE_GAP_ADV_ITVL_MS(itvl_ms);
+    adv.itvl_max = BLE_GAP_ADV_ITVL_MS(itvl_ms);
+    adv.filter_policy = BLE_HCI_ADV_FILT_NONE;
+
+    rc = ble_gap_adv_start(BLE_OWN_ADDR_PUBLIC, NULL, duration_ms, &adv, gap_event_cb, NULL);
+    if (rc != 0) {
+        ESP_LOGE(TAG, "Emergency adv_start rc=%d", rc);
+        return;
+    }
+    s_adv_phase = ADV_PHASE_EMERGENCY;
+
+    // The first advertisement goes out as soon as advertising is enabled
+    if (s_emergency_press_us) {
+        JS_DLOGI(TAG, "Emergency advertising started %lu ms after the button press", (uint32_t)((esp_timer_get_time() - s_emergency_press_us) / 1000));
+        s_emergency_press_us = 0;
+    }
+    JS_DLOGI(TAG, "Emergency %u advertising every %u ms", s_emergency_counter, itvl_ms);
+}
+
+// Advertising data: flags, name and optional manufacturer data (emergency)
+static int set_adv_fields(const uint8_t *mfg_data, uint8_t mfg_data_len) {
+    struct ble_hs_adv_fields fields = {0};
+    fields.flags = BLE_HS_ADV_F_DISC_GEN | BLE_HS_ADV_F_BREDR_UNSUP; // Discoverable and BR/EDR unsupported (BLE only)
+
+    // Set the device name in the advertising data
+    const char *name = ble_svc_gap_device_name(); // Set in js_ble_init -> ble_svc_gap_device_name_set("JiveStick");
+    fields.name = (uint8_t *)name;
+    fields.name_len = strlen(name);
+    fields.name_is_complete = 1;
+
+    fields.mfg_data = mfg_data;
+    fields.mfg_data_len = mfg_data_len;
+    int rc = ble_gap_adv_set_fields(&fields);
+
+#if CONFIG_JS_BLE_STATUS_ADV
+    if (rc == 0) rc = set_status_rsp_fields();
+#endif
+    return rc;
+}
+
+#if CONFIG_JS_BLE_STATUS_ADV
+/**
+ * Status in the scan response, so a phone can show it without connecting.
+ * Manufacturer data: [company id (LE)][frame type][flags][battery mV (LE)][next alarm unix (LE u32, 0 = none)][fw major, minor, patch]
+ */
+static int set_status_rsp_fields(void) {
+    int battery_mv;
+    bool charging;
+    js_state_get_battery(&battery_mv, &charging);
+    uint32_t next_alarm = js_state_get_next_alarm();
+
+    // Firmware version from the app description ("1.2.3" or "v1.2.3", anything else is sent as 0.0.0)
+    static uint8_t fw[3];
+    static bool fw_parsed = false;
+    if (!fw_parsed) {
+        const char *ver = esp_app_get_description()->version;
+        if (ver[0] == 'v') ver++;
+        if (sscanf(ver, "%hhu.%hhu.%hhu", &fw[0], &fw[1], &fw[2]) != 3) memset(fw, 0, sizeof(fw));
+        fw_parsed = true;
+    }
+
+    uint8_t mfg_data[] = {
+        MFG_COMPANY_ID & 0xFF, MFG_COMPANY_ID >> 8,
+        STATUS_FRAME_TYPE,
+        charging ? STATUS_FLAG_CHARGING : 0,
+        battery_mv & 0xFF, (battery_mv >> 8) & 0xFF,
+        next_alarm & 0xFF, (next_alarm >> 8) & 0xFF, (next_alarm >> 16) & 0xFF, next_alarm >> 24,
+        fw[0], fw[1], fw[2]};
+
+    struct ble_hs_adv_fields rsp = {0};
+    rsp.mfg_data = mfg_data;
+    rsp.mfg_data_len = sizeof(mfg_data);
+    return ble_gap_adv_rsp_set_fields(&rsp);
+}
+#endif
+
+// Refresh the status in the scan response after a state change (takes effect on the next scan while advertising)
+void js_ble_update_status_adv(void) {
+#if CONFIG_JS_BLE_STATUS_ADV
+    if (!_stack_is_ready) return;
+    int rc = set_status_rsp_fields();
+    if (rc != 0) ESP_LOGW(TAG, "Failed to update status scan response: %d", rc);
+#endif
+}
+
+// Advertising phase ended without a connection. Fall back to slow or time out.
+static void on_adv_complete(int reason) {
+    // Only the duration expiring moves the schedule on (connections and stops are handled elsewhere)
+    if (reason != BLE_HS_ETIMEOUT) return;
+
+    // The phase that ended is idle until the next one starts, so nothing that fails on the way can step it again
+    adv_phase_t ended = s_adv_phase;
+    s_adv_phase = ADV_PHASE_IDLE;
+
+    // Next emergency back-off step
+    if (ended == ADV_PHASE_EMERGENCY) {
+        if (s_emergency_active) start_emergency_adv();
+        return;
+    }
+
+    if (ended == ADV_PHASE_DIRECTED) {
+        start_adv_phase(ADV_PHASE_FAST);
+        return;
+    }
+
+    // The bonded phone didn't come back in time, let new phones in for the rest of the schedule
+    if (ended == ADV_PHASE_FAST) {
+        s_whitelist_only = false;
+        start_adv_phase(ADV_PHASE_SLOW);
+        return;
+    }
+
+    JS_DLOGI(TAG, "Advertising timed out");
+    js_events_post(JS_EVENT_BLE_ADV_TIMEOUT, NULL, 0);
+}
+
+/* ********************************* Bonding Helpers ******************************* */
+// Read the identity addresses of all bonded phones from the NVS store
+static int load_bonded_peers(ble_addr_t *peers, int max_peers) {
+    int num_peers = 0;
+    int rc = ble_store_util_bonded_peers(peers, &num_peers, max_peers);
+    if (rc != 0) {
+        ESP_LOGW(TAG, "Failed to read bonded peers: %d", rc);
+        return 0;
+    }
+    return num_peers;
+}
+
+/**
+ * Check if this phone was bonded when the advertising schedule started (a phone that pairs on this connection isn't).
+ * addr must be the identity address, which is only known once the link is encrypted.
+ */
+static bool is_bonded_peer(const ble_addr_t *addr) {
+    for (int i = 0; i < s_num_bonded; i++) {
+        if (ble_addr_cmp(&s_bonded_peers[i], addr) == 0) return true;
+    }
+    return false;
+}
+
+// Log the time from the start of advertising to the connection, split by bonded and new phones
+static void record_connect_latency(int64_t latency_ms, bool bonded) {
+    connect_stats_t *stats = &s_connect_stats[bonded ? 1 : 0];
+
+    if (stats->count == 0 || latency_ms < stats->min_ms) stats->min_ms = latency_ms;
+    if (latency_ms > stats->max_ms) stats->max_ms = latency_ms;
+    stats->total_ms += latency_ms;
+    stats->count++;
+
+    JS_DLOGI(TAG, "Connected %s phone in %lu ms (avg %lu, min %lu, max %lu over %lu connections)",
+             bonded ? "bonded" : "new", (uint32_t)latency_ms, (uint32_t)(stats->total_ms / stats->count),
+             (uint32_t)stats->min_ms, (uint32_t)stats->max_ms, (uint32_t)stats->count);
+}
+
+/* ******************************* Connection Tracking ***************************** */
+// Byte counters, called from the GATT callbacks and notify paths
+void js_ble_conn_add_rx(uint16_t conn_handle, size_t len) {
+    taskENTER_CRITICAL(&s_conn_lock);
+    conn_info_t *conn = conn_find(conn_handle);
+    if (conn) conn->rx_bytes += len;
+    taskEXIT_CRITICAL(&s_conn_lock);
+}
+
+void js_ble_conn_add_tx(uint16_t conn_handle, size_t len) {
+    taskENTER_CRITICAL(&s_conn_lock);
+    conn_info_t *conn = conn_find(conn_handle);
+    if (conn) conn->tx_bytes += len;
+    taskEXIT_CRITICAL(&s_conn_lock);
+}
+
+/**
+ * Take a slot for a new connection and log what it cost in RAM.
+ * Most of the per-connection memory is reserved up front by NimBLE (CONFIG_BT_NIMBLE_MAX_CONNECTIONS),
+ * so this is the extra heap used at runtime (security, GATT state, mbufs).
+ */
+static void conn_add(uint16_t conn_handle) {
+    uint32_t heap_now = esp_get_free_heap_size();
+    int32_t heap_cost = s_heap_at_adv_start ? (int32_t)(s_heap_at_adv_start - heap_now) : 0;
+
+    taskENTER_CRITICAL(&s_conn_lock);
+    conn_info_t *conn = conn_find(BLE_HS_CONN_HANDLE_NONE);
+    if (conn) {
+        *conn = (conn_info_t){
+            .handle = conn_handle,
+            .connected_us = esp_timer_get_time(),
+            .heap_cost = heap_cost,
+            .heap_at_connect = heap_now,
+            .adv_latency_ms = -1,
+        };
+    }
+    taskEXIT_CRITICAL(&s_conn_lock);
+
+    if (!conn) {
+        ESP_LOGE(TAG, "No free slot for connection %u", conn_handle); // NimBLE limits connections to the same number
+        return;
+    }
+    ESP_LOGI(TAG, "Connection %u: %d/%d in use, ~%ld bytes heap (%lu free)", conn_handle, conn_count(),
+             JS_BLE_MAX_CONNECTIONS, (long)heap_cost, (unsigned long)heap_now);
+}
+
+// Free the slot and report the connection's throughput
+static void conn_remove(uint16_t conn_handle) {
+    conn_info_t info = {0};
+    taskENTER_CRITICAL(&s_conn_lock);
+    conn_info_t *conn = conn_find(conn_handle);
+    if (conn) {
+        info = *conn;
+        conn->handle = BLE_HS_CONN_HANDLE_NONE;
+    }
+    taskEXIT_CRITICAL(&s_conn_lock);
+    if (!conn) return;
+
+    // Disconnected without encrypting, so it wasn't a bonded phone
+    if (info.adv_latency_ms >= 0) record_connect_latency(info.adv_latency_ms, false);
+
+    int64_t duration_ms = (esp_timer_get_time() - info.connected_us) / 1000;
+    if (duration_ms <= 0) duration_ms = 1;
+    ESP_LOGI(TAG, "Connection %u: %lld s, rx %lu bytes (%lld B/s), tx %lu bytes (%lld B/s), heap %+ld bytes since connect",
+             conn_handle, duration_ms / 1000, (unsigned long)info.rx_bytes, info.rx_bytes * 1000LL / duration_ms,
+             (unsigned long)info.tx_bytes, info.tx_bytes * 1000LL / duration_ms,
+             (long)((int64_t)esp_get_free_heap_size() - info.heap_at_connect));
+}
+
+// Take the pending advertising-to-connect latency (-1 if there's none, or it was already recorded)
+static int64_t conn_take_adv_latency(uint16_t conn_handle) {
+    int64_t latency_ms = -1;
+    taskENTER_CRITICAL(&s_conn_lock);
+    conn_info_t *conn = conn_find(conn_handle);
+    if (conn) {
+        latency_ms = conn->adv_latency_ms;
+        conn->adv_latency_ms = -1;
+    }
+    taskEXIT_CRITICAL(&s_conn_lock);
+    return latency_ms;
+}
+
+static int conn_count(void) {
+    int count = 0;
+    for (int i = 0; i < JS_BLE_MAX_CONNECTIONS; i++) {
+        if (s_conns[i].handle != BLE_HS_CONN_HANDLE_NONE) count++;
+    }
+    return count;
+}
+
+// Find a connection slot (BLE_HS_CONN_HANDLE_NONE finds a free one)
+static conn_info_t *conn_find(uint16_t conn_handle) {
+    for (int i = 0; i < JS_BLE_MAX_CONNECTIONS; i++) {
+        if (s_conns[i].handle == conn_handle) return &s_conns[i];
+    }
+    return NULL;
+}
+
+// Publish the link state to js_state (LEDs and anything else subscribed react to it). Called after every
+// connect, disconnect and advertising start or stop, a set that doesn't change it notifies nobody.
+static void publish_ble_state(void) {
+    ble_state_t state = BLE_STATE_DISCONNECTED;
+    if (ble_gap_adv_active()) {
+        state = BLE_STATE_PAIRING;
+    } else if (conn_count() > 0) {
+        state = BLE_STATE_CONNECTED;
+    }
+    js_state_set_ble(state);
 }
 
 /* ******************************* Callback Handlers ******************************* */
@@ -152,20 +830,106 @@ static int gap_event_cb(struct ble_gap_event *event, void *arg) {
 
     case BLE_GAP_EVENT_CONNECT:
         if (event->connect.status == 0) {
-            ble_conn_handle = event->connect.conn_handle;
-            js_ble_gatt_set_conn_handle(ble_conn_handle); // Pass the connection handle to js_ble_gatt.c so it can use it for notifications
-            ESP_LOGI(TAG, "Connected");
+            uint16_t conn_handle = event->connect.conn_handle;
+            JS_DLOGI(TAG, "Connected");
+            conn_add(conn_handle);
+
+            // Discovery-to-connected latency, reported once encryption tells bonded and new phones apart
+            if (s_adv_phase != ADV_PHASE_IDLE && s_adv_phase != ADV_PHASE_EMERGENCY) {
+                int64_t latency_ms = (esp_timer_get_time() - s_adv_schedule_start_us) / 1000;
+                taskENTER_CRITICAL(&s_conn_lock);
+                conn_info_t *conn = conn_find(conn_handle);
+                if (conn) conn->adv_latency_ms = latency_ms;
+                taskEXIT_CRITICAL(&s_conn_lock);
+            }
+            s_adv_phase = ADV_PHASE_IDLE;
+
+            // Ask the phone to encrypt (restores the bond, or pairs and bonds a new phone)
+            ble_gap_security_initiate(conn_handle);
+
+            // Connecting stopped the advertising, keep the emergency alert going for other phones
+            if (s_emergency_active) start_emergency_adv();
+        } else if (s_emergency_active) {
+            ESP_LOGW(TAG, "Connect failed; restart emergency adv");
+            start_emergency_adv();
         } else {
-            ble_conn_handle = BLE_HS_CONN_HANDLE_NONE;
             ESP_LOGW(TAG, "Connect failed; restart adv");
-            start_advertising();
+            start_adv_phase(ADV_PHASE_FAST); // Keep the original schedule start so the timeout still applies
         }
+        publish_ble_state();
         return 0;
 
     case BLE_GAP_EVENT_DISCONNECT:
-        ESP_LOGI(TAG, "Disconnected");
-        ble_conn_handle = BLE_HS_CONN_HANDLE_NONE;
-        js_ble_gatt_set_conn_handle(ble_conn_handle); // Pass the connection handle to js_ble_gatt.c so it can use it for notifications
+        JS_DLOGI(TAG, "Disconnected (reason=0x%x)", event->disconnect.reason);
+        conn_remove(event->disconnect.conn.conn_handle);
+        js_ble_gatt_on_disconnect(event->disconnect.conn.conn_handle);
+#if CONFIG_JS_BLE_THROUGHPUT_TEST
+        js_ble_test_on_disconnect(event->disconnect.conn.conn_handle);
+#endif
+
+        // A connection slot is free again, so emergency advertising can go back to connectable
+        if (s_emergency_active) {
+            if (ble_gap_adv_active()) ble_gap_adv_stop();
+            start_emergency_adv();
+            publish_ble_state();
+            return 0;
+        }
+
+        // Restart advertising so the phone can reconnect (unless the user stopped BLE or we're already advertising)
+        // A bonded phone gets reconnect mode (whitelist only) so nobody else grabs the slot
+        if (!s_stop_requested && !ble_gap_adv_active()) {
+            JS_DLOGI(TAG, "Restarting advertising after disconnect");
+            start_advertising(event->disconnect.conn.sec_state.bonded);
+        }
+        publish_ble_state();
+        return 0;
+
+    case BLE_GAP_EVENT_ENC_CHANGE:
+        if (event->enc_change.status == 0) {
+            struct ble_gap_conn_desc desc;
+            if (ble_gap_conn_find(event->enc_change.conn_handle, &desc) == 0) {
+                // peer_id_addr is the identity address now (resolved by the controller, or distributed while pairing)
+                int64_t latency_ms = conn_take_adv_latency(event->enc_change.conn_handle);
+                if (latency_ms >= 0) record_connect_latency(latency_ms, is_bonded_peer(&desc.peer_id_addr));
+                if (desc.sec_state.bonded) {
+                    s_last_peer = desc.peer_id_addr; // Remember for directed advertising
+                    s_has_last_peer = true;
+                }
+            }
+            JS_DLOGI(TAG, "Encryption enabled");
+        } else {
+            ESP_LOGW(TAG, "Encryption failed: %d", event->enc_change.status);
+        }
+        return 0;
+
+    case BLE_GAP_EVENT_MTU:
+        JS_DLOGI(TAG, "MTU updated to %d", event->mtu.value);
+        return 0;
+
+    case BLE_GAP_EVENT_SUBSCRIBE:
+        js_ble_gatt_on_subscribe(event->subscribe.conn_handle, event->subscribe.attr_handle, event->subscribe.cur_notify);
+        js_ble_telemetry_on_subscribe(event->subscribe.conn_handle, event->subscribe.attr_handle, event->subscribe.cur_notify);
+        js_ble_log_on_subscribe(event->subscribe.conn_handle, event->subscribe.attr_handle, event->subscribe.cur_notify);
+        return 0;
+
+    case BLE_GAP_EVENT_REPEAT_PAIRING: {
+        // The phone lost its keys (e.g. "forget device"), so drop ours and pair again
+        struct ble_gap_conn_desc desc;
+        if (ble_gap_conn_find(event->repeat_pairing.conn_handle, &desc) == 0) {
+            ble_store_util_delete_peer(&desc.peer_id_addr);
+        }
+        return BLE_GAP_REPEAT_PAIRING_RETRY;
+    }
+
+#if CONFIG_JS_BLE_THROUGHPUT_TEST
+    case BLE_GAP_EVENT_NOTIFY_TX:
+        js_ble_test_on_notify_tx(event->notify_tx.conn_handle);
+        return 0;
+#endif
+
+    case BLE_GAP_EVENT_ADV_COMPLETE:
+        on_adv_complete(event->adv_complete.reason);
+        publish_ble_state();
         return 0;
 
     default:
@@ -173,6 +937,11 @@ static int gap_event_cb(struct ble_gap_event *event, void *arg) {
     }
 }
 
+// For code shared with the host task that would otherwise wait (e.g. for notify buffers)
+bool js_ble_in_host_task(void) {
+    return s_host_task != NULL && xTaskGetCurrentTaskHandle() == s_host_task;
+}
+
 /* ***************************** Local Set-Up Functions **************************** */
 // On BLE stack ready, set _stack_is_ready to true
 static void on_stack_ready(void) {
@@ -183,6 +952,7 @@ static void on_stack_ready(void) {
 
 // NimBLE task that runs the BLE event loop
 static void ble_host_task(void *param) {
+    s_host_task = xTaskGetCurrentTaskHandle();
     nimble_port_run();             // NimBLE event loop (blocks)
     nimble_port_freertos_deinit(); // cleanup if it ever exits
 }
\ No newline at end of file
@@ -0,0 +1,184 @@
+/**
+ * BLE audio file upload
+ * Streams a .wav file into /fs using the bulk transfer engine (js_ble_xfer.c) with per-chunk CRC.
+ * Data goes to "<name>.tmp" and is only renamed to "<name>" once the whole-file CRC matches,
+ * so a dropped link never leaves a half written track in the list.
+ * The BEGIN argument is the file name, e.g. "Lullaby_120s_16k_adpcm.wav".
+ */
+
+// Self Include
+#include "js_ble_files.h"
+
+// Library Includes
+#include "esp_littlefs.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "host/ble_hs.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// Local Includes
+#include "js_audio.h"
+#include "js_ble_xfer.h"
+#include "js_state.h"
+
+// Defines
+#define TAG "js_ble_files"
+#define FS_BASE_PATH "/fs"
+#define FS_PARTITION "storage"
+#define MAX_NAME_LEN 32
+#define WRITE_BUFFER_SIZE 4096 // One LittleFS block, so flash writes happen in whole blocks
+#define FREE_SPACE_MARGIN (8 * 1024) // Leave room for LittleFS metadata
+
+// Service and Characteristics addresses (UUIDs)
+static const ble_uuid128_t FILES_SVC_UUID = BLE_UUID128_INIT(0x9E, 0x81, 0x20, 0x01, 0x22, 0xE5, 0xA9, 0xE0, 0x93, 0xF3, 0xA3, 0xB5, 0x20, 0x00, 0x40, 0x6E);  // 6E400020-B5A3-F393-E0A9-E5220120819E
+static const ble_uuid128_t FILES_CTRL_UUID = BLE_UUID128_INIT(0x9E, 0x81, 0x20, 0x01, 0x22, 0xE5, 0xA9, 0xE0, 0x93, 0xF3, 0xA3, 0xB5, 0x21, 0x00, 0x40, 0x6E); // 6E400021-B5A3-F393-E0A9-E5220120819E
+static const ble_uuid128_t FILES_DATA_UUID = BLE_UUID128_INIT(0x9E, 0x81, 0x20, 0x01, 0x22, 0xE5, 0xA9, 0xE0, 0x93, 0xF3, 0xA3, 0xB5, 0x22, 0x00, 0x40, 0x6E); // 6E400022-B5A3-F393-E0A9-E5220120819E
+
+// Forward Declarations
+static int files_ctrl_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+static int files_data_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+static esp_err_t files_begin(uint32_t size, const uint8_t *arg, size_t arg_len);
+static esp_err_t files_write(const uint8_t *data, size_t len);
+static esp_err_t files_finish(void);
+static void files_abort(void);
+static bool is_valid_name(const char *name);
+static uint16_t s_ctrl_val_handle;
+static FILE *s_file = NULL;
+static char s_final_path[sizeof(FS_BASE_PATH) + MAX_NAME_LEN + 1];
+static char s_tmp_path[sizeof(s_final_path) + 4];
+static char s_write_buffer[WRITE_BUFFER_SIZE];
+
+// Sink for the transfer engine
+static const js_ble_xfer_sink_t files_sink = {
+    .name = "files",
+    .chunk_crc = true,
+    .begin = files_begin,
+    .write = files_write,
+    .finish = files_finish,
+    .abort = files_abort,
+};
+
+/* ****************** Service / Characteristics Definitions ***************** */
+static const struct ble_gatt_chr_def files_chrs[] = {
+    {
+        .uuid = (const ble_uuid_t *)&FILES_CTRL_UUID,
+        .access_cb = files_ctrl_callback,
+        .val_handle = &s_ctrl_val_handle,
+        .flags = BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_NOTIFY,
+    },
+    {
+        .uuid = (const ble_uuid_t *)&FILES_DATA_UUID,
+        .access_cb = files_data_callback,
+        .flags = BLE_GATT_CHR_F_WRITE_NO_RSP,
+    },
+    {0}};
+
+static const struct ble_gatt_svc_def files_svcs[] = {
+    {
+        .type = BLE_GATT_SVC_TYPE_PRIMARY,
+        .uuid = (const ble_uuid_t *)&FILES_SVC_UUID,
+        .characteristics = files_chrs,
+    },
+    {0}};
+
+// Passing back to js_ble.c for registration
+const struct ble_gatt_svc_def *js_ble_files_get_svcs(void) {
+    return files_svcs;
+}
+
+/* ************************** Callback Functions ************************** */
+static int files_ctrl_callback(uint16_t conn_handle, uint16_t attr_handle,
+                               struct ble_gatt_access_ctxt *ctxt, void *arg) {
+    if (ctxt->op != BLE_GATT_ACCESS_OP_WRITE_CHR) return BLE_ATT_ERR_READ_NOT_PERMITTED;
+    return js_ble_xfer_control(&files_sink, conn_handle, s_ctrl_val_handle, ctxt->om);
+}
+
+static int files_data_callback(uint16_t conn_handle, uint16_t attr_handle,
+                               struct ble_gatt_access_ctxt *ctxt, void *arg) {
+    if (ctxt->op != BLE_GATT_ACCESS_OP_WRITE_CHR) return BLE_ATT_ERR_READ_NOT_PERMITTED;
+    return js_ble_xfer_data(&files_sink, conn_handle, ctxt->om);
+}
+
+/* ************************** Files Sink ************************** */
+// Check the name and free space, then open the temp file
+static esp_err_t files_begin(uint32_t size, const uint8_t *arg, size_t arg_len) {
+    char name[MAX_NAME_LEN + 1];
+    if (arg_len == 0 || arg_len > MAX_NAME_LEN) return ESP_ERR_INVALID_ARG;
+    memcpy(name, arg, arg_len);
+    name[arg_len] = '\0';
+    if (!is_valid_name(name)) return ESP_ERR_INVALID_ARG;
+
+    size_t total = 0, used = 0;
+    esp_err_t err = esp_littlefs_info(FS_PARTITION, &total, &used);
+    if (err != ESP_OK) return err;
+    if ((size_t)size + FREE_SPACE_MARGIN > total - used) {
+        ESP_LOGE(TAG, "Not enough space for %lu bytes (%u free)", (unsigned long)size, (unsigned)(total - used));
+        return ESP_ERR_NO_MEM;
+    }
+
+    snprintf(s_final_path, sizeof(s_final_path), FS_BASE_PATH "/%s", name);
+    snprintf(s_tmp_path, sizeof(s_tmp_path), "%s.tmp", s_final_path);
+
+    // Only called for a new transfer (a resume keeps the open file), so start from empty
+    s_file = fopen(s_tmp_path, "wb");
+    if (!s_file) return ESP_FAIL;
+    setvbuf(s_file, s_write_buffer, _IOFBF, sizeof(s_write_buffer));
+
+    ESP_LOGI(TAG, "Writing %lu bytes to %s", (unsigned long)size, s_tmp_path);
+    return ESP_OK;
+}
+
+static esp_err_t files_write(const uint8_t *data, size_t len) {
+    if (!s_file) return ESP_ERR_INVALID_STATE;
+    if (fwrite(data, 1, len, s_file) != len) return ESP_FAIL;
+
+    // Give the audio task the flash and CPU between chunks while something is playing
+    if (js_state_get_audio() != JS_AUDIO_IDLE) vTaskDelay(1);
+    return ESP_OK;
+}
+
+// Flush, then swap the finished file into place and reload the track list
+static esp_err_t files_finish(void) {
+    if (!s_file) return ESP_ERR_INVALID_STATE;
+    bool ok = fflush(s_file) == 0 && fsync(fileno(s_file)) == 0;
+    ok = (fclose(s_file) == 0) && ok;
+    s_file = NULL;
+    if (!ok) {
+        remove(s_tmp_path);
+        return ESP_FAIL;
+    }
+
+    // LittleFS replaces an existing track in the same rename, so there's never a moment without it
+    if (rename(s_tmp_path, s_final_path) != 0) {
+        remove(s_tmp_path);
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "Saved %s", s_final_path);
+    js_audio_refresh_tracks();
+    return ESP_OK;
+}
+
+static void files_abort(void) {
+    if (s_file) {
+        fclose(s_file);
+        s_file = NULL;
+    }
+    remove(s_tmp_path);
+}
+
+/* ************************** Helper Functions ************************** */
+// Plain .wav names in the root only, no paths and not the emergency track
+static bool is_valid_name(const char *name) {
+    size_t len = strlen(name);
+    if (len < 5 || strcmp(name + len - 4, ".wav") != 0) return false;
+    if (strncmp(name, "help_", 5) == 0) return false;
+    if (name[0] == '.') return false;
+    for (size_t i = 0; i < len; i++) {
+        if (name[i] == '/' || name[i] == '\\' || name[i] < 0x20) return false;
+    }
+    return true;
+}
@@ -1,28 +1,75 @@
 // Self Include
+#include "js_ble.h"
 #include "js_ble_gatt.h"
+#include "js_ble_log.h"
+#include "js_ble_telemetry.h"
 
 // Libraray includes
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "host/ble_gatt.h"
 #include "host/ble_hs.h"
 #include "host/util/util.h"
+#include "js_cmd.h"
 #include "js_events.h"
+#include "js_state.h"
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 // Defines
 #define TAG "js_ble_gatt"
+#define SEGMENT_MORE '+'                      // First byte of every segment except the last (writes and notifications)
+#define SEGMENT_TIMEOUT_US (5 * 1000 * 1000) // Drop a partly received command after this long without the next segment
+#define NOTIFY_RETRIES 20                    // Waits for a free mbuf while sending a long response in segments (not on the host task)
 
 // Service and Characteristics addresses (UUIDs)
 static const ble_uuid128_t SVC_UUID = BLE_UUID128_INIT(0x9E, 0x81, 0x20, 0x01, 0x22, 0xE5, 0xA9, 0xE0, 0x93, 0xF3, 0xA3, 0xB5, 0x01, 0x00, 0x40, 0x6E);        // 6E400001-B5A3-F393-E0A9-E5220120819E
 static const ble_uuid128_t CHR_WRITE_UUID = BLE_UUID128_INIT(0x9E, 0x81, 0x20, 0x01, 0x22, 0xE5, 0xA9, 0xE0, 0x93, 0xF3, 0xA3, 0xB5, 0x02, 0x00, 0x40, 0x6E);  // 6E400002-B5A3-F393-E0A9-E5220120819E
 static const ble_uuid128_t CHR_NOTIFY_UUID = BLE_UUID128_INIT(0x9E, 0x81, 0x20, 0x01, 0x22, 0xE5, 0xA9, 0xE0, 0x93, 0xF3, 0xA3, 0xB5, 0x03, 0x00, 0x40, 0x6E); // 6E400003-B5A3-F393-E0A9-E5220120819E
+// Readable state characteristics (served from js_state, no event loop involved)
+static const ble_uuid128_t CHR_BATTERY_UUID = BLE_UUID128_INIT(0x9E, 0x81, 0x20, 0x01, 0x22, 0xE5, 0xA9, 0xE0, 0x93, 0xF3, 0xA3, 0xB5, 0x04, 0x00, 0x40, 0x6E);  // 6E400004-B5A3-F393-E0A9-E5220120819E
+static const ble_uuid128_t CHR_TIME_UUID = BLE_UUID128_INIT(0x9E, 0x81, 0x20, 0x01, 0x22, 0xE5, 0xA9, 0xE0, 0x93, 0xF3, 0xA3, 0xB5, 0x05, 0x00, 0x40, 0x6E);     // 6E400005-B5A3-F393-E0A9-E5220120819E
+static const ble_uuid128_t CHR_TIMEZONE_UUID = BLE_UUID128_INIT(0x9E, 0x81, 0x20, 0x01, 0x22, 0xE5, 0xA9, 0xE0, 0x93, 0xF3, 0xA3, 0xB5, 0x06, 0x00, 0x40, 0x6E); // 6E400006-B5A3-F393-E0A9-E5220120819E
+static const ble_uuid128_t CHR_ALARMS_UUID = BLE_UUID128_INIT(0x9E, 0x81, 0x20, 0x01, 0x22, 0xE5, 0xA9, 0xE0, 0x93, 0xF3, 0xA3, 0xB5, 0x07, 0x00, 0x40, 0x6E);   // 6E400007-B5A3-F393-E0A9-E5220120819E
+static const ble_uuid128_t CHR_TELEMETRY_UUID = BLE_UUID128_INIT(0x9E, 0x81, 0x20, 0x01, 0x22, 0xE5, 0xA9, 0xE0, 0x93, 0xF3, 0xA3, 0xB5, 0x08, 0x00, 0x40, 0x6E); // 6E400008-B5A3-F393-E0A9-E5220120819E
+static const ble_uuid128_t CHR_LOG_UUID = BLE_UUID128_INIT(0x9E, 0x81, 0x20, 0x01, 0x22, 0xE5, 0xA9, 0xE0, 0x93, 0xF3, 0xA3, 0xB5, 0x09, 0x00, 0x40, 0x6E);       // 6E400009-B5A3-F393-E0A9-E5220120819E
+
+// State characteristic IDs (passed as the access callback arg)
+typedef enum {
+    STATE_CHR_BATTERY,
+    STATE_CHR_TIME,
+    STATE_CHR_TIMEZONE,
+    STATE_CHR_ALARMS,
+} state_chr_t;
+
+// Command reassembly for one connection (host task only, so no lock)
+typedef struct {
+    uint16_t conn_handle;
+    uint16_t len;
+    int64_t last_us;
+    char buf[JS_CMD_MAX_LEN];
+} cmd_rx_t;
 
 // Forward Declarations
 static int ble_write_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
 static int ble_notify_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+static int ble_state_read_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+static void on_state_changed(js_state_field_t field, void *arg);
+static int get_notify_subscribers(uint16_t *conns);
+static cmd_rx_t *get_cmd_rx(uint16_t conn_handle);
+static void dispatch_command(uint16_t conn_handle, const char *line);
+static esp_err_t notify_segment(uint16_t conn_handle, const char *data, size_t len, bool more);
 static uint16_t s_notify_val_handle;
-static uint16_t ble_conn_handle = BLE_HS_CONN_HANDLE_NONE; // Connection handle passed from js_ble.c for use in notifications
+static uint16_t s_battery_val_handle;
+static uint16_t s_timezone_val_handle;
+static uint16_t s_alarms_val_handle;
+static uint16_t s_notify_subs[JS_BLE_MAX_CONNECTIONS]; // Phones subscribed to the notify characteristic
+static portMUX_TYPE s_subs_lock = portMUX_INITIALIZER_UNLOCKED;
+static cmd_rx_t s_cmd_rx[JS_BLE_MAX_CONNECTIONS];
 
 /* ****************** Service / Characteristics Definitions ***************** */
 // Custom characteristics definition
@@ -38,6 +85,45 @@ static const struct ble_gatt_chr_def gatt_chrs[] = {
         .val_handle = &s_notify_val_handle, // Handle for sending notifications back to the client
         .flags = BLE_GATT_CHR_F_NOTIFY,
     },
+    {
+        .uuid = (const ble_uuid_t *)&CHR_BATTERY_UUID, // uint16 mV (LE) + uint8 charging
+        .access_cb = ble_state_read_callback,
+        .arg = (void *)STATE_CHR_BATTERY,
+        .val_handle = &s_battery_val_handle,
+        .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_NOTIFY,
+    },
+    {
+        .uuid = (const ble_uuid_t *)&CHR_TIME_UUID, // uint64 unix seconds (LE) from the system clock
+        .access_cb = ble_state_read_callback,
+        .arg = (void *)STATE_CHR_TIME,
+        .flags = BLE_GATT_CHR_F_READ,
+    },
+    {
+        .uuid = (const ble_uuid_t *)&CHR_TIMEZONE_UUID, // POSIX TZ string
+        .access_cb = ble_state_read_callback,
+        .arg = (void *)STATE_CHR_TIMEZONE,
+        .val_handle = &s_timezone_val_handle,
+        .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_NOTIFY,
+    },
+    {
+        .uuid = (const ble_uuid_t *)&CHR_ALARMS_UUID, // Alarms string (same format as the `a` command)
+        .access_cb = ble_state_read_callback,
+        .arg = (void *)STATE_CHR_ALARMS,
+        .val_handle = &s_alarms_val_handle,
+        .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_NOTIFY,
+    },
+    {
+        .uuid = (const ble_uuid_t *)&CHR_TELEMETRY_UUID, // Binary snapshots (see js_ble_telemetry.c)
+        .access_cb = js_ble_telemetry_access_cb,
+        .val_handle = &js_ble_telemetry_val_handle,
+        .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_NOTIFY,
+    },
+    {
+        .uuid = (const ble_uuid_t *)&CHR_LOG_UUID, // Log stream (see js_ble_log.c)
+        .access_cb = js_ble_log_access_cb,
+        .val_handle = &js_ble_log_val_handle,
+        .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_NOTIFY,
+    },
     {0}};
 
 // Applying the above characteristics to the service
@@ -51,36 +137,88 @@ static const struct ble_gatt_svc_def gatt_svcs[] = {
 
 // Passing back to js_ble.c for registration
 const struct ble_gatt_svc_def *js_ble_get_gatt_svcs(void) {
+    // Send notifications on the state characteristics when the cached values change
+    uint32_t fields = JS_STATE_BIT(JS_STATE_BATTERY) | JS_STATE_BIT(JS_STATE_TIMEZONE) | JS_STATE_BIT(JS_STATE_ALARMS) |
+                      JS_STATE_BIT(JS_STATE_AUDIO) | JS_STATE_BIT(JS_STATE_NEXT_ALARM);
+    js_state_subscribe(fields, on_state_changed, NULL);
+
+    // 0 is a valid connection handle, so mark the subscriber slots empty
+    for (int i = 0; i < JS_BLE_MAX_CONNECTIONS; i++) {
+        s_notify_subs[i] = BLE_HS_CONN_HANDLE_NONE;
+        s_cmd_rx[i].conn_handle = BLE_HS_CONN_HANDLE_NONE;
+    }
     return gatt_svcs;
 }
 
-// Getting the notify handle from js_ble.c
-void js_ble_gatt_set_conn_handle(uint16_t conn_handle) {
-    ble_conn_handle = conn_handle;
+// Track which phones want notify characteristic updates (called from the GAP event handler in js_ble.c)
+// NimBLE also sends an unsubscribe when a phone disconnects, so the list can't go stale
+void js_ble_gatt_on_subscribe(uint16_t conn_handle, uint16_t attr_handle, bool notify) {
+    if (attr_handle != s_notify_val_handle) return;
+
+    taskENTER_CRITICAL(&s_subs_lock);
+    for (int i = 0; i < JS_BLE_MAX_CONNECTIONS; i++) {
+        if (s_notify_subs[i] == conn_handle) s_notify_subs[i] = BLE_HS_CONN_HANDLE_NONE;
+    }
+    for (int i = 0; notify && i < JS_BLE_MAX_CONNECTIONS; i++) {
+        if (s_notify_subs[i] == BLE_HS_CONN_HANDLE_NONE) {
+            s_notify_subs[i] = conn_handle;
+            break;
+        }
+    }
+    taskEXIT_CRITICAL(&s_subs_lock);
+}
+
+// Drop any partly received command and the connection's admission slot (called from the GAP event handler in js_ble.c)
+void js_ble_gatt_on_disconnect(uint16_t conn_handle) {
+    js_events_release_source(conn_handle);
+    for (int i = 0; i < JS_BLE_MAX_CONNECTIONS; i++) {
+        if (s_cmd_rx[i].conn_handle == conn_handle) {
+            s_cmd_rx[i].conn_handle = BLE_HS_CONN_HANDLE_NONE;
+            s_cmd_rx[i].len = 0;
+        }
+    }
 }
 
 /* ************************** Global Notify Function ************************** */
 
+// Send to every subscribed phone (unsolicited updates)
 esp_err_t js_ble_notify(const char *s) {
-    ESP_LOGI(TAG, "js_ble_notify called with: %s", s);
+    uint16_t conns[JS_BLE_MAX_CONNECTIONS];
+    int count = get_notify_subscribers(conns);
+    if (count == 0) return ESP_ERR_INVALID_STATE;
+
+    esp_err_t ret = ESP_OK;
+    for (int i = 0; i < count; i++) {
+        esp_err_t err = js_ble_notify_conn(conns[i], s);
+        if (err != ESP_OK) ret = err;
+    }
+    return ret;
+}
 
+/**
+ * Send to one phone (the response to a command it wrote)
+ * Longer than one notification (MTU - 3) is split into segments. Every segment but the last starts with '+',
+ * so the phone appends until it gets one without it.
+ */
+esp_err_t js_ble_notify_conn(uint16_t conn_handle, const char *s) {
     if (!s) return ESP_ERR_INVALID_ARG;
-    if (ble_conn_handle == BLE_HS_CONN_HANDLE_NONE) return ESP_ERR_INVALID_STATE;
+    if (conn_handle == JS_REPLY_NONE) return ESP_OK; // Serial command, already logged
     if (s_notify_val_handle == 0) return ESP_ERR_INVALID_STATE;
 
     size_t len = strlen(s);
     if (len == 0) return ESP_ERR_INVALID_ARG;
 
-    struct os_mbuf *om = ble_hs_mbuf_from_flat(s, len);
-    if (!om) return ESP_ERR_NO_MEM;
+    uint16_t mtu = ble_att_mtu(conn_handle);
+    if (mtu == 0) return ESP_ERR_INVALID_STATE; // Not connected
+    size_t max_payload = mtu - 3;
 
-    int rc = ble_gatts_notify_custom(ble_conn_handle, s_notify_val_handle, om);
-    if (rc != 0) {
-        ESP_LOGE(TAG, "Notify failed: %d", rc);
-        return ESP_FAIL;
+    while (len > max_payload) {
+        esp_err_t err = notify_segment(conn_handle, s, max_payload - 1, true);
+        if (err != ESP_OK) return err;
+        s += max_payload - 1;
+        len -= max_payload - 1;
     }
-
-    return ESP_OK;
+    return notify_segment(conn_handle, s, len, false);
 }
 
 /* ************************** Callback Function ************************** */
@@ -92,90 +230,194 @@ static int ble_write_callback(uint16_t conn_handle, uint16_t attr_handle,
         return BLE_ATT_ERR_WRITE_NOT_PERMITTED;
     }
 
-    // Create a buffer to hold the incoming data. Largest is alarms and 128 should be enough for 10 alarms
-    char line[128];
-
-    // Confirm that length passed is valid and not larger than our buffer
+    // Long writes (prepare/execute) arrive here already joined by NimBLE, up to the 512 byte attribute limit
     int len = OS_MBUF_PKTLEN(ctxt->om);
-    if (len <= 0 || len >= (int)sizeof(line)) {
+    js_ble_conn_add_rx(conn_handle, len);
+    if (len <= 0 || len >= JS_CMD_MAX_LEN) {
         return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
     }
 
-    // Copy the data from the mbuf to our buffer and null-terminate it
-    int rc = ble_hs_mbuf_to_flat(ctxt->om, line, sizeof(line) - 1, NULL);
-    if (rc != 0) return BLE_ATT_ERR_UNLIKELY;
-    line[len] = '\0';
+    cmd_rx_t *rx = get_cmd_rx(conn_handle);
+    if (!rx) return BLE_ATT_ERR_INSUFFICIENT_RES;
 
-    // Parse the command and post to the main event loop for handling
-    ESP_LOGI(TAG, "ble_write_callback received: %s", line);
+    // Drop a partly received command the phone gave up on
+    int64_t now_us = esp_timer_get_time();
+    if (rx->len > 0 && now_us - rx->last_us > SEGMENT_TIMEOUT_US) {
+        ESP_LOGW(TAG, "Dropping %u bytes of an unfinished command", rx->len);
+        rx->len = 0;
+    }
 
-    // Post to main event loop (copies bytes internally)
-    // esp_event_post(JS_EVENT_BASE, JS_EVENT_READ_SYSTEM_TIME, NULL, 0, portMAX_DELAY);
-    switch (line[0]) {
-    // ********************* Time Events *********************
-    case 't': // Read system time
-        ESP_LOGI(TAG, "Read Time command received");
-        esp_event_post(JS_EVENT_BASE, JS_EVENT_READ_SYSTEM_TIME, NULL, 0, 0);
-        break;
+    // Segments starting with '+' have more to follow (for phones that can't do long writes, or big payloads)
+    char first;
+    if (os_mbuf_copydata(ctxt->om, 0, 1, &first) != 0) return BLE_ATT_ERR_UNLIKELY;
+    bool more = first == SEGMENT_MORE;
+    int skip = more ? 1 : 0;
+
+    // Whole command has to fit in the bounded buffer
+    if (rx->len + len - skip >= JS_CMD_MAX_LEN) {
+        char resp[32];
+        snprintf(resp, sizeof(resp), "%c:ERR:%s", rx->len ? rx->buf[0] : '?', esp_err_to_name(ESP_ERR_INVALID_SIZE));
+        ESP_LOGW(TAG, "Command longer than %d bytes, dropped", JS_CMD_MAX_LEN - 1);
+        rx->len = 0;
+        js_ble_notify_conn(conn_handle, resp);
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    }
 
-    case 'T': // Write system time
-        ESP_LOGI(TAG, "Write Time command received");
-        // Strip out the first two character (T:) before posting the event
-        esp_event_post(JS_EVENT_BASE, JS_EVENT_WRITE_SYSTEM_TIME, line + 2, strlen(line + 2) + 1, 0);
-        break;
+    if (os_mbuf_copydata(ctxt->om, skip, len - skip, rx->buf + rx->len) != 0) return BLE_ATT_ERR_UNLIKELY;
+    rx->len += len - skip;
+    rx->last_us = now_us;
+    if (more) return 0;
 
-    // ***************** User Settings Events ****************
-    case 'l': // Read Location/Timezone
-        ESP_LOGI(TAG, "Read timezone command received");
-        esp_event_post(JS_EVENT_BASE, JS_EVENT_READ_TIMEZONE, NULL, 0, 0);
-        break;
+    // Last segment: null-terminate and dispatch once
+    rx->buf[rx->len] = '\0';
+    rx->len = 0;
+    dispatch_command(conn_handle, rx->buf);
 
-    case 'L': // Write Location/Timezone
-        ESP_LOGI(TAG, "Write timezone command received");
-        // Strip out the first two character (L:) before posting the event with a null-terminated string
-        esp_event_post(JS_EVENT_BASE, JS_EVENT_WRITE_TIMEZONE, line + 2, strlen(line + 2) + 1, 0);
-        break;
+    // No payload response here (ATT-level write response is handled by stack)
+    return 0;
+}
 
-    case 'a': // Read Alarms
-        ESP_LOGI(TAG, "Read Alarms command received");
-        esp_event_post(JS_EVENT_BASE, JS_EVENT_READ_ALARMS, NULL, 0, 0);
-        break;
+// Route the command to the main event loop, or tell the phone why it wasn't taken
+static void dispatch_command(uint16_t conn_handle, const char *line) {
+    esp_err_t err = js_cmd_route(line, conn_handle, JS_CMD_SRC_BLE);
+    if (err == ESP_OK) return;
+
+    char nack[64];
+    js_cmd_format_nack(line, err, nack, sizeof(nack));
+    js_ble_notify_conn(conn_handle, nack);
+}
+
+// Notify Callback. This is needed for NimBLE but not used
+static int ble_notify_callback(uint16_t conn_handle, uint16_t attr_handle,
+                               struct ble_gatt_access_ctxt *ctxt, void *arg) {
+    // We don’t allow reads/writes on the notify characteristic.
+    if (ctxt->op == BLE_GATT_ACCESS_OP_READ_CHR) return BLE_ATT_ERR_READ_NOT_PERMITTED;
+    if (ctxt->op == BLE_GATT_ACCESS_OP_WRITE_CHR) return BLE_ATT_ERR_WRITE_NOT_PERMITTED;
+    return BLE_ATT_ERR_UNLIKELY;
+}
 
-    case 'A': // Write Alarms
-        ESP_LOGI(TAG, "Alarms command received");
-        // Strip out the first two character (A:) before posting the event with a null-terminated string
-        esp_event_post(JS_EVENT_BASE, JS_EVENT_WRITE_ALARMS, line + 2, strlen(line + 2) + 1, 0);
+// Read Callback for the state characteristics. Values come straight from the js_state cache.
+static int ble_state_read_callback(uint16_t conn_handle, uint16_t attr_handle,
+                                   struct ble_gatt_access_ctxt *ctxt, void *arg) {
+    if (ctxt->op != BLE_GATT_ACCESS_OP_READ_CHR) return BLE_ATT_ERR_WRITE_NOT_PERMITTED;
+
+    int rc;
+    switch ((state_chr_t)(uintptr_t)arg) {
+    case STATE_CHR_BATTERY: {
+        int battery_mv;
+        bool charging;
+        js_state_get_battery(&battery_mv, &charging);
+        uint8_t value[3] = {battery_mv & 0xFF, (battery_mv >> 8) & 0xFF, charging};
+        rc = os_mbuf_append(ctxt->om, value, sizeof(value));
         break;
+    }
 
-        // No payload response here (ATT-level write response is handled by stack)
-        return 0;
+    case STATE_CHR_TIME: {
+        uint64_t now = (uint64_t)time(NULL);
+        uint8_t value[8];
+        for (int i = 0; i < 8; i++) value[i] = (now >> (8 * i)) & 0xFF;
+        rc = os_mbuf_append(ctxt->om, value, sizeof(value));
+        break;
+    }
 
-    // ******************** Battery Events ********************
-    case 'b': // Read Battery
-        ESP_LOGI(TAG, "Read Battery command received");
-        esp_event_post(JS_EVENT_BASE, JS_EVENT_READ_BATTERY, NULL, 0, 0);
+    case STATE_CHR_TIMEZONE: {
+        char tz[64];
+        size_t len = js_state_get_timezone(tz, sizeof(tz));
+        rc = os_mbuf_append(ctxt->om, tz, len);
         break;
+    }
 
-    case 'c': // Read Charger
-        ESP_LOGI(TAG, "Read Charger command received");
-        esp_event_post(JS_EVENT_BASE, JS_EVENT_READ_CHARGER, NULL, 0, 0);
+    case STATE_CHR_ALARMS: {
+        static char alarms[JS_STATE_ALARMS_MAX]; // Static: the host task stack is small (host task only)
+        size_t len = js_state_get_alarms(alarms, sizeof(alarms));
+        rc = os_mbuf_append(ctxt->om, alarms, len); // NimBLE handles long reads (read blob) using the offset
         break;
+    }
 
     default:
-        ESP_LOGW(TAG, "Unknown command: %s", line);
-        js_ble_notify("Unknown command received");
-        break;
+        return BLE_ATT_ERR_UNLIKELY;
     }
 
-    // No payload response here (ATT-level write response is handled by stack)
-    return 0;
+    return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
 }
 
-// Notify Callback. This is needed for NimBLE but not used
-static int ble_notify_callback(uint16_t conn_handle, uint16_t attr_handle,
-                               struct ble_gatt_access_ctxt *ctxt, void *arg) {
-    // We don’t allow reads/writes on the notify characteristic.
-    if (ctxt->op == BLE_GATT_ACCESS_OP_READ_CHR) return BLE_ATT_ERR_READ_NOT_PERMITTED;
-    if (ctxt->op == BLE_GATT_ACCESS_OP_WRITE_CHR) return BLE_ATT_ERR_WRITE_NOT_PERMITTED;
-    return BLE_ATT_ERR_UNLIKELY;
-}
\ No newline at end of file
+// Find this connection's reassembly buffer, or claim a free one
+static cmd_rx_t *get_cmd_rx(uint16_t conn_handle) {
+    cmd_rx_t *free_rx = NULL;
+    for (int i = 0; i < JS_BLE_MAX_CONNECTIONS; i++) {
+        if (s_cmd_rx[i].conn_handle == conn_handle) return &s_cmd_rx[i];
+        if (!free_rx && s_cmd_rx[i].conn_handle == BLE_HS_CONN_HANDLE_NONE) free_rx = &s_cmd_rx[i];
+    }
+    if (free_rx) {
+        free_rx->conn_handle = conn_handle;
+        free_rx->len = 0;
+    }
+    return free_rx;
+}
+
+/**
+ * Send one notification, prefixed with '+' if more follow. Waits for mbufs when a long response drains the pool.
+ * On the NimBLE host task (NACKs from the write callback) it fails at once instead: the host task is what frees
+ * the mbufs, so sleeping there only stalls the stack.
+ */
+static esp_err_t notify_segment(uint16_t conn_handle, const char *data, size_t len, bool more) {
+    int attempts = js_ble_in_host_task() ? 1 : NOTIFY_RETRIES;
+    for (int attempt = 0; attempt < attempts; attempt++) {
+        struct os_mbuf *om = more ? ble_hs_mbuf_from_flat("+", 1) : ble_hs_mbuf_from_flat(data, len);
+        if (om && more && os_mbuf_append(om, data, len) != 0) {
+            os_mbuf_free_chain(om);
+            om = NULL;
+        }
+
+        // notify_custom consumes the mbuf either way, so it's rebuilt on a retry
+        int rc = om ? ble_gatts_notify_custom(conn_handle, s_notify_val_handle, om) : BLE_HS_ENOMEM;
+        if (rc == 0) {
+            js_ble_conn_add_tx(conn_handle, len + (more ? 1 : 0));
+            return ESP_OK;
+        }
+        if (rc != BLE_HS_ENOMEM) {
+            ESP_LOGE(TAG, "Notify to %u failed: %d", conn_handle, rc);
+            return ESP_FAIL;
+        }
+        if (attempt + 1 < attempts) vTaskDelay(pdMS_TO_TICKS(10));
+    }
+
+    ESP_LOGE(TAG, "Notify to %u failed: out of buffers", conn_handle);
+    return ESP_ERR_NO_MEM;
+}
+
+// Copy the subscriber list (returns the count)
+static int get_notify_subscribers(uint16_t *conns) {
+    int count = 0;
+    taskENTER_CRITICAL(&s_subs_lock);
+    for (int i = 0; i < JS_BLE_MAX_CONNECTIONS; i++) {
+        if (s_notify_subs[i] != BLE_HS_CONN_HANDLE_NONE) conns[count++] = s_notify_subs[i];
+    }
+    taskEXIT_CRITICAL(&s_subs_lock);
+    return count;
+}
+
+// State changed, notify subscribed phones (NimBLE reads the new value through ble_state_read_callback)
+static void on_state_changed(js_state_field_t field, void *arg) {
+    switch (field) {
+    case JS_STATE_BATTERY:
+        if (s_battery_val_handle) ble_gatts_chr_updated(s_battery_val_handle);
+        js_ble_telemetry_kick();
+        js_ble_update_status_adv();
+        break;
+    case JS_STATE_TIMEZONE:
+        if (s_timezone_val_handle) ble_gatts_chr_updated(s_timezone_val_handle);
+        break;
+    case JS_STATE_ALARMS:
+        if (s_alarms_val_handle) ble_gatts_chr_updated(s_alarms_val_handle);
+        break;
+    case JS_STATE_AUDIO:
+        js_ble_telemetry_kick();
+        break;
+    case JS_STATE_NEXT_ALARM:
+        js_ble_update_status_adv();
+        break;
+    default:
+        break;
+    }
+}
@@ -0,0 +1,342 @@
+/**
+ * Log characteristic
+ * Streams ESP_LOGx output to subscribed phones for field diagnostics without a USB cable.
+ * The vprintf hook doesn't format on the caller: like js_dlog, it records the format and the raw arguments (%s
+ * arguments are copied, they may be on the caller's stack) and never waits. A low priority task formats the lines
+ * and sends them on. Lines below the level filter are skipped before anything is copied, and the task is rate
+ * limited so logging can't crowd out commands or telemetry on the link.
+ * Write a uint8 ESP log level (1 error - 5 verbose, 0 off) to set the filter. Read returns the level and the
+ * number of lines dropped because the ring buffer was full.
+ */
+
+// Self Include
+#include "js_ble_log.h"
+
+// Library Includes
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/ringbuf.h"
+#include "freertos/task.h"
+#include "host/ble_hs.h"
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+// Local Includes
+#include "js_ble_gatt.h"
+
+// Defines
+#define TAG "js_ble_log"
+#define LOG_RING_SIZE 4096             // Bytes of log text held while the link catches up
+#define LOG_LINE_MAX 160               // Longer lines are cut (formatted on the log task's stack)
+#define LOG_RECORDS 16                 // Lines waiting to be formatted
+#define LOG_MAX_ARGS 10                // Timestamp, tag and up to 8 message arguments
+#define LOG_TEXT_MAX 64                // Room for the copies of a line's %s arguments (tag included)
+#define LOG_ARGS_RAW 0xFF              // nargs of a line with arguments that can't be recorded, sent as the format
+#define LOG_RATE_BYTES_PER_S 2048      // Sustained stream rate, leaves the link free for everything else
+#define LOG_BURST_BYTES 1024           // Bucket size
+#define LOG_DEFAULT_LEVEL ESP_LOG_WARN // Until a phone writes another level
+#define LOG_NOTIFY_RETRIES 5           // Waits for a free mbuf before the chunk is dropped
+#define LOG_TASK_STACK 3072            // vsnprintf of the lines plus NimBLE notify
+#define LOG_TASK_PRIORITY 2            // Below audio and the BLE host
+
+// Types
+typedef struct {
+    atomic_bool ready;           // Complete, the log task may format it
+    const char *fmt;             // The ESP_LOGx() format, "E (%lu) %s: ...\n"
+    uint8_t nargs;               // Words in args, or LOG_ARGS_RAW
+    uint32_t args[LOG_MAX_ARGS]; // As passed, except %s which point into text
+    char text[LOG_TEXT_MAX];
+} log_record_t;
+
+// Forward Declarations
+uint16_t js_ble_log_val_handle;
+static TaskHandle_t s_task = NULL;
+static RingbufHandle_t s_ring = NULL;
+static StaticRingbuffer_t s_ring_mem;
+static uint8_t s_ring_storage[LOG_RING_SIZE];
+static StaticTask_t s_task_mem;
+static StackType_t s_task_stack[LOG_TASK_STACK];
+static vprintf_like_t s_prev_vprintf = NULL;
+static uint16_t s_subs[JS_BLE_MAX_CONNECTIONS]; // Subscribed connections
+static volatile int s_sub_count = 0;
+static portMUX_TYPE s_subs_lock = portMUX_INITIALIZER_UNLOCKED;
+static volatile esp_log_level_t s_level = LOG_DEFAULT_LEVEL;
+static volatile uint32_t s_dropped = 0;
+static log_record_t s_records[LOG_RECORDS];
+static unsigned s_record_head = 0; // Next to claim
+static unsigned s_record_tail = 0; // Next to format
+static portMUX_TYPE s_records_lock = portMUX_INITIALIZER_UNLOCKED;
+static int log_vprintf(const char *fmt, va_list args);
+static esp_log_level_t line_level(const char *fmt);
+static void record_args(log_record_t *rec, const char *fmt, va_list args);
+static void format_records(void);
+static void log_task(void *arg);
+static void send_chunk(const uint8_t *data, size_t len, const uint16_t *conns, int count);
+static int get_subscribers(uint16_t *conns);
+
+/** Start the log task and install the vprintf hook (lines are only captured while a phone is subscribed) */
+esp_err_t js_ble_log_init(void) {
+    for (int i = 0; i < JS_BLE_MAX_CONNECTIONS; i++) s_subs[i] = BLE_HS_CONN_HANDLE_NONE;
+
+    s_ring = xRingbufferCreateStatic(LOG_RING_SIZE, RINGBUF_TYPE_BYTEBUF, s_ring_storage, &s_ring_mem);
+    if (!s_ring) return ESP_ERR_NO_MEM;
+    s_task = xTaskCreateStatic(log_task, "ble_log", LOG_TASK_STACK, NULL, LOG_TASK_PRIORITY, s_task_stack, &s_task_mem);
+    if (!s_task) return ESP_ERR_NO_MEM;
+
+    s_prev_vprintf = esp_log_set_vprintf(log_vprintf);
+    return ESP_OK;
+}
+
+/* ************************** Global Functions ************************** */
+// Track the subscription (called from the GAP event handler in js_ble.c)
+void js_ble_log_on_subscribe(uint16_t conn_handle, uint16_t attr_handle, bool notify) {
+    if (attr_handle != js_ble_log_val_handle) return;
+
+    int count = 0;
+    taskENTER_CRITICAL(&s_subs_lock);
+    for (int i = 0; i < JS_BLE_MAX_CONNECTIONS; i++) {
+        if (s_subs[i] == conn_handle) s_subs[i] = BLE_HS_CONN_HANDLE_NONE;
+    }
+    for (int i = 0; notify && i < JS_BLE_MAX_CONNECTIONS; i++) {
+        if (s_subs[i] == BLE_HS_CONN_HANDLE_NONE) {
+            s_subs[i] = conn_handle;
+            break;
+        }
+    }
+    for (int i = 0; i < JS_BLE_MAX_CONNECTIONS; i++) {
+        if (s_subs[i] != BLE_HS_CONN_HANDLE_NONE) count++;
+    }
+    s_sub_count = count;
+    taskEXIT_CRITICAL(&s_subs_lock);
+
+    ESP_LOGI(TAG, "Log stream %s (level %d)", notify ? "subscribed" : "unsubscribed", s_level);
+}
+
+// Read returns [u8 level][u32 dropped lines (LE)], write sets the level (uint8)
+int js_ble_log_access_cb(uint16_t conn_handle, uint16_t attr_handle,
+                         struct ble_gatt_access_ctxt *ctxt, void *arg) {
+    if (ctxt->op == BLE_GATT_ACCESS_OP_READ_CHR) {
+        uint32_t dropped = s_dropped;
+        uint8_t value[5] = {s_level, dropped & 0xFF, (dropped >> 8) & 0xFF, (dropped >> 16) & 0xFF, dropped >> 24};
+        return os_mbuf_append(ctxt->om, value, sizeof(value)) == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+    }
+
+    if (ctxt->op == BLE_GATT_ACCESS_OP_WRITE_CHR) {
+        uint8_t level;
+        uint16_t len = 0;
+        if (OS_MBUF_PKTLEN(ctxt->om) != sizeof(level)) return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+        if (ble_hs_mbuf_to_flat(ctxt->om, &level, sizeof(level), &len) != 0) return BLE_ATT_ERR_UNLIKELY;
+        if (level > ESP_LOG_VERBOSE) return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+
+        s_level = (esp_log_level_t)level;
+        ESP_LOGI(TAG, "Log stream level set to %d", level);
+        return 0;
+    }
+
+    return BLE_ATT_ERR_UNLIKELY;
+}
+
+/* ************************** Local Functions ************************** */
+// Console output as before, plus a record of the line for the log task. Runs on whichever task logged, so it
+// never blocks and never formats.
+static int log_vprintf(const char *fmt, va_list args) {
+    va_list copy;
+    va_copy(copy, args);
+    int ret = s_prev_vprintf(fmt, args);
+
+    // Skip our own task (notifying logs too) and anything the filter would drop, before copying anything
+    if (s_sub_count > 0 && !xPortInIsrContext() && xTaskGetCurrentTaskHandle() != s_task &&
+        line_level(fmt) <= s_level) {
+        log_record_t *rec = NULL;
+        taskENTER_CRITICAL(&s_records_lock);
+        if (s_record_head - s_record_tail < LOG_RECORDS) rec = &s_records[s_record_head++ % LOG_RECORDS];
+        taskEXIT_CRITICAL(&s_records_lock);
+
+        if (rec) {
+            record_args(rec, fmt, copy);
+            atomic_store_explicit(&rec->ready, true, memory_order_release);
+            xTaskNotifyGive(s_task);
+        } else {
+            s_dropped++;
+        }
+    }
+
+    va_end(copy);
+    return ret;
+}
+
+/**
+ * Copy the arguments a format takes into the record, walking its conversions. Everything 32 bits or less is kept
+ * as a word (the same as JS_DLOGx), strings are copied into the record's text. 64 bit and floating point arguments
+ * can't be passed on that way, a line with one is sent as its bare format.
+ */
+static void record_args(log_record_t *rec, const char *fmt, va_list args) {
+    size_t text_len = 0;
+    rec->fmt = fmt;
+    rec->nargs = 0;
+
+    for (const char *p = fmt; *p; p++) {
+        if (*p != '%') continue;
+        p++;
+        if (*p == '%') continue;
+
+        // Flags, width and precision (a * takes an int)
+        for (; *p && strchr("-+ #0123456789.*", *p); p++) {
+            if (*p != '*') continue;
+            if (rec->nargs == LOG_MAX_ARGS) goto raw;
+            rec->args[rec->nargs++] = va_arg(args, int);
+        }
+
+        // Length: hh, h and l are 32 bits here, ll, j and L aren't
+        while (*p == 'h' || *p == 'l' || *p == 'z' || *p == 't') {
+            if (p[0] == 'l' && p[1] == 'l') goto raw;
+            p++;
+        }
+        if (!*p || rec->nargs == LOG_MAX_ARGS) goto raw;
+
+        if (*p == 's') {
+            const char *s = va_arg(args, const char *);
+            char *copy = &rec->text[text_len];
+            strlcpy(copy, s ? s : "(null)", sizeof(rec->text) - text_len);
+            text_len += strlen(copy);
+            if (text_len < sizeof(rec->text) - 1) text_len++; // Past the null. Once full, the rest get an empty string
+            rec->args[rec->nargs++] = (uint32_t)(uintptr_t)copy;
+        } else if (strchr("diouxXcp", *p)) {
+            rec->args[rec->nargs++] = va_arg(args, uint32_t);
+        } else {
+            goto raw;
+        }
+    }
+    return;
+
+raw:
+    rec->nargs = LOG_ARGS_RAW;
+}
+
+// Format the finished records into the ring buffer, in order
+static void format_records(void) {
+    for (;;) {
+        // A record that's claimed but not ready yet is still being written, its writer notifies when it's done
+        log_record_t *rec = &s_records[s_record_tail % LOG_RECORDS];
+        if (s_record_tail == s_record_head || !atomic_load_explicit(&rec->ready, memory_order_acquire)) return;
+
+        char line[LOG_LINE_MAX];
+        int len;
+        if (rec->nargs == LOG_ARGS_RAW) {
+            len = strlcpy(line, rec->fmt, sizeof(line));
+        } else {
+            uint32_t a[LOG_MAX_ARGS] = {0};
+            for (int i = 0; i < rec->nargs; i++) a[i] = rec->args[i];
+            len = snprintf(line, sizeof(line), rec->fmt, a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], a[8], a[9]);
+        }
+        if (len >= (int)sizeof(line)) {
+            len = sizeof(line) - 1;
+            line[len - 1] = '\n'; // Cut lines still end the line
+        }
+        if (len > 0 && xRingbufferSend(s_ring, line, len, 0) != pdTRUE) s_dropped++;
+
+        atomic_store_explicit(&rec->ready, false, memory_order_relaxed);
+        taskENTER_CRITICAL(&s_records_lock);
+        s_record_tail++;
+        taskEXIT_CRITICAL(&s_records_lock);
+    }
+}
+
+// ESP log lines start with the level letter ("E (123) tag: ..."), anything else counts as info
+static esp_log_level_t line_level(const char *fmt) {
+    switch (fmt[0]) {
+    case 'E':
+        return ESP_LOG_ERROR;
+    case 'W':
+        return ESP_LOG_WARN;
+    case 'D':
+        return ESP_LOG_DEBUG;
+    case 'V':
+        return ESP_LOG_VERBOSE;
+    default:
+        return ESP_LOG_INFO;
+    }
+}
+
+// Send the ring buffer to subscribed phones in MTU sized chunks, no faster than the rate limit
+static void log_task(void *arg) {
+    uint16_t conns[JS_BLE_MAX_CONNECTIONS];
+    int64_t tokens = LOG_BURST_BYTES;
+    int64_t last_refill_us = esp_timer_get_time();
+    uint32_t dropped_reported = 0;
+
+    for (;;) {
+        // Largest chunk every subscriber can take in one notification
+        int count = get_subscribers(conns);
+        size_t max_len = LOG_BURST_BYTES;
+        for (int i = 0; i < count; i++) {
+            uint16_t mtu = ble_att_mtu(conns[i]);
+            if (mtu > 3 && mtu - 3U < max_len) max_len = mtu - 3;
+        }
+
+        // Format what was logged, then sleep until there's more if nothing is waiting
+        format_records();
+        size_t len = 0;
+        uint8_t *data = xRingbufferReceiveUpTo(s_ring, &len, 0, max_len);
+        if (!data) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        // Wait for the bucket to cover this chunk
+        int64_t now = esp_timer_get_time();
+        tokens += (now - last_refill_us) * LOG_RATE_BYTES_PER_S / 1000000;
+        if (tokens > LOG_BURST_BYTES) tokens = LOG_BURST_BYTES;
+        last_refill_us = now;
+        if (tokens < (int64_t)len) {
+            vTaskDelay(pdMS_TO_TICKS((len - tokens) * 1000 / LOG_RATE_BYTES_PER_S) + 1);
+            tokens = len; // Refilled while waiting
+            last_refill_us = esp_timer_get_time();
+        }
+        tokens -= len;
+
+        // Say when lines were lost so the gap is visible in the stream
+        count = get_subscribers(conns);
+        uint32_t dropped = s_dropped;
+        if (dropped != dropped_reported) {
+            char notice[40];
+            int notice_len = snprintf(notice, sizeof(notice), "[%lu log lines dropped]\n", (unsigned long)(dropped - dropped_reported));
+            send_chunk((const uint8_t *)notice, notice_len, conns, count);
+            dropped_reported = dropped;
+        }
+
+        send_chunk(data, len, conns, count);
+        vRingbufferReturnItem(s_ring, data);
+    }
+}
+
+// Notify one chunk to every subscriber, waiting briefly for mbufs. A chunk that still can't go is dropped.
+static void send_chunk(const uint8_t *data, size_t len, const uint16_t *conns, int count) {
+    for (int i = 0; i < count; i++) {
+        for (int attempt = 0; attempt < LOG_NOTIFY_RETRIES; attempt++) {
+            struct os_mbuf *om = ble_hs_mbuf_from_flat(data, len);
+            int rc = om ? ble_gatts_notify_custom(conns[i], js_ble_log_val_handle, om) : BLE_HS_ENOMEM;
+            if (rc == 0) {
+                js_ble_conn_add_tx(conns[i], len);
+                break;
+            }
+            if (rc != BLE_HS_ENOMEM) break;
+            vTaskDelay(pdMS_TO_TICKS(10));
+        }
+    }
+}
+
+// Copy the subscriber list (returns the count)
+static int get_subscribers(uint16_t *conns) {
+    int count = 0;
+    taskENTER_CRITICAL(&s_subs_lock);
+    for (int i = 0; i < JS_BLE_MAX_CONNECTIONS; i++) {
+        if (s_subs[i] != BLE_HS_CONN_HANDLE_NONE) conns[count++] = s_subs[i];
+    }
+    taskEXIT_CRITICAL(&s_subs_lock);
+    return count;
+}
@@ -0,0 +1,125 @@
+/**
+ * BLE firmware update
+ * Streams an image into the inactive OTA slot using the bulk transfer engine (js_ble_xfer.c).
+ * The new image boots in a pending state and is only kept if app_main gets through init (see confirm_running_image).
+ */
+
+// Self Include
+#include "js_ble_ota.h"
+
+// Library Includes
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_system.h"
+#include "host/ble_hs.h"
+
+// Local Includes
+#include "js_ble_xfer.h"
+#include "js_sched.h"
+
+// Defines
+#define TAG "js_ble_ota"
+#define REBOOT_DELAY_MS 1000 // Time for the END response to go out before restarting
+
+// Service and Characteristics addresses (UUIDs)
+static const ble_uuid128_t OTA_SVC_UUID = BLE_UUID128_INIT(0x9E, 0x81, 0x20, 0x01, 0x22, 0xE5, 0xA9, 0xE0, 0x93, 0xF3, 0xA3, 0xB5, 0x10, 0x00, 0x40, 0x6E);  // 6E400010-B5A3-F393-E0A9-E5220120819E
+static const ble_uuid128_t OTA_CTRL_UUID = BLE_UUID128_INIT(0x9E, 0x81, 0x20, 0x01, 0x22, 0xE5, 0xA9, 0xE0, 0x93, 0xF3, 0xA3, 0xB5, 0x11, 0x00, 0x40, 0x6E); // 6E400011-B5A3-F393-E0A9-E5220120819E
+static const ble_uuid128_t OTA_DATA_UUID = BLE_UUID128_INIT(0x9E, 0x81, 0x20, 0x01, 0x22, 0xE5, 0xA9, 0xE0, 0x93, 0xF3, 0xA3, 0xB5, 0x12, 0x00, 0x40, 0x6E); // 6E400012-B5A3-F393-E0A9-E5220120819E
+
+// Forward Declarations
+static int ota_ctrl_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+static int ota_data_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+static esp_err_t ota_begin(uint32_t size, const uint8_t *arg, size_t arg_len);
+static esp_err_t ota_write(const uint8_t *data, size_t len);
+static esp_err_t ota_finish(void);
+static void ota_abort(void);
+static void reboot_job(void *arg);
+static uint16_t s_ctrl_val_handle;
+static esp_ota_handle_t s_ota_handle;
+static const esp_partition_t *s_ota_partition = NULL;
+
+// Sink for the transfer engine
+static const js_ble_xfer_sink_t ota_sink = {
+    .name = "ota",
+    .begin = ota_begin,
+    .write = ota_write,
+    .finish = ota_finish,
+    .abort = ota_abort,
+};
+
+/* ****************** Service / Characteristics Definitions ***************** */
+static const struct ble_gatt_chr_def ota_chrs[] = {
+    {
+        .uuid = (const ble_uuid_t *)&OTA_CTRL_UUID,
+        .access_cb = ota_ctrl_callback,
+        .val_handle = &s_ctrl_val_handle,
+        .flags = BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_NOTIFY,
+    },
+    {
+        .uuid = (const ble_uuid_t *)&OTA_DATA_UUID,
+        .access_cb = ota_data_callback,
+        .flags = BLE_GATT_CHR_F_WRITE_NO_RSP,
+    },
+    {0}};
+
+static const struct ble_gatt_svc_def ota_svcs[] = {
+    {
+        .type = BLE_GATT_SVC_TYPE_PRIMARY,
+        .uuid = (const ble_uuid_t *)&OTA_SVC_UUID,
+        .characteristics = ota_chrs,
+    },
+    {0}};
+
+// Passing back to js_ble.c for registration
+const struct ble_gatt_svc_def *js_ble_ota_get_svcs(void) {
+    return ota_svcs;
+}
+
+/* ************************** Callback Functions ************************** */
+static int ota_ctrl_callback(uint16_t conn_handle, uint16_t attr_handle,
+                             struct ble_gatt_access_ctxt *ctxt, void *arg) {
+    if (ctxt->op != BLE_GATT_ACCESS_OP_WRITE_CHR) return BLE_ATT_ERR_READ_NOT_PERMITTED;
+    return js_ble_xfer_control(&ota_sink, conn_handle, s_ctrl_val_handle, ctxt->om);
+}
+
+static int ota_data_callback(uint16_t conn_handle, uint16_t attr_handle,
+                             struct ble_gatt_access_ctxt *ctxt, void *arg) {
+    if (ctxt->op != BLE_GATT_ACCESS_OP_WRITE_CHR) return BLE_ATT_ERR_READ_NOT_PERMITTED;
+    return js_ble_xfer_data(&ota_sink, conn_handle, ctxt->om);
+}
+
+/* ************************** OTA Sink ************************** */
+// Open the inactive slot. Sequential writes erase sector by sector instead of the whole slot up front.
+static esp_err_t ota_begin(uint32_t size, const uint8_t *arg, size_t arg_len) {
+    s_ota_partition = esp_ota_get_next_update_partition(NULL);
+    if (!s_ota_partition) return ESP_ERR_NOT_FOUND;
+    if (size > s_ota_partition->size) return ESP_ERR_INVALID_SIZE;
+
+    ESP_LOGI(TAG, "Writing %lu bytes to %s", (unsigned long)size, s_ota_partition->label);
+    return esp_ota_begin(s_ota_partition, OTA_WITH_SEQUENTIAL_WRITES, &s_ota_handle);
+}
+
+static esp_err_t ota_write(const uint8_t *data, size_t len) {
+    return esp_ota_write(s_ota_handle, data, len);
+}
+
+// Validate the image, switch the boot slot and restart
+static esp_err_t ota_finish(void) {
+    esp_err_t err = esp_ota_end(s_ota_handle); // Checks the image header and SHA-256
+    if (err != ESP_OK) return err;
+
+    err = esp_ota_set_boot_partition(s_ota_partition);
+    if (err != ESP_OK) return err;
+
+    ESP_LOGI(TAG, "Update complete, restarting into %s", s_ota_partition->label);
+    js_sched_after("ota_reboot", REBOOT_DELAY_MS, reboot_job, NULL, NULL);
+    return ESP_OK;
+}
+
+static void ota_abort(void) {
+    esp_ota_abort(s_ota_handle);
+}
+
+static void reboot_job(void *arg) {
+    esp_restart();
+}
@@ -0,0 +1,199 @@
+/**
+ * Telemetry characteristic
+ * While any phone is subscribed, a compact binary snapshot is notified to every subscriber each period and
+ * immediately on state changes.
+ * Writing a uint16 (LE) to the characteristic sets the period in ms.
+ */
+
+// Self Include
+#include "js_ble_telemetry.h"
+
+// Library Includes
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "host/ble_hs.h"
+#include <string.h>
+#include <time.h>
+
+// Local Includes
+#include "js_ble_gatt.h"
+#include "js_state.h"
+#include "js_time.h"
+
+// Defines
+#define TAG "js_ble_telemetry"
+#define TELEMETRY_VERSION 1
+#define DEFAULT_PERIOD_MS 1000
+#define MIN_PERIOD_MS 250
+#define MAX_PERIOD_MS 60000
+#define DRIFT_CHECK_PERIOD_US (60 * 1000000LL) // RTC is read over I2C, so only check drift once a minute
+#define TELEMETRY_TASK_STACK 3072
+#define TELEMETRY_TASK_PRIORITY 4
+
+// Snapshot flags
+#define FLAG_CHARGING (1 << 0)
+#define FLAG_SONG_PLAYING (1 << 1)
+#define FLAG_EMERGENCY_PLAYING (1 << 2)
+#define FLAG_RTC_ERROR (1 << 3)
+
+// Snapshot sent in one notification (16 bytes, little endian)
+typedef struct __attribute__((packed)) {
+    uint8_t version;
+    uint8_t flags;
+    uint16_t battery_mv;
+    uint32_t unix_time;  // System time
+    int16_t rtc_drift_s; // RTC - system time at the last check
+    uint16_t seq;        // Increments every snapshot so the app can spot dropped notifications
+    uint32_t uptime_s;
+} telemetry_snapshot_t;
+
+// Forward Declarations
+uint16_t js_ble_telemetry_val_handle;
+static TaskHandle_t s_task = NULL;
+static StaticTask_t s_task_mem;
+static StackType_t s_task_stack[TELEMETRY_TASK_STACK];
+static uint16_t s_subs[JS_BLE_MAX_CONNECTIONS]; // Subscribed connections
+static portMUX_TYPE s_subs_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t s_period_ms = DEFAULT_PERIOD_MS;
+static uint16_t s_seq = 0;
+static int16_t s_rtc_drift_s = 0;
+static bool s_rtc_error = false;
+static int64_t s_last_drift_check_us = 0;
+static void telemetry_task(void *arg);
+static void build_snapshot(telemetry_snapshot_t *snap);
+static void update_rtc_drift(void);
+static int get_subscribers(uint16_t *conns);
+
+/** Start the telemetry task (it sleeps until a phone subscribes) */
+esp_err_t js_ble_telemetry_init(void) {
+    for (int i = 0; i < JS_BLE_MAX_CONNECTIONS; i++) s_subs[i] = BLE_HS_CONN_HANDLE_NONE;
+    s_task = xTaskCreateStatic(telemetry_task, "ble_telemetry", TELEMETRY_TASK_STACK, NULL, TELEMETRY_TASK_PRIORITY, s_task_stack, &s_task_mem);
+    if (!s_task) return ESP_ERR_NO_MEM;
+    return ESP_OK;
+}
+
+/* ************************** Global Functions ************************** */
+// Track the subscription (called from the GAP event handler in js_ble.c)
+void js_ble_telemetry_on_subscribe(uint16_t conn_handle, uint16_t attr_handle, bool notify) {
+    if (attr_handle != js_ble_telemetry_val_handle) return;
+
+    taskENTER_CRITICAL(&s_subs_lock);
+    for (int i = 0; i < JS_BLE_MAX_CONNECTIONS; i++) {
+        if (s_subs[i] == conn_handle) s_subs[i] = BLE_HS_CONN_HANDLE_NONE;
+    }
+    for (int i = 0; notify && i < JS_BLE_MAX_CONNECTIONS; i++) {
+        if (s_subs[i] == BLE_HS_CONN_HANDLE_NONE) {
+            s_subs[i] = conn_handle;
+            break;
+        }
+    }
+    taskEXIT_CRITICAL(&s_subs_lock);
+    if (notify) s_last_drift_check_us = 0; // Check drift on the first snapshot
+
+    ESP_LOGI(TAG, "Telemetry %s (period %lu ms)", notify ? "subscribed" : "unsubscribed", (unsigned long)s_period_ms);
+    js_ble_telemetry_kick();
+}
+
+// Wake the task to send a snapshot now
+void js_ble_telemetry_kick(void) {
+    if (s_task) xTaskNotifyGive(s_task);
+}
+
+// Read returns the current snapshot, write sets the period (uint16 ms, LE)
+int js_ble_telemetry_access_cb(uint16_t conn_handle, uint16_t attr_handle,
+                               struct ble_gatt_access_ctxt *ctxt, void *arg) {
+    if (ctxt->op == BLE_GATT_ACCESS_OP_READ_CHR) {
+        telemetry_snapshot_t snap;
+        build_snapshot(&snap);
+        return os_mbuf_append(ctxt->om, &snap, sizeof(snap)) == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+    }
+
+    if (ctxt->op == BLE_GATT_ACCESS_OP_WRITE_CHR) {
+        uint8_t value[2];
+        uint16_t len = 0;
+        if (OS_MBUF_PKTLEN(ctxt->om) != sizeof(value)) return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+        if (ble_hs_mbuf_to_flat(ctxt->om, value, sizeof(value), &len) != 0) return BLE_ATT_ERR_UNLIKELY;
+
+        uint32_t period_ms = value[0] | (value[1] << 8);
+        if (period_ms < MIN_PERIOD_MS) period_ms = MIN_PERIOD_MS;
+        if (period_ms > MAX_PERIOD_MS) period_ms = MAX_PERIOD_MS;
+        s_period_ms = period_ms;
+        ESP_LOGI(TAG, "Telemetry period set to %lu ms", (unsigned long)s_period_ms);
+        js_ble_telemetry_kick();
+        return 0;
+    }
+
+    return BLE_ATT_ERR_UNLIKELY;
+}
+
+/* ************************** Local Functions ************************** */
+// Send a snapshot every period (or when kicked) to every subscribed phone
+static void telemetry_task(void *arg) {
+    uint16_t conns[JS_BLE_MAX_CONNECTIONS];
+    for (;;) {
+        bool subscribed = get_subscribers(conns) > 0;
+        ulTaskNotifyTake(pdTRUE, subscribed ? pdMS_TO_TICKS(s_period_ms) : portMAX_DELAY);
+
+        int count = get_subscribers(conns);
+        if (count == 0) continue;
+
+        if (esp_timer_get_time() - s_last_drift_check_us >= DRIFT_CHECK_PERIOD_US) update_rtc_drift();
+
+        telemetry_snapshot_t snap;
+        build_snapshot(&snap);
+        s_seq++;
+
+        // Same snapshot (and seq) to everyone. notify_custom consumes the mbuf, so one each.
+        for (int i = 0; i < count; i++) {
+            struct os_mbuf *om = ble_hs_mbuf_from_flat(&snap, sizeof(snap));
+            if (!om) break;
+            int rc = ble_gatts_notify_custom(conns[i], js_ble_telemetry_val_handle, om);
+            if (rc != 0) {
+                ESP_LOGW(TAG, "Telemetry notify to %u failed: %d", conns[i], rc);
+            } else {
+                js_ble_conn_add_tx(conns[i], sizeof(snap));
+            }
+        }
+    }
+}
+
+// Copy the subscriber list (returns the count)
+static int get_subscribers(uint16_t *conns) {
+    int count = 0;
+    taskENTER_CRITICAL(&s_subs_lock);
+    for (int i = 0; i < JS_BLE_MAX_CONNECTIONS; i++) {
+        if (s_subs[i] != BLE_HS_CONN_HANDLE_NONE) conns[count++] = s_subs[i];
+    }
+    taskEXIT_CRITICAL(&s_subs_lock);
+    return count;
+}
+
+// Fill in the snapshot from the state cache and system clock
+static void build_snapshot(telemetry_snapshot_t *snap) {
+    int battery_mv;
+    bool charging;
+    js_state_get_battery(&battery_mv, &charging);
+    js_audio_state_t audio = js_state_get_audio();
+
+    memset(snap, 0, sizeof(*snap));
+    snap->version = TELEMETRY_VERSION;
+    snap->flags = (charging ? FLAG_CHARGING : 0) |
+                  (audio == JS_AUDIO_SONG ? FLAG_SONG_PLAYING : 0) |
+                  (audio == JS_AUDIO_EMERGENCY ? FLAG_EMERGENCY_PLAYING : 0) |
+                  (s_rtc_error ? FLAG_RTC_ERROR : 0);
+    snap->battery_mv = battery_mv;
+    snap->unix_time = (uint32_t)time(NULL);
+    snap->rtc_drift_s = s_rtc_drift_s;
+    snap->seq = s_seq;
+    snap->uptime_s = (uint32_t)(esp_timer_get_time() / 1000000);
+}
+
+// Compare the RTC with the system clock
+static void update_rtc_drift(void) {
+    uint64_t rtc_unix;
+    s_last_drift_check_us = esp_timer_get_time();
+    s_rtc_error = js_time_read_rtc(&rtc_unix) != ESP_OK;
+    if (!s_rtc_error) s_rtc_drift_s = (int16_t)((int64_t)rtc_unix - (int64_t)time(NULL));
+}
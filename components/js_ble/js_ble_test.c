@@ -0,0 +1,356 @@
+/**
+ * BLE throughput test service (CONFIG_JS_BLE_THROUGHPUT_TEST)
+ * Sink: write (without response) packets starting with a u32 (LE) sequence number. Bytes, packets and
+ *       sequence gaps are counted and the data is dropped.
+ * Source: subscribe, then write START to the control characteristic. MTU-sized notifications starting
+ *         with a u32 sequence number are sent as fast as the stack has buffers for them.
+ * Control: write [0x01] to reset the counters, [0x02][u16 seconds] to start the source (0 = until stopped),
+ *          [0x03] to stop it. Read it for the stats (test_stats_t).
+ */
+
+// Self Include
+#include "js_ble_test.h"
+
+// Library Includes
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "host/ble_hs.h"
+#include <string.h>
+
+// Local Includes
+#include "js_ble_gatt.h"
+
+// Defines
+#define TAG "js_ble_test"
+#define TEST_TASK_PRIORITY 3 // Same as the transfer engine, below audio
+#define TEST_TASK_STACK 3072
+#define CREDIT_WAIT_MS 10    // Wait for a notification to complete when out of buffers
+#define LOG_PERIOD_US (1000 * 1000)
+#define OP_RESET 0x01
+#define OP_START_SOURCE 0x02
+#define OP_STOP_SOURCE 0x03
+
+// Airtime estimate per ATT packet, in bytes on air (see estimate_airtime_us)
+#define ATT_L2CAP_HEADER 7 // ATT opcode + handle, L2CAP length + channel
+#define LL_OVERHEAD 14     // Preamble, access address, header, CRC, MIC (encrypted link)
+#define LL_EMPTY_PDU 10    // Empty packet from the peer acknowledging ours
+#define LL_IFS_US 150
+
+// Service and Characteristics addresses (UUIDs)
+static const ble_uuid128_t TEST_SVC_UUID = BLE_UUID128_INIT(0x9E, 0x81, 0x20, 0x01, 0x22, 0xE5, 0xA9, 0xE0, 0x93, 0xF3, 0xA3, 0xB5, 0x30, 0x00, 0x40, 0x6E);    // 6E400030-B5A3-F393-E0A9-E5220120819E
+static const ble_uuid128_t TEST_SINK_UUID = BLE_UUID128_INIT(0x9E, 0x81, 0x20, 0x01, 0x22, 0xE5, 0xA9, 0xE0, 0x93, 0xF3, 0xA3, 0xB5, 0x31, 0x00, 0x40, 0x6E);   // 6E400031-B5A3-F393-E0A9-E5220120819E
+static const ble_uuid128_t TEST_SOURCE_UUID = BLE_UUID128_INIT(0x9E, 0x81, 0x20, 0x01, 0x22, 0xE5, 0xA9, 0xE0, 0x93, 0xF3, 0xA3, 0xB5, 0x32, 0x00, 0x40, 0x6E); // 6E400032-B5A3-F393-E0A9-E5220120819E
+static const ble_uuid128_t TEST_CTRL_UUID = BLE_UUID128_INIT(0x9E, 0x81, 0x20, 0x01, 0x22, 0xE5, 0xA9, 0xE0, 0x93, 0xF3, 0xA3, 0xB5, 0x33, 0x00, 0x40, 0x6E);   // 6E400033-B5A3-F393-E0A9-E5220120819E
+
+// Counters for one direction
+typedef struct {
+    uint32_t bytes;
+    uint32_t packets;
+    uint32_t lost; // Sink only: gaps in the sequence numbers
+    uint32_t next_seq;
+    int64_t first_us;
+    int64_t last_us;
+} test_counters_t;
+
+// Stats returned by a read of the control characteristic (36 bytes, little endian)
+typedef struct __attribute__((packed)) {
+    uint32_t sink_bytes;
+    uint32_t sink_packets;
+    uint32_t sink_lost;
+    uint32_t sink_bps;
+    uint32_t source_bytes;
+    uint32_t source_packets;
+    uint32_t source_bps;
+    uint16_t conn_itvl;            // Units of 1.25ms
+    uint16_t pkts_per_event_x10;   // Average ATT packets per connection event (x10)
+    uint16_t utilization_permille; // Estimated radio airtime used by the test traffic
+    uint8_t tx_phy;                // 1 = 1M, 2 = 2M, 3 = Coded
+    uint8_t reserved;
+} test_stats_t;
+
+// Forward Declarations
+static int test_sink_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+static int test_source_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+static int test_ctrl_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+static void source_task(void *arg);
+static void build_stats(uint16_t conn_handle, test_stats_t *stats);
+static uint32_t bytes_per_second(const test_counters_t *c);
+static uint32_t estimate_airtime_us(const test_counters_t *c, uint8_t phy);
+static void log_stats(void);
+static uint16_t s_source_val_handle;
+static TaskHandle_t s_task = NULL;
+static StaticTask_t s_task_mem;
+static StackType_t s_task_stack[TEST_TASK_STACK];
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static test_counters_t s_sink;
+static test_counters_t s_source;
+static uint16_t s_stats_conn = BLE_HS_CONN_HANDLE_NONE;  // Last phone to use the service (for the link parameters)
+static uint16_t s_source_conn = BLE_HS_CONN_HANDLE_NONE; // Set while the source is running
+static int64_t s_source_end_us = 0;                      // 0 = run until stopped
+static uint8_t s_source_buf[512];
+
+/* ****************** Service / Characteristics Definitions ***************** */
+static const struct ble_gatt_chr_def test_chrs[] = {
+    {
+        .uuid = (const ble_uuid_t *)&TEST_SINK_UUID,
+        .access_cb = test_sink_callback,
+        .flags = BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_WRITE_NO_RSP,
+    },
+    {
+        .uuid = (const ble_uuid_t *)&TEST_SOURCE_UUID,
+        .access_cb = test_source_callback,
+        .val_handle = &s_source_val_handle,
+        .flags = BLE_GATT_CHR_F_NOTIFY,
+    },
+    {
+        .uuid = (const ble_uuid_t *)&TEST_CTRL_UUID,
+        .access_cb = test_ctrl_callback,
+        .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE,
+    },
+    {0}};
+
+static const struct ble_gatt_svc_def test_svcs[] = {
+    {
+        .type = BLE_GATT_SVC_TYPE_PRIMARY,
+        .uuid = (const ble_uuid_t *)&TEST_SVC_UUID,
+        .characteristics = test_chrs,
+    },
+    {0}};
+
+// Passing back to js_ble.c for registration
+const struct ble_gatt_svc_def *js_ble_test_get_svcs(void) {
+    return test_svcs;
+}
+
+/** Start the source task (it sleeps until START) */
+esp_err_t js_ble_test_init(void) {
+    s_task = xTaskCreateStatic(source_task, "ble_test", TEST_TASK_STACK, NULL, TEST_TASK_PRIORITY, s_task_stack, &s_task_mem);
+    if (!s_task) return ESP_ERR_NO_MEM;
+    return ESP_OK;
+}
+
+/* ************************** Global Functions ************************** */
+// A notification went out, so there may be a buffer free again (called from the GAP event handler in js_ble.c)
+void js_ble_test_on_notify_tx(uint16_t conn_handle) {
+    if (s_task && conn_handle == s_source_conn) xTaskNotifyGive(s_task);
+}
+
+// Stop streaming to a phone that went away
+void js_ble_test_on_disconnect(uint16_t conn_handle) {
+    if (conn_handle == s_source_conn) s_source_conn = BLE_HS_CONN_HANDLE_NONE;
+    if (conn_handle == s_stats_conn) s_stats_conn = BLE_HS_CONN_HANDLE_NONE;
+}
+
+/* ************************** Callback Functions ************************** */
+// Count and drop the data, checking the sequence number for lost packets
+static int test_sink_callback(uint16_t conn_handle, uint16_t attr_handle,
+                              struct ble_gatt_access_ctxt *ctxt, void *arg) {
+    if (ctxt->op != BLE_GATT_ACCESS_OP_WRITE_CHR) return BLE_ATT_ERR_READ_NOT_PERMITTED;
+
+    uint16_t len = OS_MBUF_PKTLEN(ctxt->om);
+    uint8_t seq_bytes[4];
+    if (len < sizeof(seq_bytes) || os_mbuf_copydata(ctxt->om, 0, sizeof(seq_bytes), seq_bytes) != 0) {
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    }
+    uint32_t seq = seq_bytes[0] | (seq_bytes[1] << 8) | (seq_bytes[2] << 16) | ((uint32_t)seq_bytes[3] << 24);
+    int64_t now_us = esp_timer_get_time();
+
+    taskENTER_CRITICAL(&s_lock);
+    if (s_sink.packets == 0) {
+        s_sink.first_us = now_us;
+    } else if (seq > s_sink.next_seq) {
+        s_sink.lost += seq - s_sink.next_seq;
+    }
+    s_sink.next_seq = seq + 1;
+    s_sink.bytes += len;
+    s_sink.packets++;
+    s_sink.last_us = now_us;
+    taskEXIT_CRITICAL(&s_lock);
+
+    s_stats_conn = conn_handle;
+    js_ble_conn_add_rx(conn_handle, len);
+    return 0;
+}
+
+// Notify only
+static int test_source_callback(uint16_t conn_handle, uint16_t attr_handle,
+                                struct ble_gatt_access_ctxt *ctxt, void *arg) {
+    return BLE_ATT_ERR_READ_NOT_PERMITTED;
+}
+
+// Write runs a command, read returns the stats
+static int test_ctrl_callback(uint16_t conn_handle, uint16_t attr_handle,
+                              struct ble_gatt_access_ctxt *ctxt, void *arg) {
+    if (ctxt->op == BLE_GATT_ACCESS_OP_READ_CHR) {
+        test_stats_t stats;
+        build_stats(conn_handle, &stats);
+        return os_mbuf_append(ctxt->om, &stats, sizeof(stats)) == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+    }
+    if (ctxt->op != BLE_GATT_ACCESS_OP_WRITE_CHR) return BLE_ATT_ERR_UNLIKELY;
+
+    uint8_t buf[3] = {0};
+    uint16_t len = 0;
+    if (OS_MBUF_PKTLEN(ctxt->om) > sizeof(buf)) return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    if (ble_hs_mbuf_to_flat(ctxt->om, buf, sizeof(buf), &len) != 0 || len == 0) return BLE_ATT_ERR_UNLIKELY;
+    s_stats_conn = conn_handle;
+
+    switch (buf[0]) {
+    case OP_RESET:
+        taskENTER_CRITICAL(&s_lock);
+        memset(&s_sink, 0, sizeof(s_sink));
+        memset(&s_source, 0, sizeof(s_source));
+        taskEXIT_CRITICAL(&s_lock);
+        ESP_LOGI(TAG, "Counters reset");
+        return 0;
+
+    case OP_START_SOURCE: {
+        uint16_t seconds = len >= 3 ? buf[1] | (buf[2] << 8) : 0;
+        js_ble_request_fast_link(conn_handle);
+        taskENTER_CRITICAL(&s_lock);
+        memset(&s_source, 0, sizeof(s_source));
+        taskEXIT_CRITICAL(&s_lock);
+        s_source_end_us = seconds ? esp_timer_get_time() + seconds * 1000000LL : 0;
+        s_source_conn = conn_handle;
+        ESP_LOGI(TAG, "Source started (%u s)", seconds);
+        xTaskNotifyGive(s_task);
+        return 0;
+    }
+
+    case OP_STOP_SOURCE:
+        s_source_conn = BLE_HS_CONN_HANDLE_NONE;
+        return 0;
+
+    default:
+        return BLE_ATT_ERR_REQ_NOT_SUPPORTED;
+    }
+}
+
+/* ************************** Local Functions ************************** */
+// Stream notifications while the source is running, otherwise log the sink stats once a second
+static void source_task(void *arg) {
+    int64_t last_log_us = 0;
+    uint32_t last_logged_packets = 0;
+    for (size_t i = 0; i < sizeof(s_source_buf); i++) s_source_buf[i] = i & 0xFF;
+
+    for (;;) {
+        uint16_t conn_handle = s_source_conn;
+        int64_t now_us = esp_timer_get_time();
+
+        // Log while there's traffic in either direction
+        if (now_us - last_log_us >= LOG_PERIOD_US) {
+            last_log_us = now_us;
+            if (s_sink.packets + s_source.packets != last_logged_packets) log_stats();
+            last_logged_packets = s_sink.packets + s_source.packets;
+        }
+
+        if (conn_handle == BLE_HS_CONN_HANDLE_NONE) {
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(1000));
+            continue;
+        }
+
+        if (s_source_end_us && now_us >= s_source_end_us) {
+            ESP_LOGI(TAG, "Source finished");
+            s_source_conn = BLE_HS_CONN_HANDLE_NONE;
+            log_stats();
+            continue;
+        }
+
+        uint16_t mtu = ble_att_mtu(conn_handle);
+        if (mtu == 0) {
+            s_source_conn = BLE_HS_CONN_HANDLE_NONE;
+            continue;
+        }
+        size_t len = mtu - 3;
+        if (len > sizeof(s_source_buf)) len = sizeof(s_source_buf);
+        uint32_t seq = s_source.next_seq;
+        s_source_buf[0] = seq & 0xFF;
+        s_source_buf[1] = (seq >> 8) & 0xFF;
+        s_source_buf[2] = (seq >> 16) & 0xFF;
+        s_source_buf[3] = (seq >> 24) & 0xFF;
+
+        // Out of buffers is the flow control: wait for a notification to complete (NOTIFY_TX) and try again
+        struct os_mbuf *om = ble_hs_mbuf_from_flat(s_source_buf, len);
+        int rc = om ? ble_gatts_notify_custom(conn_handle, s_source_val_handle, om) : BLE_HS_ENOMEM;
+        if (rc == BLE_HS_ENOMEM) {
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CREDIT_WAIT_MS));
+            continue;
+        }
+        if (rc != 0) {
+            ESP_LOGW(TAG, "Source notify failed: %d, stopping", rc);
+            s_source_conn = BLE_HS_CONN_HANDLE_NONE;
+            continue;
+        }
+
+        taskENTER_CRITICAL(&s_lock);
+        if (s_source.packets == 0) s_source.first_us = now_us;
+        s_source.next_seq = seq + 1;
+        s_source.bytes += len;
+        s_source.packets++;
+        s_source.last_us = esp_timer_get_time();
+        taskEXIT_CRITICAL(&s_lock);
+        js_ble_conn_add_tx(conn_handle, len);
+    }
+}
+
+// Counters plus what they mean for the current link
+static void build_stats(uint16_t conn_handle, test_stats_t *stats) {
+    test_counters_t sink, source;
+    taskENTER_CRITICAL(&s_lock);
+    sink = s_sink;
+    source = s_source;
+    taskEXIT_CRITICAL(&s_lock);
+
+    memset(stats, 0, sizeof(*stats));
+    stats->sink_bytes = sink.bytes;
+    stats->sink_packets = sink.packets;
+    stats->sink_lost = sink.lost;
+    stats->sink_bps = bytes_per_second(&sink);
+    stats->source_bytes = source.bytes;
+    stats->source_packets = source.packets;
+    stats->source_bps = bytes_per_second(&source);
+
+    struct ble_gap_conn_desc desc;
+    uint8_t tx_phy = 1, rx_phy = 1;
+    if (ble_gap_conn_find(conn_handle, &desc) != 0) return;
+    ble_gap_read_le_phy(conn_handle, &tx_phy, &rx_phy);
+    stats->conn_itvl = desc.conn_itvl;
+    stats->tx_phy = tx_phy;
+
+    // Connection events and airtime over whichever direction ran longer
+    const test_counters_t *busiest = (sink.last_us - sink.first_us) > (source.last_us - source.first_us) ? &sink : &source;
+    int64_t elapsed_us = busiest->last_us - busiest->first_us;
+    int64_t itvl_us = desc.conn_itvl * 1250LL;
+    if (elapsed_us <= 0 || itvl_us == 0) return;
+    int64_t events = elapsed_us / itvl_us + 1;
+    stats->pkts_per_event_x10 = busiest->packets * 10LL / events;
+    int64_t permille = estimate_airtime_us(busiest, busiest == &sink ? rx_phy : tx_phy) * 1000LL / elapsed_us;
+    stats->utilization_permille = permille > 1000 ? 1000 : permille;
+}
+
+static uint32_t bytes_per_second(const test_counters_t *c) {
+    int64_t elapsed_us = c->last_us - c->first_us;
+    return elapsed_us > 0 ? c->bytes * 1000000LL / elapsed_us : 0;
+}
+
+/**
+ * Rough radio time used by the counted packets: each ATT packet as one LL data packet
+ * (plus headers), the peer's empty ack and two inter-frame spaces. Coded PHY is counted as 1M.
+ */
+static uint32_t estimate_airtime_us(const test_counters_t *c, uint8_t phy) {
+    if (c->packets == 0) return 0;
+    uint32_t bits_per_us = phy == BLE_GAP_LE_PHY_2M ? 2 : 1;
+    uint64_t air_bytes = c->bytes + (uint64_t)c->packets * (ATT_L2CAP_HEADER + LL_OVERHEAD + LL_EMPTY_PDU);
+    return air_bytes * 8 / bits_per_us + (uint64_t)c->packets * 2 * LL_IFS_US;
+}
+
+static void log_stats(void) {
+    test_stats_t stats;
+    build_stats(s_stats_conn, &stats);
+    ESP_LOGI(TAG, "Sink %lu B (%lu B/s, %lu pkts, %lu lost) | Source %lu B (%lu B/s, %lu pkts) | itvl %u, phy %u, %u.%u pkts/event, %u.%u%% airtime",
+             (unsigned long)stats.sink_bytes, (unsigned long)stats.sink_bps, (unsigned long)stats.sink_packets, (unsigned long)stats.sink_lost,
+             (unsigned long)stats.source_bytes, (unsigned long)stats.source_bps, (unsigned long)stats.source_packets,
+             stats.conn_itvl, stats.tx_phy, stats.pkts_per_event_x10 / 10, stats.pkts_per_event_x10 % 10,
+             stats.utilization_permille / 10, stats.utilization_permille % 10);
+}
@@ -0,0 +1,440 @@
+/**
+ * Bulk transfer engine (see js_ble_xfer.h for the protocol)
+ * The NimBLE host task only validates and copies packets into a fixed pool of buffers.
+ * Flash writes happen in a separate low priority task so BLE and audio keep running.
+ */
+
+// Self Include
+#include "js_ble_xfer.h"
+
+// Library Includes
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "host/ble_hs.h"
+#include <string.h>
+
+// Local Includes
+#include "js_ble_gatt.h"
+
+// Defines
+#define TAG "js_ble_xfer"
+#define XFER_SLOT_COUNT 8
+#define XFER_SLOT_SIZE 512 // Largest ATT write payload with a 517 MTU, less the offset header
+#define XFER_DATA_HEADER 4 // u32 offset
+#define XFER_CRC_HEADER 2  // u16 chunk CRC (sinks with chunk_crc)
+#define XFER_ACK_PACKETS (XFER_SLOT_COUNT / 2)
+#define XFER_TASK_PRIORITY 3 // Below audio (10) so playback isn't disturbed
+#define XFER_TASK_STACK 4096
+#define XFER_QUEUE_LENGTH (XFER_SLOT_COUNT + 4)
+
+// Messages from the host task to the transfer task
+typedef enum {
+    MSG_BEGIN,
+    MSG_DATA,
+    MSG_END,
+    MSG_ABORT,
+    MSG_STATUS,
+} xfer_msg_type_t;
+
+typedef struct {
+    xfer_msg_type_t type;
+    uint8_t slot; // MSG_DATA buffer
+    uint16_t len; // MSG_DATA length
+    uint16_t conn_handle;
+    uint16_t ctrl_handle;
+} xfer_msg_t;
+
+// The current (or last) transfer
+typedef struct {
+    const js_ble_xfer_sink_t *sink;
+    bool open; // Sink has begun and not finished/aborted (can be resumed)
+    uint32_t size;
+    uint32_t crc32;
+    uint8_t arg[JS_XFER_ARG_MAX];
+    size_t arg_len;
+    uint32_t written; // Bytes written to the sink
+    uint32_t running_crc;
+    uint32_t last_ack;
+    uint16_t unacked_packets; // Packets written since the last ACK
+    uint32_t last_progress;
+    uint16_t conn_handle;
+    uint16_t ctrl_handle;
+    int64_t start_us;
+    uint32_t start_offset; // Offset the current run started from (for throughput after a resume)
+} xfer_session_t;
+
+// Forward Declarations
+static QueueHandle_t s_msg_queue = NULL;
+static QueueHandle_t s_free_slots = NULL;
+static StaticQueue_t s_msg_queue_mem;
+static StaticQueue_t s_free_slots_mem;
+static uint8_t s_msg_queue_storage[XFER_QUEUE_LENGTH * sizeof(xfer_msg_t)];
+static uint8_t s_free_slots_storage[XFER_SLOT_COUNT * sizeof(uint8_t)];
+static StaticTask_t s_task_mem;
+static StackType_t s_task_stack[XFER_TASK_STACK];
+static uint8_t s_slots[XFER_SLOT_COUNT][XFER_SLOT_SIZE];
+static xfer_session_t s_session; // Written by the transfer task under s_session_lock, read via session_snapshot()
+static portMUX_TYPE s_session_lock = portMUX_INITIALIZER_UNLOCKED;
+static xfer_session_t s_pending_begin; // Filled by the host task, applied by the transfer task
+static volatile bool s_begin_pending = false;
+static volatile bool s_accepting = false; // Host task accepts data packets
+static volatile uint32_t s_expected = 0;  // Next offset the host task will accept
+static bool s_nack_sent = false;
+static void xfer_task(void *arg);
+static void handle_begin(const xfer_msg_t *msg);
+static void handle_data(const xfer_msg_t *msg);
+static void handle_end(const xfer_msg_t *msg);
+static void close_session(bool abort);
+static xfer_session_t session_snapshot(void);
+static void send_response(uint16_t conn_handle, uint16_t ctrl_handle, uint8_t rsp, js_xfer_status_t status, const uint32_t *offset);
+static void put_le32(uint8_t *p, uint32_t v);
+static uint32_t get_le32(const uint8_t *p);
+static uint16_t crc16_ccitt(const uint8_t *data, size_t len);
+
+/** Create the buffer pool and the transfer task */
+esp_err_t js_ble_xfer_init(void) {
+    s_msg_queue = xQueueCreateStatic(XFER_QUEUE_LENGTH, sizeof(xfer_msg_t), s_msg_queue_storage, &s_msg_queue_mem);
+    s_free_slots = xQueueCreateStatic(XFER_SLOT_COUNT, sizeof(uint8_t), s_free_slots_storage, &s_free_slots_mem);
+    if (!s_msg_queue || !s_free_slots) return ESP_ERR_NO_MEM;
+
+    for (uint8_t i = 0; i < XFER_SLOT_COUNT; i++) xQueueSend(s_free_slots, &i, 0);
+
+    if (!xTaskCreateStatic(xfer_task, "ble_xfer", XFER_TASK_STACK, NULL, XFER_TASK_PRIORITY, s_task_stack, &s_task_mem)) return ESP_ERR_NO_MEM;
+    return ESP_OK;
+}
+
+/* ************************** Global Functions ************************** */
+// Control characteristic write (NimBLE host task)
+int js_ble_xfer_control(const js_ble_xfer_sink_t *sink, uint16_t conn_handle, uint16_t ctrl_val_handle, struct os_mbuf *om) {
+    uint8_t buf[1 + 8 + JS_XFER_ARG_MAX];
+    uint16_t len = OS_MBUF_PKTLEN(om);
+    if (len < 1 || len > sizeof(buf)) return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    if (ble_hs_mbuf_to_flat(om, buf, sizeof(buf), &len) != 0) return BLE_ATT_ERR_UNLIKELY;
+    js_ble_conn_add_rx(conn_handle, len);
+
+    xfer_msg_t msg = {.conn_handle = conn_handle, .ctrl_handle = ctrl_val_handle};
+
+    switch (buf[0]) {
+    case JS_XFER_OP_BEGIN: {
+        if (len < 9) return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+
+        // Only one transfer at a time (across services and phones), unless the other one's phone has gone away
+        xfer_session_t session = session_snapshot();
+        struct ble_gap_conn_desc desc;
+        bool other_active = session.open && (session.sink != sink || session.conn_handle != conn_handle) &&
+                            ble_gap_conn_find(session.conn_handle, &desc) == 0;
+        if (s_begin_pending || other_active) {
+            send_response(conn_handle, ctrl_val_handle, JS_XFER_RSP_BEGIN, JS_XFER_ERR_BUSY, NULL);
+            return 0;
+        }
+
+        memset(&s_pending_begin, 0, sizeof(s_pending_begin));
+        s_pending_begin.sink = sink;
+        s_pending_begin.size = get_le32(buf + 1);
+        s_pending_begin.crc32 = get_le32(buf + 5);
+        s_pending_begin.arg_len = len - 9;
+        memcpy(s_pending_begin.arg, buf + 9, s_pending_begin.arg_len);
+
+        // Stop taking data until the transfer task has opened (or resumed) the session
+        s_accepting = false;
+        s_begin_pending = true;
+        msg.type = MSG_BEGIN;
+
+        // Ask for the fastest link the phone allows (short interval, 2M PHY, long packets)
+        js_ble_request_fast_link(conn_handle);
+        break;
+    }
+
+    case JS_XFER_OP_END:
+    case JS_XFER_OP_ABORT:
+    case JS_XFER_OP_STATUS: {
+        xfer_session_t session = session_snapshot();
+        if (session.sink != sink || session.conn_handle != conn_handle) {
+            uint8_t rsp = buf[0] == JS_XFER_OP_END ? JS_XFER_RSP_END : buf[0] == JS_XFER_OP_ABORT ? JS_XFER_RSP_ABORT : JS_XFER_RSP_STATUS;
+            send_response(conn_handle, ctrl_val_handle, rsp, JS_XFER_ERR_NO_SESSION, NULL);
+            return 0;
+        }
+        if (buf[0] != JS_XFER_OP_STATUS) s_accepting = false;
+        msg.type = buf[0] == JS_XFER_OP_END ? MSG_END : buf[0] == JS_XFER_OP_ABORT ? MSG_ABORT : MSG_STATUS;
+        break;
+    }
+
+    default:
+        return BLE_ATT_ERR_REQ_NOT_SUPPORTED;
+    }
+
+    // Queued behind any data so the transfer task sees everything in order
+    if (xQueueSend(s_msg_queue, &msg, 0) != pdTRUE) {
+        if (msg.type == MSG_BEGIN) s_begin_pending = false;
+        return BLE_ATT_ERR_INSUFFICIENT_RES;
+    }
+    return 0;
+}
+
+// Data characteristic write without response (NimBLE host task)
+int js_ble_xfer_data(const js_ble_xfer_sink_t *sink, uint16_t conn_handle, struct os_mbuf *om) {
+    if (!s_accepting) return 0;
+    xfer_session_t session = session_snapshot();
+    if (session.sink != sink || session.conn_handle != conn_handle) return 0; // Not this phone's session: it waits for a BEGIN response anyway
+    js_ble_conn_add_rx(conn_handle, OS_MBUF_PKTLEN(om));
+
+    uint16_t header_len = XFER_DATA_HEADER + (sink->chunk_crc ? XFER_CRC_HEADER : 0);
+    uint16_t len = OS_MBUF_PKTLEN(om);
+    if (len <= header_len || len > header_len + XFER_SLOT_SIZE) return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+
+    uint8_t header[XFER_DATA_HEADER + XFER_CRC_HEADER];
+    if (os_mbuf_copydata(om, 0, header_len, header) != 0) return BLE_ATT_ERR_UNLIKELY;
+    uint32_t offset = get_le32(header);
+    uint16_t payload_len = len - header_len;
+    uint32_t expected = s_expected;
+
+    // Already have it (a resend after a NACK), ignore
+    if (offset < expected) return 0;
+
+    // Gap or past the end: tell the phone where to resend from (once per gap)
+    js_xfer_status_t status = JS_XFER_OK;
+    uint8_t slot;
+    if (offset > expected || offset + payload_len > session.size) {
+        status = JS_XFER_ERR_INVALID;
+    } else if (xQueueReceive(s_free_slots, &slot, 0) != pdTRUE) {
+        status = JS_XFER_ERR_NO_BUFFER; // The phone sent more than the window
+    }
+
+    // Copy into the buffer and check the chunk CRC before accepting it
+    if (status == JS_XFER_OK) {
+        os_mbuf_copydata(om, header_len, payload_len, s_slots[slot]);
+        if (sink->chunk_crc && crc16_ccitt(s_slots[slot], payload_len) != (header[4] | (header[5] << 8))) {
+            xQueueSend(s_free_slots, &slot, 0);
+            status = JS_XFER_ERR_CRC;
+        }
+    }
+
+    if (status != JS_XFER_OK) {
+        if (!s_nack_sent) send_response(conn_handle, session.ctrl_handle, JS_XFER_RSP_NACK, status, &expected);
+        s_nack_sent = true;
+        return 0;
+    }
+
+    // Hand it to the transfer task
+    xfer_msg_t msg = {.type = MSG_DATA, .slot = slot, .len = payload_len};
+    xQueueSend(s_msg_queue, &msg, 0); // Can't be full, the queue is longer than the slot pool
+    s_expected = expected + payload_len;
+    s_nack_sent = false;
+    return 0;
+}
+
+/* ************************** Transfer Task ************************** */
+static void xfer_task(void *arg) {
+    xfer_msg_t msg;
+
+    for (;;) {
+        if (xQueueReceive(s_msg_queue, &msg, portMAX_DELAY) != pdTRUE) continue;
+
+        switch (msg.type) {
+        case MSG_BEGIN:
+            handle_begin(&msg);
+            break;
+
+        case MSG_DATA:
+            handle_data(&msg);
+            xQueueSend(s_free_slots, &msg.slot, 0);
+            break;
+
+        case MSG_END:
+            handle_end(&msg);
+            break;
+
+        case MSG_ABORT:
+            ESP_LOGI(TAG, "%s: aborted at %lu bytes", s_session.sink->name, (unsigned long)s_session.written);
+            close_session(true);
+            send_response(msg.conn_handle, msg.ctrl_handle, JS_XFER_RSP_ABORT, JS_XFER_OK, NULL);
+            break;
+
+        case MSG_STATUS:
+            send_response(msg.conn_handle, msg.ctrl_handle, JS_XFER_RSP_STATUS, s_session.open ? JS_XFER_OK : JS_XFER_ERR_NO_SESSION, &s_session.written);
+            break;
+        }
+    }
+}
+
+// Open a new session, or resume the open one if it's the same transfer
+static void handle_begin(const xfer_msg_t *msg) {
+    xfer_session_t *req = &s_pending_begin;
+    bool resume = s_session.open && s_session.sink == req->sink && s_session.size == req->size &&
+                  s_session.crc32 == req->crc32 && s_session.arg_len == req->arg_len &&
+                  memcmp(s_session.arg, req->arg, req->arg_len) == 0;
+
+    js_xfer_status_t status = JS_XFER_OK;
+    if (resume) {
+        ESP_LOGI(TAG, "%s: resuming at %lu/%lu bytes", req->sink->name, (unsigned long)s_session.written, (unsigned long)s_session.size);
+    } else {
+        // Drop whatever was open before
+        if (s_session.open) close_session(true);
+
+        esp_err_t err = req->size == 0 ? ESP_ERR_INVALID_SIZE : req->sink->begin(req->size, req->arg, req->arg_len);
+        if (err == ESP_OK) {
+            taskENTER_CRITICAL(&s_session_lock);
+            s_session = *req;
+            s_session.open = true;
+            taskEXIT_CRITICAL(&s_session_lock);
+            ESP_LOGI(TAG, "%s: starting %lu bytes", req->sink->name, (unsigned long)req->size);
+        } else {
+            ESP_LOGE(TAG, "%s: begin failed: %s", req->sink->name, esp_err_to_name(err));
+            status = JS_XFER_ERR_INVALID;
+        }
+    }
+
+    taskENTER_CRITICAL(&s_session_lock);
+    s_session.conn_handle = msg->conn_handle;
+    s_session.ctrl_handle = msg->ctrl_handle;
+    taskEXIT_CRITICAL(&s_session_lock);
+    s_session.start_us = esp_timer_get_time();
+    s_session.start_offset = s_session.written;
+    s_session.last_ack = s_session.written;
+    s_session.unacked_packets = 0;
+
+    // Start accepting from where the flash write got to
+    s_expected = s_session.written;
+    s_nack_sent = false;
+    s_accepting = status == JS_XFER_OK;
+    s_begin_pending = false;
+
+    // [0x81][status][u32 resume offset][u16 window bytes][u16 max payload bytes]
+    // Each packet takes a whole slot whatever its size, so the window is one full-size packet per slot
+    uint8_t rsp[10] = {JS_XFER_RSP_BEGIN, status};
+    uint16_t max_payload = ble_att_mtu(msg->conn_handle) - 3 - XFER_DATA_HEADER - (req->sink->chunk_crc ? XFER_CRC_HEADER : 0);
+    if (max_payload > XFER_SLOT_SIZE) max_payload = XFER_SLOT_SIZE;
+    uint16_t window_bytes = XFER_SLOT_COUNT * max_payload;
+    put_le32(rsp + 2, s_session.written);
+    rsp[6] = window_bytes & 0xFF;
+    rsp[7] = window_bytes >> 8;
+    rsp[8] = max_payload & 0xFF;
+    rsp[9] = max_payload >> 8;
+    struct os_mbuf *om = ble_hs_mbuf_from_flat(rsp, sizeof(rsp));
+    if (om) ble_gatts_notify_custom(msg->conn_handle, msg->ctrl_handle, om);
+}
+
+// Write a data buffer to the sink and ACK every half window (in packets, as that's what frees the slots)
+static void handle_data(const xfer_msg_t *msg) {
+    if (!s_session.open) return;
+
+    esp_err_t err = s_session.sink->write(s_slots[msg->slot], msg->len);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "%s: write failed at %lu: %s", s_session.sink->name, (unsigned long)s_session.written, esp_err_to_name(err));
+        s_accepting = false;
+        send_response(s_session.conn_handle, s_session.ctrl_handle, JS_XFER_RSP_ACK, JS_XFER_ERR_WRITE, &s_session.written);
+        close_session(true);
+        return;
+    }
+
+    s_session.running_crc = esp_rom_crc32_le(s_session.running_crc, s_slots[msg->slot], msg->len);
+    s_session.written += msg->len;
+    s_session.unacked_packets++;
+
+    if (s_session.unacked_packets >= XFER_ACK_PACKETS || s_session.written == s_session.size) {
+        s_session.last_ack = s_session.written;
+        s_session.unacked_packets = 0;
+        send_response(s_session.conn_handle, s_session.ctrl_handle, JS_XFER_RSP_ACK, JS_XFER_OK, &s_session.written);
+    }
+
+    // Progress and throughput every 10%
+    if (s_session.written - s_session.last_progress >= s_session.size / 10) {
+        int64_t elapsed_ms = (esp_timer_get_time() - s_session.start_us) / 1000;
+        uint32_t run_bytes = s_session.written - s_session.start_offset;
+        s_session.last_progress = s_session.written;
+        ESP_LOGI(TAG, "%s: %lu/%lu bytes (%lu B/s)", s_session.sink->name, (unsigned long)s_session.written,
+                 (unsigned long)s_session.size, (unsigned long)(elapsed_ms > 0 ? run_bytes * 1000LL / elapsed_ms : 0));
+    }
+}
+
+// Check everything arrived intact, then let the sink finish
+static void handle_end(const xfer_msg_t *msg) {
+    js_xfer_status_t status = JS_XFER_OK;
+
+    if (!s_session.open || s_session.written != s_session.size) {
+        status = JS_XFER_ERR_NO_SESSION;
+    } else if (s_session.running_crc != s_session.crc32) {
+        ESP_LOGE(TAG, "%s: CRC mismatch (got 0x%08lx, expected 0x%08lx)", s_session.sink->name,
+                 (unsigned long)s_session.running_crc, (unsigned long)s_session.crc32);
+        status = JS_XFER_ERR_CRC;
+        close_session(true);
+    } else {
+        int64_t elapsed_ms = (esp_timer_get_time() - s_session.start_us) / 1000;
+        uint32_t run_bytes = s_session.written - s_session.start_offset;
+        ESP_LOGI(TAG, "%s: received %lu bytes in %lld ms (%lu B/s)", s_session.sink->name, (unsigned long)run_bytes,
+                 elapsed_ms, (unsigned long)(elapsed_ms > 0 ? run_bytes * 1000LL / elapsed_ms : 0));
+
+        esp_err_t err = s_session.sink->finish();
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "%s: finish failed: %s", s_session.sink->name, esp_err_to_name(err));
+            status = JS_XFER_ERR_WRITE;
+        }
+        taskENTER_CRITICAL(&s_session_lock);
+        s_session.open = false;
+        taskEXIT_CRITICAL(&s_session_lock);
+    }
+
+    send_response(msg->conn_handle, msg->ctrl_handle, JS_XFER_RSP_END, status, NULL);
+}
+
+/* ************************** Local Functions ************************** */
+static void close_session(bool abort) {
+    if (s_session.open && abort) s_session.sink->abort();
+    taskENTER_CRITICAL(&s_session_lock);
+    s_session.open = false;
+    taskEXIT_CRITICAL(&s_session_lock);
+    s_accepting = false;
+}
+
+// Copy of the session for the host task (the transfer task changes it between packets)
+static xfer_session_t session_snapshot(void) {
+    taskENTER_CRITICAL(&s_session_lock);
+    xfer_session_t session = s_session;
+    taskEXIT_CRITICAL(&s_session_lock);
+    return session;
+}
+
+// Notify [rsp][status] with an optional u32 offset on the control characteristic
+static void send_response(uint16_t conn_handle, uint16_t ctrl_handle, uint8_t rsp, js_xfer_status_t status, const uint32_t *offset) {
+    uint8_t buf[6] = {rsp, status};
+    size_t len = 2;
+    if (offset) {
+        put_le32(buf + 2, *offset);
+        len += 4;
+    }
+
+    struct os_mbuf *om = ble_hs_mbuf_from_flat(buf, len);
+    if (!om) return;
+    int rc = ble_gatts_notify_custom(conn_handle, ctrl_handle, om);
+    if (rc != 0)
+        ESP_LOGW(TAG, "Response 0x%02x notify failed: %d", rsp, rc);
+    else
+        js_ble_conn_add_tx(conn_handle, len);
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// CRC-16/CCITT-FALSE (poly 0x1021, init 0xFFFF), easy to match on the phone side
+static uint16_t crc16_ccitt(const uint8_t *data, size_t len) {
+    uint16_t crc = 0xFFFF;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= (uint16_t)data[i] << 8;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
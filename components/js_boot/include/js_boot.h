@@ -0,0 +1,17 @@
+#pragma once
+#include "esp_bit_defs.h"
+#include "esp_err.h"
+#include <stdint.h>
+
+#define JS_BOOT_MAX_STEPS 24 // Event group bits
+
+// One init step. deps is a mask of the steps that have to finish first, BIT(index) of each.
+typedef struct {
+    const char *name;
+    esp_err_t (*init)(void);
+    uint32_t deps;
+} js_boot_step_t;
+
+// Functions
+esp_err_t js_boot_run(const js_boot_step_t *steps, int count);
+void js_boot_print_timeline(void);
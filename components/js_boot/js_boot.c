@@ -0,0 +1,123 @@
+/**
+ * Boot
+ * Runs the init steps from a table, each as soon as the steps it depends on are done, so independent inits
+ * overlap (the BLE controller, NVS, the RTC read and the file system mount all spend most of their time waiting).
+ * Every step gets its own short lived task that waits for its dependencies on an event group. A step whose
+ * dependency failed is skipped. How long each step took is kept for the boot timeline.
+ */
+
+// Self Include
+#include "js_boot.h"
+
+// Library Includes
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/task.h"
+#include <stdbool.h>
+#include <stdio.h>
+
+// Defines
+#define TAG "js_boot"
+#define STEP_STACK 4096     // The largest init (NimBLE) ran on the app_main stack before
+#define TIMELINE_COLUMNS 50 // Width of the bars in the timeline
+
+// Types
+typedef struct {
+    const js_boot_step_t *step;
+    int64_t start_us;
+    int64_t end_us;
+    esp_err_t err;
+} step_run_t;
+
+// Forward Declarations
+static step_run_t s_runs[JS_BOOT_MAX_STEPS];
+static int s_count = 0;
+static int64_t s_boot_start_us = 0;
+static int64_t s_boot_end_us = 0;
+static EventGroupHandle_t s_done = NULL; // Bit per step, set when it finished (or failed, or was skipped)
+static StaticEventGroup_t s_done_mem;
+static void step_task(void *arg);
+
+/* ************************** Global Functions ************************** */
+/**
+ * Run the steps (each in its own task, at the caller's priority) and wait for all of them.
+ * Returns the first error, after every step that could run has run.
+ */
+esp_err_t js_boot_run(const js_boot_step_t *steps, int count) {
+    if (count > JS_BOOT_MAX_STEPS) return ESP_ERR_INVALID_SIZE;
+
+    if (!s_done) s_done = xEventGroupCreateStatic(&s_done_mem);
+    if (!s_done) return ESP_ERR_NO_MEM;
+    xEventGroupClearBits(s_done, (1UL << JS_BOOT_MAX_STEPS) - 1);
+
+    s_count = count;
+    s_boot_start_us = esp_timer_get_time();
+    UBaseType_t priority = uxTaskPriorityGet(NULL);
+    for (int i = 0; i < count; i++) {
+        s_runs[i] = (step_run_t){.step = &steps[i], .err = ESP_ERR_INVALID_STATE};
+        if (xTaskCreate(step_task, steps[i].name, STEP_STACK, (void *)i, priority, NULL) != pdPASS) {
+            ESP_LOGE(TAG, "No memory for the %s task", steps[i].name);
+            s_runs[i].err = ESP_ERR_NO_MEM; // Its dependents are skipped
+            s_runs[i].start_us = s_runs[i].end_us = esp_timer_get_time();
+            xEventGroupSetBits(s_done, BIT(i));
+        }
+    }
+
+    EventBits_t all = (1UL << count) - 1;
+    xEventGroupWaitBits(s_done, all, pdFALSE, pdTRUE, portMAX_DELAY);
+    s_boot_end_us = esp_timer_get_time();
+
+    esp_err_t ret = ESP_OK;
+    for (int i = 0; i < count && ret == ESP_OK; i++) ret = s_runs[i].err;
+    return ret;
+}
+
+/**
+ * Print when each step ran, from the first step to the last one finishing:
+ * "  name      start ms  took ms  |   #####          |"
+ */
+void js_boot_print_timeline(void) {
+    int64_t span_us = s_boot_end_us - s_boot_start_us;
+    if (span_us <= 0) return;
+
+    ESP_LOGI(TAG, "Boot: %lld ms since reset, %lld ms in %d init steps", s_boot_end_us / 1000, span_us / 1000, s_count);
+    for (int i = 0; i < s_count; i++) {
+        const step_run_t *run = &s_runs[i];
+        char bar[TIMELINE_COLUMNS + 1];
+        int first = (run->start_us - s_boot_start_us) * TIMELINE_COLUMNS / span_us;
+        int last = (run->end_us - s_boot_start_us) * TIMELINE_COLUMNS / span_us;
+        for (int c = 0; c < TIMELINE_COLUMNS; c++) bar[c] = (c >= first && c <= last) ? '#' : ' ';
+        bar[TIMELINE_COLUMNS] = '\0';
+
+        printf("  %-14s %6lld ms %6lld ms |%s| %s\n", run->step->name, (run->start_us - s_boot_start_us) / 1000,
+               (run->end_us - run->start_us) / 1000, bar, run->err == ESP_OK ? "" : esp_err_to_name(run->err));
+    }
+}
+
+/* ************************** Local Functions ************************** */
+// Wait for the step's dependencies, run it and mark it done (failed too, so its dependents don't wait forever)
+static void step_task(void *arg) {
+    int index = (int)arg;
+    step_run_t *run = &s_runs[index];
+    const js_boot_step_t *step = run->step;
+
+    if (step->deps) xEventGroupWaitBits(s_done, step->deps, pdFALSE, pdTRUE, portMAX_DELAY);
+
+    run->start_us = esp_timer_get_time();
+    bool deps_ok = true;
+    for (int d = 0; d < s_count; d++) {
+        if ((step->deps & BIT(d)) && s_runs[d].err != ESP_OK) deps_ok = false;
+    }
+    if (deps_ok) {
+        run->err = step->init();
+        if (run->err != ESP_OK) ESP_LOGE(TAG, "%s failed: %s", step->name, esp_err_to_name(run->err));
+    } else {
+        ESP_LOGE(TAG, "%s skipped, a step it depends on failed", step->name);
+    }
+    run->end_us = esp_timer_get_time();
+
+    xEventGroupSetBits(s_done, BIT(index));
+    vTaskDelete(NULL);
+}
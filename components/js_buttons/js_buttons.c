@@ -16,12 +16,16 @@
 #include <string.h>
 // For calling events
 #include "esp_event.h"
+#include "js_dlog.h"
 #include "js_events.h"
+#include "js_trace.h"
 
 // Defines
 #define TAG "js_buttons"
 #define DEBOUNCE_TIME 1      // ms
 #define LONG_PRESS_TIME 1000 // ms
+#define QUEUE_LENGTH 10
+#define HANDLER_STACK 2048
 
 #define BTN_RED GPIO_NUM_23
 #define BTN_BLUE GPIO_NUM_17
@@ -57,14 +61,20 @@ typedef struct
 {
     uint32_t pin;
     button_event_type_t type;
+    int64_t time_us; // When the ISR saw it (for the emergency alert latency)
 } button_event_t;
 
 // Forward Declarations
 static QueueHandle_t button_press_queue = NULL;
+static StaticQueue_t button_press_queue_mem;
+static uint8_t button_press_queue_storage[QUEUE_LENGTH * sizeof(button_event_t)];
+static StaticTask_t button_press_handler_mem;
+static StackType_t button_press_handler_stack[HANDLER_STACK];
 static void button_press_handler(void *arg);
 static void button_isr(void *arg);
 static void long_press_timer_callback(TimerHandle_t xTimer);
 static button_props_t button_props[BTN_COUNT];
+static StaticTimer_t long_press_timer_mem[BTN_COUNT];
 
 /** Initialize button GPIOs, ISRs and handlers */
 esp_err_t js_buttons_init(void) {
@@ -98,14 +108,14 @@ esp_err_t js_buttons_init(void) {
 
     // Create long-press timers for each button
     for (int i = 0; i < BTN_COUNT; i++) {
-        button_props[i].long_press_timer = xTimerCreate("long_press_timer", pdMS_TO_TICKS(LONG_PRESS_TIME), pdFALSE, (void *)i, long_press_timer_callback);
+        button_props[i].long_press_timer = xTimerCreateStatic("long_press_timer", pdMS_TO_TICKS(LONG_PRESS_TIME), pdFALSE, (void *)i, long_press_timer_callback, &long_press_timer_mem[i]);
         ESP_GOTO_ON_FALSE(button_props[i].long_press_timer != NULL, ESP_FAIL, error, TAG, "js_buttons_init: Failed to create long-press timer");
     }
 
     // Init the button press handler
-    button_press_queue = xQueueCreate(10, sizeof(button_event_t));
+    button_press_queue = xQueueCreateStatic(QUEUE_LENGTH, sizeof(button_event_t), button_press_queue_storage, &button_press_queue_mem);
     ESP_GOTO_ON_ERROR(button_press_queue == NULL ? ESP_FAIL : ESP_OK, error, TAG, "js_buttons_init: Failed to create button press queue");
-    xTaskCreate(button_press_handler, "button_press_handler", 2048, NULL, 10, NULL);
+    xTaskCreateStatic(button_press_handler, "button_press_handler", HANDLER_STACK, NULL, 10, button_press_handler_stack, &button_press_handler_mem);
 
     // Install GPIO ISR service
     for (int i = 0; i < BTN_COUNT; i++) {
@@ -130,7 +140,7 @@ static void long_press_timer_callback(TimerHandle_t xTimer) {
         return;
 
     // Send the event
-    button_event_t event = {.pin = button_prop->pin, .type = BUTTON_EVENT_LONG_PRESS};
+    button_event_t event = {.pin = button_prop->pin, .type = BUTTON_EVENT_LONG_PRESS, .time_us = esp_timer_get_time()};
     xQueueSend(button_press_queue, &event, 0);
 }
 
@@ -185,7 +195,8 @@ static void IRAM_ATTR button_isr(void *arg) {
     }
 
     // Send short press event only, long press is handled by the timer
-    button_event_t event = {.pin = button_prop->pin, .type = event_type};
+    button_event_t event = {.pin = button_prop->pin, .type = event_type, .time_us = esp_timer_get_time()};
+    js_trace_record(JS_TRACE_ISR, button_prop->pin, 0, event.time_us);
     xQueueSendFromISR(button_press_queue, &event, NULL);
 }
 
@@ -200,34 +211,34 @@ static void button_press_handler(void *arg) {
             switch (event.pin) {
             case BTN_RED:
                 if (event.type == BUTTON_EVENT_RELEASE_SHORT) {
-                    ESP_LOGI(TAG, "RED button SHORT pressed");
-                    // Send event to main task handler
-                    esp_event_post(JS_EVENT_BASE, JS_EVENT_EMERGENCY_BUTTON_PRESSED, NULL, 0, 0);
+                    JS_DLOGI(TAG, "RED button SHORT pressed");
+                    // Send event to main task handler with the press time
+                    js_events_post_at(JS_EVENT_EMERGENCY_BUTTON_PRESSED, &event.time_us, sizeof(event.time_us), event.time_us);
                 }
                 if (event.type == BUTTON_EVENT_LONG_PRESS) {
-                    ESP_LOGI(TAG, "RED button LONG pressed");
+                    JS_DLOGI(TAG, "RED button LONG pressed");
                 }
                 break;
 
             case BTN_BLUE:
                 if (event.type == BUTTON_EVENT_RELEASE_SHORT) {
-                    ESP_LOGI(TAG, "BLUE button SHORT pressed");
-                    esp_event_post(JS_EVENT_BASE, JS_EVENT_START_PAIRING, NULL, 0, 0);
+                    JS_DLOGI(TAG, "BLUE button SHORT pressed");
+                    js_events_post_at(JS_EVENT_START_PAIRING, NULL, 0, event.time_us);
                 }
                 if (event.type == BUTTON_EVENT_LONG_PRESS) {
-                    ESP_LOGI(TAG, "BLUE button LONG pressed");
-                    esp_event_post(JS_EVENT_BASE, JS_EVENT_STOP_BLE, NULL, 0, 0);
+                    JS_DLOGI(TAG, "BLUE button LONG pressed");
+                    js_events_post_at(JS_EVENT_STOP_BLE, NULL, 0, event.time_us);
                 }
                 break;
 
             case BTN_YELLOW:
                 if (event.type == BUTTON_EVENT_RELEASE_SHORT) {
-                    ESP_LOGI(TAG, "YELLOW button SHORT pressed");
-                    esp_event_post(JS_EVENT_BASE, JS_EVENT_SHOW_BATTERY_STATUS, NULL, 0, 0);
+                    JS_DLOGI(TAG, "YELLOW button SHORT pressed");
+                    js_events_post_at(JS_EVENT_SHOW_BATTERY_STATUS, NULL, 0, event.time_us);
                 }
                 if (event.type == BUTTON_EVENT_LONG_PRESS) {
-                    ESP_LOGI(TAG, "YELLOW button LONG pressed");
-                    esp_event_post(JS_EVENT_BASE, JS_EVENT_HIDE_BATTERY_STATUS, NULL, 0, 0);
+                    JS_DLOGI(TAG, "YELLOW button LONG pressed");
+                    js_events_post_at(JS_EVENT_HIDE_BATTERY_STATUS, NULL, 0, event.time_us);
                 }
                 break;
 
@@ -0,0 +1,15 @@
+// Host build stand-in for ESP-IDF's esp_check.h
+#pragma once
+#include "esp_err.h"
+#include "esp_log.h"
+
+#define ESP_RETURN_ON_ERROR(x, tag, msg) \
+    do {                                 \
+        esp_err_t err_rc_ = (x);         \
+        if (err_rc_ != ESP_OK) {         \
+            ESP_LOGE(tag, "%s", msg);    \
+            return err_rc_;              \
+        }                                \
+    } while (0)
+
+#define ESP_ERROR_CHECK_WITHOUT_ABORT(x) (x)
@@ -0,0 +1,9 @@
+// Host build stand-in for js_dlog.h, the deferred logs print straight away
+#pragma once
+#include "esp_log.h"
+
+#define JS_DLOGE(tag, fmt, ...) ESP_LOGE(tag, fmt, ##__VA_ARGS__)
+#define JS_DLOGW(tag, fmt, ...) ESP_LOGW(tag, fmt, ##__VA_ARGS__)
+#define JS_DLOGI(tag, fmt, ...) ESP_LOGI(tag, fmt, ##__VA_ARGS__)
+#define JS_DLOGD(tag, fmt, ...) ESP_LOGD(tag, fmt, ##__VA_ARGS__)
+#define JS_DLOGV(tag, fmt, ...) ESP_LOGV(tag, fmt, ##__VA_ARGS__)
@@ -0,0 +1,3 @@
+// Host build stand-in for ESP-IDF's nvs_flash.h
+#pragma once
+#include "nvs.h"
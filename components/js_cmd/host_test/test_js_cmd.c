@@ -0,0 +1,301 @@
+/**
+ * Host tests for the command router
+ * js_cmd.c is included here so its static parsers (find_cmd, parse_cmd, parse_u64, the payload parsers) can be
+ * called directly. js_events is faked below to record what js_cmd_route() posts.
+ * Run with no arguments for the tests, or "benchmark [iterations]" for the parse benchmark.
+ */
+
+// Unit Under Test
+#include "../js_cmd.c"
+
+// Library Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Local Includes
+#include "js_events.h"
+#include "js_user_settings.h"
+
+// Defines
+#define CHECK(cond)                                                       \
+    do {                                                                  \
+        s_checks++;                                                       \
+        if (!(cond)) {                                                    \
+            s_failures++;                                                 \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);        \
+        }                                                                 \
+    } while (0)
+#define CHECK_ERR(expr, expected) CHECK((expr) == (expected))
+
+// Forward Declarations
+static int s_checks = 0;
+static int s_failures = 0;
+static uint8_t s_slot[JS_EVENT_LARGE_PAYLOAD] __attribute__((aligned(8))); // The one fake event slot
+static int s_claimed = 0;                                                   // Claimed and not yet sent or released
+static int32_t s_sent_event = -1;
+static size_t s_sent_size = 0;
+static bool s_sent_was_cmd = false;
+static uint8_t s_sent_data[JS_EVENT_LARGE_PAYLOAD];
+
+/* ************************** js_events fakes ************************** */
+void *js_events_claim(int32_t event_id, size_t size) {
+    if (s_claimed || size > sizeof(s_slot)) return NULL;
+    s_claimed = 1;
+    return s_slot;
+}
+
+void js_events_release(void *payload) {
+    s_claimed = 0;
+}
+
+esp_err_t js_events_post_at(int32_t event_id, const void *data, size_t size, int64_t origin_us) {
+    s_sent_event = event_id;
+    s_sent_size = size;
+    s_sent_was_cmd = false;
+    if (size) memcpy(s_sent_data, data, size);
+    return ESP_OK;
+}
+
+esp_err_t js_events_send_cmd(void *cmd, size_t size, int64_t origin_us) {
+    s_sent_event = JS_EVENT_COUNT; // Not known from the payload, the tests check the slot
+    s_sent_size = size;
+    s_sent_was_cmd = true;
+    memcpy(s_sent_data, cmd, size);
+    s_claimed = 0;
+    return ESP_OK;
+}
+
+static void reset_sent(void) {
+    s_sent_event = -1;
+    s_sent_size = 0;
+    s_sent_was_cmd = false;
+}
+
+/* ************************** Tests ************************** */
+static void test_find_cmd(void) {
+    CHECK(find_cmd('t', JS_CMD_SRC_SERIAL) && find_cmd('t', JS_CMD_SRC_SERIAL)->event_id == JS_EVENT_READ_SYSTEM_TIME);
+    CHECK(find_cmd('t', JS_CMD_SRC_BLE) != NULL);
+    CHECK(find_cmd('A', JS_CMD_SRC_BLE) && find_cmd('A', JS_CMD_SRC_BLE)->event_id == JS_EVENT_WRITE_ALARMS);
+
+    // Serial only commands aren't there for BLE
+    CHECK(find_cmd('P', JS_CMD_SRC_SERIAL) != NULL);
+    CHECK(find_cmd('P', JS_CMD_SRC_BLE) == NULL);
+    CHECK(find_cmd('B', JS_CMD_SRC_BLE) == NULL);
+    CHECK(find_cmd('e', JS_CMD_SRC_BLE) == NULL);
+
+    // Unknown, case matters
+    CHECK(find_cmd('Z', JS_CMD_SRC_SERIAL) == NULL);
+    CHECK(find_cmd('\0', JS_CMD_SRC_SERIAL) == NULL);
+    CHECK(find_cmd('p', JS_CMD_SRC_SERIAL) == NULL);
+
+    // Every prefix is in the table once
+    for (int i = 0; i < sizeof(s_cmds) / sizeof(s_cmds[0]); i++) {
+        for (int j = i + 1; j < sizeof(s_cmds) / sizeof(s_cmds[0]); j++) CHECK(s_cmds[i].prefix != s_cmds[j].prefix);
+    }
+}
+
+static void test_parse_u64(void) {
+    uint64_t v = 0;
+    CHECK(parse_u64("0", 10, &v) && v == 0);
+    CHECK(parse_u64("1770921313", UINT64_MAX, &v) && v == 1770921313ULL);
+    CHECK(parse_u64("255", UINT8_MAX, &v) && v == 255);
+    CHECK(parse_u64("18446744073709551615", UINT64_MAX, &v) && v == UINT64_MAX);
+
+    // Errors leave out untouched
+    v = 42;
+    CHECK(!parse_u64("", UINT64_MAX, &v));
+    CHECK(!parse_u64("256", UINT8_MAX, &v));
+    CHECK(!parse_u64("18446744073709551616", UINT64_MAX, &v)); // Overflow
+    CHECK(!parse_u64("99999999999999999999999", UINT64_MAX, &v));
+    CHECK(!parse_u64("-1", UINT64_MAX, &v));
+    CHECK(!parse_u64("+1", UINT64_MAX, &v));
+    CHECK(!parse_u64(" 1", UINT64_MAX, &v));
+    CHECK(!parse_u64("1 ", UINT64_MAX, &v));
+    CHECK(!parse_u64("12a", UINT64_MAX, &v));
+    CHECK(!parse_u64("0x10", UINT64_MAX, &v));
+    CHECK(v == 42);
+}
+
+static void test_parse_cmd(void) {
+    static js_cmd_t cmd;
+    size_t len = 99;
+    const cmd_def_t *def;
+
+    // No payload
+    def = find_cmd('t', JS_CMD_SRC_SERIAL);
+    CHECK_ERR(parse_cmd(def, "t", &cmd, &len), ESP_OK);
+    CHECK(len == 0);
+    CHECK_ERR(parse_cmd(def, "t:", &cmd, &len), ESP_OK); // Empty payload, nothing to parse
+    CHECK_ERR(parse_cmd(def, "tx", &cmd, &len), ESP_ERR_INVALID_ARG);
+
+    // T: unix time
+    def = find_cmd('T', JS_CMD_SRC_SERIAL);
+    CHECK_ERR(parse_cmd(def, "T:1770921313", &cmd, &len), ESP_OK);
+    CHECK(cmd.unix_time == 1770921313ULL && len == sizeof(cmd.unix_time));
+    CHECK_ERR(parse_cmd(def, "T", &cmd, &len), ESP_ERR_INVALID_ARG);
+    CHECK_ERR(parse_cmd(def, "T:", &cmd, &len), ESP_ERR_INVALID_ARG);
+    CHECK_ERR(parse_cmd(def, "T:-5", &cmd, &len), ESP_ERR_INVALID_ARG);
+    CHECK_ERR(parse_cmd(def, "T1770921313", &cmd, &len), ESP_ERR_INVALID_ARG);
+
+    // P: track index (uint8_t)
+    def = find_cmd('P', JS_CMD_SRC_SERIAL);
+    CHECK_ERR(parse_cmd(def, "P:2", &cmd, &len), ESP_OK);
+    CHECK(cmd.index == 2 && len == sizeof(cmd.index));
+    CHECK_ERR(parse_cmd(def, "P:255", &cmd, &len), ESP_OK);
+    CHECK_ERR(parse_cmd(def, "P:256", &cmd, &len), ESP_ERR_INVALID_ARG);
+    CHECK_ERR(parse_cmd(def, "P:", &cmd, &len), ESP_ERR_INVALID_ARG);
+
+    // B: iterations, optional
+    def = find_cmd('B', JS_CMD_SRC_SERIAL);
+    CHECK_ERR(parse_cmd(def, "B", &cmd, &len), ESP_OK);
+    CHECK(cmd.iterations == BENCHMARK_DEFAULT_ITERATIONS && len == sizeof(cmd.iterations));
+    CHECK_ERR(parse_cmd(def, "B:100000", &cmd, &len), ESP_OK);
+    CHECK(cmd.iterations == 100000);
+    CHECK_ERR(parse_cmd(def, "B:100001", &cmd, &len), ESP_ERR_INVALID_ARG);
+
+    // h: event ID, optional
+    def = find_cmd('h', JS_CMD_SRC_BLE);
+    CHECK_ERR(parse_cmd(def, "h", &cmd, &len), ESP_OK);
+    CHECK(cmd.index == JS_TRACE_ALL_EVENTS);
+    CHECK_ERR(parse_cmd(def, "h:14", &cmd, &len), ESP_OK);
+    CHECK(cmd.index == 14);
+    char line[16];
+    snprintf(line, sizeof(line), "h:%d", JS_EVENT_COUNT);
+    CHECK_ERR(parse_cmd(def, line, &cmd, &len), ESP_ERR_INVALID_ARG);
+
+    // S: settings image as hex
+    def = find_cmd('S', JS_CMD_SRC_BLE);
+    CHECK_ERR(parse_cmd(def, "S:01ab", &cmd, &len), ESP_OK);
+    CHECK(strcmp(cmd.text, "01ab") == 0 && len == 5);
+    CHECK_ERR(parse_cmd(def, "S:", &cmd, &len), ESP_ERR_INVALID_ARG);
+    CHECK_ERR(parse_cmd(def, "S:abc", &cmd, &len), ESP_ERR_INVALID_ARG); // Odd length
+    CHECK_ERR(parse_cmd(def, "S:0g", &cmd, &len), ESP_ERR_INVALID_ARG);
+    static char image[2 + JS_SETTINGS_IMAGE_MAX * 2 + 3];
+    memset(image, '0', sizeof(image) - 1);
+    image[0] = 'S';
+    image[1] = ':';
+    image[sizeof(image) - 1] = '\0';
+    CHECK_ERR(parse_cmd(def, image, &cmd, &len), ESP_ERR_INVALID_SIZE);
+}
+
+static void test_parse_timezone(void) {
+    static js_cmd_t cmd;
+    size_t len = 0;
+
+    CHECK_ERR(parse_timezone("EST5EDT,M3.2.0/2,M11.1.0/2", &cmd, &len), ESP_OK);
+    CHECK(strcmp(cmd.text, "EST5EDT,M3.2.0/2,M11.1.0/2") == 0);
+    CHECK(len == strlen("EST5EDT,M3.2.0/2,M11.1.0/2") + 1);
+
+    // Empty, too long for the settings field, not printable
+    char tz[sizeof(((js_user_prefs_t *)0)->timezone) + 1];
+    CHECK_ERR(parse_timezone("", &cmd, &len), ESP_ERR_INVALID_ARG);
+    memset(tz, 'A', sizeof(tz) - 2);
+    tz[sizeof(tz) - 2] = '\0'; // Longest that fits
+    CHECK_ERR(parse_timezone(tz, &cmd, &len), ESP_OK);
+    memset(tz, 'A', sizeof(tz) - 1);
+    tz[sizeof(tz) - 1] = '\0'; // One too long
+    CHECK_ERR(parse_timezone(tz, &cmd, &len), ESP_ERR_INVALID_SIZE);
+    CHECK_ERR(parse_timezone("EST\x01", &cmd, &len), ESP_ERR_INVALID_ARG);
+    CHECK_ERR(parse_timezone("EST\t5", &cmd, &len), ESP_ERR_INVALID_ARG);
+}
+
+static void test_parse_alarms(void) {
+    js_alarm_t alarms[JS_MAX_ALARMS];
+    uint8_t count = 99;
+
+    CHECK_ERR(js_user_settings_parse_alarms("09:00,1,1;11:30,0,2", alarms, &count), ESP_OK);
+    CHECK(count == 2);
+    CHECK(alarms[0].hour == 9 && alarms[0].minute == 0 && alarms[0].enabled && alarms[0].song_index == 1);
+    CHECK(alarms[1].hour == 11 && alarms[1].minute == 30 && !alarms[1].enabled && alarms[1].song_index == 2);
+
+    // Empty clears them, empty entries are skipped
+    CHECK_ERR(js_user_settings_parse_alarms("", alarms, &count), ESP_OK);
+    CHECK(count == 0);
+    CHECK_ERR(js_user_settings_parse_alarms(";;09:00,1,1;", alarms, &count), ESP_OK);
+    CHECK(count == 1);
+
+    // Bounds
+    CHECK_ERR(js_user_settings_parse_alarms("23:59,1,0", alarms, &count), ESP_OK);
+    char line[16];
+    snprintf(line, sizeof(line), "00:00,1,%d", JS_MAX_TRACKS - 1);
+    CHECK_ERR(js_user_settings_parse_alarms(line, alarms, &count), ESP_OK);
+
+    // Errors leave count as it was
+    count = 7;
+    snprintf(line, sizeof(line), "00:00,1,%d", JS_MAX_TRACKS);
+    CHECK_ERR(js_user_settings_parse_alarms(line, alarms, &count), ESP_ERR_INVALID_ARG);
+    CHECK_ERR(js_user_settings_parse_alarms("24:00,1,1", alarms, &count), ESP_ERR_INVALID_ARG);
+    CHECK_ERR(js_user_settings_parse_alarms("09:60,1,1", alarms, &count), ESP_ERR_INVALID_ARG);
+    CHECK_ERR(js_user_settings_parse_alarms("-1:00,1,1", alarms, &count), ESP_ERR_INVALID_ARG);
+    CHECK_ERR(js_user_settings_parse_alarms("09:00,2,1", alarms, &count), ESP_ERR_INVALID_ARG);
+    CHECK_ERR(js_user_settings_parse_alarms("09:00,1,-1", alarms, &count), ESP_ERR_INVALID_ARG);
+    CHECK_ERR(js_user_settings_parse_alarms("09:00,1", alarms, &count), ESP_ERR_INVALID_ARG);
+    CHECK_ERR(js_user_settings_parse_alarms("09:00,1,1;bad", alarms, &count), ESP_ERR_INVALID_ARG);
+    CHECK_ERR(js_user_settings_parse_alarms("nine", alarms, &count), ESP_ERR_INVALID_ARG);
+    CHECK(count == 7);
+
+    // JS_MAX_ALARMS fit, one more is rejected rather than dropped
+    static char many[(JS_MAX_ALARMS + 1) * 10 + 1];
+    size_t used = 0;
+    for (int i = 0; i < JS_MAX_ALARMS; i++) used += snprintf(many + used, sizeof(many) - used, "%02d:00,1,0;", i % 24);
+    CHECK_ERR(js_user_settings_parse_alarms(many, alarms, &count), ESP_OK);
+    CHECK(count == JS_MAX_ALARMS);
+    snprintf(many + used, sizeof(many) - used, "12:00,1,0");
+    CHECK_ERR(js_user_settings_parse_alarms(many, alarms, &count), ESP_ERR_INVALID_SIZE);
+}
+
+static void test_route(void) {
+    char nack[64];
+
+    // Admitted commands are parsed into the claimed slot and sent with it
+    reset_sent();
+    CHECK_ERR(js_cmd_route("T:1770921313", 3, JS_CMD_SRC_BLE), ESP_OK);
+    CHECK(s_sent_was_cmd && s_sent_size == PAYLOAD_OFFSET + sizeof(uint64_t));
+    CHECK(((js_cmd_t *)s_sent_data)->reply_to == 3 && ((js_cmd_t *)s_sent_data)->unix_time == 1770921313ULL);
+    CHECK(!s_claimed);
+
+    // Serial test commands post just the payload and never hold a slot
+    reset_sent();
+    CHECK_ERR(js_cmd_route("P:2", JS_REPLY_NONE, JS_CMD_SRC_SERIAL), ESP_OK);
+    CHECK(!s_sent_was_cmd && s_sent_event == JS_EVENT_PLAY_AUDIO && s_sent_size == 1 && s_sent_data[0] == 2);
+    CHECK(!s_claimed);
+    reset_sent();
+    CHECK_ERR(js_cmd_route("r", JS_REPLY_NONE, JS_CMD_SRC_SERIAL), ESP_OK);
+    CHECK(s_sent_event == JS_EVENT_DUMP_TRACE && s_sent_size == 0);
+
+    // Errors: unknown, wrong transport, bad payload (the slot is given back), no free slot
+    reset_sent();
+    CHECK_ERR(js_cmd_route("Z", 3, JS_CMD_SRC_BLE), ESP_ERR_NOT_FOUND);
+    CHECK_ERR(js_cmd_route("P:2", 3, JS_CMD_SRC_BLE), ESP_ERR_NOT_FOUND);
+    CHECK_ERR(js_cmd_route("A:25:00,1,1", 3, JS_CMD_SRC_BLE), ESP_ERR_INVALID_ARG);
+    CHECK(s_sent_event == -1 && !s_claimed);
+    s_claimed = 1;
+    CHECK_ERR(js_cmd_route("t", 3, JS_CMD_SRC_BLE), ESP_ERR_NO_MEM);
+    s_claimed = 0;
+
+    // NACKs
+    js_cmd_format_nack("t", ESP_ERR_NO_MEM, nack, sizeof(nack));
+    CHECK(strcmp(nack, "t:BUSY") == 0);
+    js_cmd_format_nack("T:x", ESP_ERR_INVALID_ARG, nack, sizeof(nack));
+    CHECK(strcmp(nack, "T:ERR:ESP_ERR_INVALID_ARG") == 0);
+    js_cmd_format_nack("Z", ESP_ERR_NOT_FOUND, nack, sizeof(nack));
+    CHECK(strcmp(nack, "Unknown command received") == 0);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "benchmark") == 0) {
+        js_cmd_benchmark(argc > 2 ? strtoul(argv[2], NULL, 10) : BENCHMARK_DEFAULT_ITERATIONS);
+        return 0;
+    }
+
+    test_find_cmd();
+    test_parse_u64();
+    test_parse_cmd();
+    test_parse_timezone();
+    test_parse_alarms();
+    test_route();
+
+    printf("%d checks, %d failed\n", s_checks, s_failures);
+    return s_failures ? 1 : 0;
+}
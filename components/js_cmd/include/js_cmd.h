@@ -0,0 +1,35 @@
+#pragma once
+
+// Includes
+#include "esp_err.h"
+#include "js_events.h"
+#include "js_user_settings.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Where a command came from (each table entry lists the transports allowed to use it)
+typedef enum {
+    JS_CMD_SRC_SERIAL = 1 << 0,
+    JS_CMD_SRC_BLE = 1 << 1,
+} js_cmd_src_t;
+
+// Parsed command, the payload of the read/write command events (only the used part is posted)
+typedef struct {
+    uint16_t reply_to; // BLE connection handle that sent the command (first, see js_events_send_cmd)
+    union {
+        uint64_t unix_time; // T
+        struct {
+            uint8_t count;
+            js_alarm_t list[JS_MAX_ALARMS];
+        } alarms;                  // A
+        char text[JS_CMD_MAX_LEN]; // L timezone, S settings image (hex), validated
+        uint8_t index;             // P (posted on its own), h event ID
+        int64_t press_us;          // e (posted on its own)
+        uint32_t iterations;       // B
+    };
+} js_cmd_t;
+
+// Functions
+esp_err_t js_cmd_route(const char *line, uint16_t reply_to, js_cmd_src_t src);
+void js_cmd_format_nack(const char *line, esp_err_t err, char *out, size_t out_size);
+void js_cmd_benchmark(uint32_t iterations);
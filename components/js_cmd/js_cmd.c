@@ -0,0 +1,297 @@
+/**
+ * Command router
+ * BLE and serial both hand complete command lines ("X" or "X:payload") to js_cmd_route(). One table maps the
+ * prefix to its parser, event and allowed transports, so the two can't drift apart. Payloads are parsed and
+ * validated once here into js_cmd_t, and app_event_handler() gets typed values instead of strings.
+ */
+
+// Self Include
+#include "js_cmd.h"
+
+// Library Includes
+#include "esp_event.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Local Includes
+#include "js_dlog.h"
+#include "js_trace.h"
+
+// Defines
+#define TAG "js_cmd"
+#define SRC_ALL (JS_CMD_SRC_SERIAL | JS_CMD_SRC_BLE)
+#define PAYLOAD_OFFSET offsetof(js_cmd_t, unix_time) // Start of the union
+#define BENCHMARK_DEFAULT_ITERATIONS 1000
+#define BENCHMARK_MAX_ITERATIONS 100000
+
+// How a parsed command is delivered
+typedef enum {
+    POST_CMD,    // Whole js_cmd_t through admission control, answered to reply_to
+    POST_DIRECT, // Just the payload straight to the event loop, same as the buttons post it (local test commands)
+} post_t;
+
+// Fills in the payload and how many bytes of it are used
+typedef esp_err_t (*parse_fn_t)(const char *arg, js_cmd_t *cmd, size_t *payload_len);
+
+// Command table entry
+typedef struct {
+    char prefix;
+    int32_t event_id;
+    parse_fn_t parse; // NULL: no payload
+    post_t post;
+    uint8_t sources; // js_cmd_src_t bits
+    const char *name;
+} cmd_def_t;
+
+_Static_assert(sizeof(js_cmd_t) <= JS_EVENT_LARGE_PAYLOAD, "js_cmd_t has to fit a large event slot");
+
+// Forward Declarations
+static esp_err_t parse_unix_time(const char *arg, js_cmd_t *cmd, size_t *payload_len);
+static esp_err_t parse_timezone(const char *arg, js_cmd_t *cmd, size_t *payload_len);
+static esp_err_t parse_alarms(const char *arg, js_cmd_t *cmd, size_t *payload_len);
+static esp_err_t parse_settings_image(const char *arg, js_cmd_t *cmd, size_t *payload_len);
+static esp_err_t parse_index(const char *arg, js_cmd_t *cmd, size_t *payload_len);
+static esp_err_t parse_press_time(const char *arg, js_cmd_t *cmd, size_t *payload_len);
+static esp_err_t parse_iterations(const char *arg, js_cmd_t *cmd, size_t *payload_len);
+static esp_err_t parse_event_id(const char *arg, js_cmd_t *cmd, size_t *payload_len);
+static const cmd_def_t *find_cmd(char prefix, js_cmd_src_t src);
+static esp_err_t parse_cmd(const cmd_def_t *def, const char *line, js_cmd_t *cmd, size_t *payload_len);
+static bool parse_u64(const char *s, uint64_t max, uint64_t *out);
+static js_cmd_t s_serial_cmd; // Parse buffer for POST_DIRECT, serial only so there's one caller
+
+/* ************************** Command Table ************************** */
+static const cmd_def_t s_cmds[] = {
+    // Time
+    {'t', JS_EVENT_READ_SYSTEM_TIME, NULL, POST_CMD, SRC_ALL, "Read time"},
+    {'T', JS_EVENT_WRITE_SYSTEM_TIME, parse_unix_time, POST_CMD, SRC_ALL, "Write time"},
+    {'n', JS_EVENT_SET_NEXT_ALARM, NULL, POST_DIRECT, JS_CMD_SRC_SERIAL, "Set next alarm"},
+
+    // User settings
+    {'l', JS_EVENT_READ_TIMEZONE, NULL, POST_CMD, SRC_ALL, "Read timezone"},
+    {'L', JS_EVENT_WRITE_TIMEZONE, parse_timezone, POST_CMD, SRC_ALL, "Write timezone"},
+    {'a', JS_EVENT_READ_ALARMS, NULL, POST_CMD, SRC_ALL, "Read alarms"},
+    {'A', JS_EVENT_WRITE_ALARMS, parse_alarms, POST_CMD, SRC_ALL, "Write alarms"},
+    {'s', JS_EVENT_READ_SETTINGS, NULL, POST_CMD, SRC_ALL, "Read settings"},
+    {'S', JS_EVENT_WRITE_SETTINGS, parse_settings_image, POST_CMD, SRC_ALL, "Write settings"},
+
+    // Battery
+    {'b', JS_EVENT_READ_BATTERY, NULL, POST_CMD, SRC_ALL, "Read battery"},
+    {'c', JS_EVENT_READ_CHARGER, NULL, POST_CMD, SRC_ALL, "Read charger"},
+
+    // Audio (bench testing from the console)
+    {'P', JS_EVENT_PLAY_AUDIO, parse_index, POST_DIRECT, JS_CMD_SRC_SERIAL, "Play audio"},
+    {'e', JS_EVENT_EMERGENCY_BUTTON_PRESSED, parse_press_time, POST_DIRECT, JS_CMD_SRC_SERIAL, "Emergency button"},
+
+    // Diagnostics
+    {'q', JS_EVENT_READ_LANE_STATS, NULL, POST_CMD, SRC_ALL, "Read lane stats"},
+    {'h', JS_EVENT_READ_TRACE, parse_event_id, POST_CMD, SRC_ALL, "Read latency histograms"},
+    {'m', JS_EVENT_READ_DIAG, NULL, POST_CMD, SRC_ALL, "Read memory diagnostics"},
+    {'u', JS_EVENT_READ_CPU, NULL, POST_CMD, SRC_ALL, "Read CPU use"},
+    {'r', JS_EVENT_DUMP_TRACE, NULL, POST_DIRECT, JS_CMD_SRC_SERIAL, "Dump trace"},
+    {'B', JS_EVENT_RUN_BENCHMARK, parse_iterations, POST_DIRECT, JS_CMD_SRC_SERIAL, "Router benchmark"},
+};
+
+/* ************************** Global Functions ************************** */
+/**
+ * Parse a command line and post it. Returns ESP_ERR_NOT_FOUND for an unknown command (or one this transport
+ * can't use), a parse error, or the admission control error. js_cmd_format_nack() turns these into the reply.
+ */
+esp_err_t js_cmd_route(const char *line, uint16_t reply_to, js_cmd_src_t src) {
+    int64_t received_us = esp_timer_get_time(); // Origin of the trace
+    const cmd_def_t *def = find_cmd(line[0], src);
+    if (!def) return ESP_ERR_NOT_FOUND;
+
+    // Parsed straight into an event slot (too big for the BLE host and serial task stacks). Only POST_CMD
+    // sends the whole js_cmd_t, POST_DIRECT posts a small payload (or none) and doesn't need a large slot.
+    js_cmd_t *cmd = &s_serial_cmd;
+    if (def->post == POST_CMD) {
+        cmd = js_events_claim(def->event_id, sizeof(js_cmd_t));
+        if (!cmd) return ESP_ERR_NO_MEM;
+    }
+
+    size_t payload_len = 0;
+    esp_err_t err = parse_cmd(def, line, cmd, &payload_len);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "%s: invalid payload (%s)", def->name, esp_err_to_name(err));
+    } else {
+        JS_DLOGI(TAG, "%s command received", def->name); // Names are literals, safe to defer
+        cmd->reply_to = reply_to;
+        switch (def->post) {
+        case POST_CMD:
+            return js_events_send_cmd(cmd, PAYLOAD_OFFSET + payload_len, received_us); // Slot goes with the event
+        case POST_DIRECT:
+            err = js_events_post_at(def->event_id, payload_len ? (const uint8_t *)cmd + PAYLOAD_OFFSET : NULL, payload_len, received_us);
+            break;
+        }
+    }
+
+    if (cmd != &s_serial_cmd) js_events_release(cmd);
+    return err;
+}
+
+// Reply for a command js_cmd_route() didn't accept: "X:BUSY" when saturated, otherwise "X:ERR:<error>"
+void js_cmd_format_nack(const char *line, esp_err_t err, char *out, size_t out_size) {
+    switch (err) {
+    case ESP_ERR_NOT_FOUND:
+        snprintf(out, out_size, "Unknown command received");
+        break;
+    case ESP_ERR_NO_MEM:        // Source or loop share full
+    case ESP_ERR_INVALID_STATE: // Over the rate limit
+    case ESP_ERR_TIMEOUT:       // Event loop queue full
+        snprintf(out, out_size, "%c:BUSY", line[0]);
+        break;
+    default:
+        snprintf(out, out_size, "%c:ERR:%s", line[0], esp_err_to_name(err));
+        break;
+    }
+}
+
+/**
+ * Parse throughput (serial "B" or "B:[iterations]"). Parses sample lines without posting them and logs the
+ * time per parse for each, to keep an eye on the cost of the router on the BLE host task.
+ */
+void js_cmd_benchmark(uint32_t iterations) {
+    static const char *const samples[] = {
+        "t",
+        "T:1770921313",
+        "L:EST5EDT,M3.2.0/2,M11.1.0/2",
+        "A:09:00,1,1;11:00,1,2;13:41,1,3;13:45,1,3",
+        "P:2",
+    };
+
+    static js_cmd_t cmd; // Too big for the lane's stack, and only the config lane runs this
+
+    for (int s = 0; s < sizeof(samples) / sizeof(samples[0]); s++) {
+        const cmd_def_t *def = find_cmd(samples[s][0], JS_CMD_SRC_SERIAL);
+        uint32_t errors = 0;
+        size_t payload_len;
+
+        int64_t start_us = esp_timer_get_time();
+        for (uint32_t i = 0; i < iterations; i++) {
+            if (!def || parse_cmd(def, samples[s], &cmd, &payload_len) != ESP_OK) errors++;
+        }
+        int64_t elapsed_us = esp_timer_get_time() - start_us;
+
+        ESP_LOGI(TAG, "%-44s %6lld ns/parse (%lu parses, %lu errors)", samples[s],
+                 iterations ? elapsed_us * 1000 / iterations : 0, (unsigned long)iterations, (unsigned long)errors);
+    }
+}
+
+/* ************************** Local Functions ************************** */
+// Table lookup, limited to the commands this transport may use
+static const cmd_def_t *find_cmd(char prefix, js_cmd_src_t src) {
+    for (int i = 0; i < sizeof(s_cmds) / sizeof(s_cmds[0]); i++) {
+        if (s_cmds[i].prefix == prefix) return (s_cmds[i].sources & src) ? &s_cmds[i] : NULL;
+    }
+    return NULL;
+}
+
+// Split off the payload ("X" or "X:payload") and run the command's parser
+static esp_err_t parse_cmd(const cmd_def_t *def, const char *line, js_cmd_t *cmd, size_t *payload_len) {
+    const char *arg = line + 1;
+    if (*arg == ':') {
+        arg++;
+    } else if (*arg != '\0') {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    *payload_len = 0;
+    return def->parse ? def->parse(arg, cmd, payload_len) : ESP_OK;
+}
+
+// T: unix seconds
+static esp_err_t parse_unix_time(const char *arg, js_cmd_t *cmd, size_t *payload_len) {
+    if (!parse_u64(arg, UINT64_MAX, &cmd->unix_time)) return ESP_ERR_INVALID_ARG;
+    *payload_len = sizeof(cmd->unix_time);
+    return ESP_OK;
+}
+
+// L: POSIX TZ string, has to fit the settings field
+static esp_err_t parse_timezone(const char *arg, js_cmd_t *cmd, size_t *payload_len) {
+    size_t len = strlen(arg);
+    if (len == 0) return ESP_ERR_INVALID_ARG;
+    if (len >= sizeof(((js_user_prefs_t *)0)->timezone)) return ESP_ERR_INVALID_SIZE;
+    for (size_t i = 0; i < len; i++) {
+        if (!isprint((unsigned char)arg[i])) return ESP_ERR_INVALID_ARG;
+    }
+
+    memcpy(cmd->text, arg, len + 1);
+    *payload_len = len + 1;
+    return ESP_OK;
+}
+
+// A: alarm list (empty clears them)
+static esp_err_t parse_alarms(const char *arg, js_cmd_t *cmd, size_t *payload_len) {
+    esp_err_t err = js_user_settings_parse_alarms(arg, cmd->alarms.list, &cmd->alarms.count);
+    if (err != ESP_OK) return err;
+
+    *payload_len = offsetof(js_cmd_t, alarms.list) - PAYLOAD_OFFSET + cmd->alarms.count * sizeof(js_alarm_t);
+    return ESP_OK;
+}
+
+// S: settings image as hex (the version, length and CRC are checked when it's applied)
+static esp_err_t parse_settings_image(const char *arg, js_cmd_t *cmd, size_t *payload_len) {
+    size_t len = strlen(arg);
+    if (len == 0 || len % 2 != 0) return ESP_ERR_INVALID_ARG;
+    if (len > JS_SETTINGS_IMAGE_MAX * 2) return ESP_ERR_INVALID_SIZE;
+    for (size_t i = 0; i < len; i++) {
+        if (!isxdigit((unsigned char)arg[i])) return ESP_ERR_INVALID_ARG;
+    }
+
+    memcpy(cmd->text, arg, len + 1);
+    *payload_len = len + 1;
+    return ESP_OK;
+}
+
+// P: track index (js_audio checks it against the tracks it has)
+static esp_err_t parse_index(const char *arg, js_cmd_t *cmd, size_t *payload_len) {
+    uint64_t index;
+    if (!parse_u64(arg, UINT8_MAX, &index)) return ESP_ERR_INVALID_ARG;
+    cmd->index = index;
+    *payload_len = sizeof(cmd->index);
+    return ESP_OK;
+}
+
+// e: no payload, the press time is taken now like the button ISR does
+static esp_err_t parse_press_time(const char *arg, js_cmd_t *cmd, size_t *payload_len) {
+    cmd->press_us = esp_timer_get_time();
+    *payload_len = sizeof(cmd->press_us);
+    return ESP_OK;
+}
+
+// B: iterations per sample (optional)
+static esp_err_t parse_iterations(const char *arg, js_cmd_t *cmd, size_t *payload_len) {
+    uint64_t iterations = BENCHMARK_DEFAULT_ITERATIONS;
+    if (*arg && !parse_u64(arg, BENCHMARK_MAX_ITERATIONS, &iterations)) return ESP_ERR_INVALID_ARG;
+    cmd->iterations = iterations;
+    *payload_len = sizeof(cmd->iterations);
+    return ESP_OK;
+}
+
+// h: event ID for its buckets (optional, none for the summary of every event)
+static esp_err_t parse_event_id(const char *arg, js_cmd_t *cmd, size_t *payload_len) {
+    uint64_t event_id = JS_TRACE_ALL_EVENTS;
+    if (*arg && !parse_u64(arg, JS_EVENT_COUNT - 1, &event_id)) return ESP_ERR_INVALID_ARG;
+    cmd->index = event_id;
+    *payload_len = sizeof(cmd->index);
+    return ESP_OK;
+}
+
+// Decimal digits only, no sign or trailing text, up to max
+static bool parse_u64(const char *s, uint64_t max, uint64_t *out) {
+    if (*s == '\0') return false;
+    uint64_t value = 0;
+    for (; *s; s++) {
+        if (!isdigit((unsigned char)*s)) return false;
+        uint64_t digit = *s - '0';
+        if (value > (max - digit) / 10) return false;
+        value = value * 10 + digit;
+    }
+    *out = value;
+    return true;
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include "esp_err.h"
+#include <stddef.h>
+
+#define JS_CPU_SAMPLE_MS 2000 // The window slides on this often
+#define JS_CPU_WINDOW_SAMPLES 5 // Samples kept, the window is up to this many sample periods (10 s)
+
+// Functions
+esp_err_t js_cpu_init(void);
+esp_err_t js_cpu_format(char *out, size_t out_size);
+void js_cpu_log(void);
@@ -0,0 +1,13 @@
+#pragma once
+#include "esp_err.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define JS_DIAG_LOG_PERIOD_MS (60 * 1000) // Heap, stacks and CPU use are logged this often
+#define JS_DIAG_MAX_TASKS 24              // Task snapshot size
+
+// Functions
+esp_err_t js_diag_init(void);
+void js_diag_boot_done(void);
+size_t js_diag_format(char *out, size_t out_size);
+void js_diag_log(void);
@@ -0,0 +1,177 @@
+/**
+ * CPU use
+ * How much of the CPU each task took over the last few seconds, as the before/after numbers for power and
+ * performance work (audio decode, BLE, the scheduler jobs).
+ * - FreeRTOS keeps a run time counter per task (CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS), counting esp_timer
+ *   microseconds while the task runs. Interrupts are counted to the task they interrupted.
+ * - A js_sched job copies every task's counter into a ring every JS_CPU_SAMPLE_MS. A read compares the current
+ *   counters with the oldest sample in the ring, so the window slides and ends at the read.
+ * - Idle is the IDLE task's share: time nothing else wanted the CPU (it's where light sleep happens).
+ */
+
+// Self Include
+#include "js_cpu.h"
+
+// Library Includes
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+// Local Includes
+#include "js_diag.h"
+#include "js_sched.h"
+
+// Defines
+#define TAG "js_cpu"
+#define IDLE_TASK_NAME "IDLE"
+
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+// Types
+typedef configRUN_TIME_COUNTER_TYPE run_time_t;
+
+typedef struct {
+    run_time_t total; // Run time counter (us since boot) when it was taken
+    int count;
+    TaskHandle_t tasks[JS_DIAG_MAX_TASKS];
+    run_time_t run_time[JS_DIAG_MAX_TASKS];
+} cpu_sample_t;
+
+// One task's share of the window
+typedef struct {
+    const char *name;
+    uint32_t permille;
+} cpu_use_t;
+
+// Forward Declarations
+static cpu_sample_t s_samples[JS_CPU_WINDOW_SAMPLES]; // Ring, s_next is the oldest once it's full
+static int s_next = 0;
+static int s_filled = 0;
+static const cpu_sample_t s_boot_sample = {0}; // Before the first sample the window starts at boot
+static TaskStatus_t s_tasks[JS_DIAG_MAX_TASKS]; // Current counters, guarded by s_mutex (too big for the callers' stacks)
+static cpu_use_t s_use[JS_DIAG_MAX_TASKS];
+static SemaphoreHandle_t s_mutex = NULL;
+static StaticSemaphore_t s_mutex_mem;
+static void sample_job(void *arg);
+static int measure(uint32_t *window_ms, uint32_t *idle_permille);
+static run_time_t sample_run_time(const cpu_sample_t *sample, TaskHandle_t task);
+#endif
+
+/** Start sampling the run time counters (needs js_sched) */
+esp_err_t js_cpu_init(void) {
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    s_mutex = xSemaphoreCreateMutexStatic(&s_mutex_mem);
+    if (!s_mutex) return ESP_ERR_NO_MEM;
+    return js_sched_every("cpu", JS_CPU_SAMPLE_MS, sample_job, NULL, NULL);
+#else
+    ESP_LOGW(TAG, "CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS is off, no CPU use");
+    return ESP_OK;
+#endif
+}
+
+/* ************************** Global Functions ************************** */
+/**
+ * "window:<ms>;idle:<%>;<task>=<%>,..." with the busiest task first and the percentages to one decimal.
+ * Tasks that didn't run in the window are left out. ESP_ERR_NOT_SUPPORTED without run time stats.
+ */
+esp_err_t js_cpu_format(char *out, size_t out_size) {
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    if (!s_mutex) return ESP_ERR_INVALID_STATE;
+
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    uint32_t window_ms, idle;
+    int count = measure(&window_ms, &idle);
+    size_t len = snprintf(out, out_size, "window:%lu;idle:%lu.%lu", (unsigned long)window_ms,
+                          (unsigned long)(idle / 10), (unsigned long)(idle % 10));
+    for (int i = 0; i < count && len < out_size; i++) {
+        len += snprintf(out + len, out_size - len, "%s%s=%lu.%lu", i ? "," : ";", s_use[i].name,
+                        (unsigned long)(s_use[i].permille / 10), (unsigned long)(s_use[i].permille % 10));
+    }
+    xSemaphoreGive(s_mutex);
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+// Log every task's share of the window
+void js_cpu_log(void) {
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    if (!s_mutex) return;
+
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    uint32_t window_ms, idle;
+    int count = measure(&window_ms, &idle);
+    ESP_LOGI(TAG, "CPU over the last %lu ms, busiest first: idle %lu.%lu%%", (unsigned long)window_ms,
+             (unsigned long)(idle / 10), (unsigned long)(idle % 10));
+    for (int i = 0; i < count; i++) {
+        printf("  %-16s %3lu.%lu%%\n", s_use[i].name, (unsigned long)(s_use[i].permille / 10),
+               (unsigned long)(s_use[i].permille % 10));
+    }
+    xSemaphoreGive(s_mutex);
+#endif
+}
+
+/* ************************** Local Functions ************************** */
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+// Copy every task's run time counter into the ring (every JS_CPU_SAMPLE_MS, from js_sched)
+static void sample_job(void *arg) {
+    xSemaphoreTake(s_mutex, portMAX_DELAY);
+    cpu_sample_t *sample = &s_samples[s_next];
+    run_time_t total = 0;
+    sample->count = uxTaskGetSystemState(s_tasks, JS_DIAG_MAX_TASKS, &total);
+    sample->total = total;
+    for (int i = 0; i < sample->count; i++) {
+        sample->tasks[i] = s_tasks[i].xHandle;
+        sample->run_time[i] = s_tasks[i].ulRunTimeCounter;
+    }
+    s_next = (s_next + 1) % JS_CPU_WINDOW_SAMPLES;
+    if (s_filled < JS_CPU_WINDOW_SAMPLES) s_filled++;
+    xSemaphoreGive(s_mutex);
+}
+
+/**
+ * Each task's share since the oldest sample (since boot before the first one) into s_use, busiest first and
+ * without the idle task. Call with s_mutex held. Returns the count.
+ */
+static int measure(uint32_t *window_ms, uint32_t *idle_permille) {
+    const cpu_sample_t *oldest = s_filled == 0 ? &s_boot_sample : &s_samples[s_filled < JS_CPU_WINDOW_SAMPLES ? 0 : s_next];
+
+    run_time_t total = 0;
+    int count = uxTaskGetSystemState(s_tasks, JS_DIAG_MAX_TASKS, &total);
+    run_time_t window = total - oldest->total;
+    *window_ms = window / 1000;
+    *idle_permille = 0;
+    if (window == 0) return 0;
+
+    int used = 0;
+    for (int i = 0; i < count; i++) {
+        // A task created since the oldest sample has all of its run time inside the window
+        run_time_t ran = s_tasks[i].ulRunTimeCounter - sample_run_time(oldest, s_tasks[i].xHandle);
+        uint32_t permille = ran * 1000 / window;
+        if (strncmp(s_tasks[i].pcTaskName, IDLE_TASK_NAME, strlen(IDLE_TASK_NAME)) == 0) {
+            *idle_permille += permille;
+            continue;
+        }
+        if (ran == 0) continue;
+
+        // Insertion sort, busiest first
+        int j = used++;
+        for (; j > 0 && s_use[j - 1].permille < permille; j--) s_use[j] = s_use[j - 1];
+        s_use[j] = (cpu_use_t){.name = s_tasks[i].pcTaskName, .permille = permille};
+    }
+    return used;
+}
+
+// A task's counter in a sample, 0 if it didn't exist yet
+static run_time_t sample_run_time(const cpu_sample_t *sample, TaskHandle_t task) {
+    for (int i = 0; i < sample->count; i++) {
+        if (sample->tasks[i] == task) return sample->run_time[i];
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,176 @@
+/**
+ * Memory diagnostics
+ * What's needed to size the task stacks and to see heap fragmentation or heap use at run time coming:
+ * - Every task's stack high-water mark (the least free stack it has had), from uxTaskGetSystemState()
+ * - Heap free, lowest free since boot and largest free block
+ * - Heap allocations since boot finished (CONFIG_JS_HEAP_GUARD). Every task, queue, timer and buffer in the app
+ *   is static, so there shouldn't be any. They're counted from the heap's alloc hook, with the last task that
+ *   made one, or with CONFIG_JS_HEAP_GUARD_ABORT the first one aborts with a backtrace.
+ * Read with the "m" command, and logged every JS_DIAG_LOG_PERIOD_MS from js_sched (with the CPU use, js_cpu.c).
+ */
+
+// Self Include
+#include "js_diag.h"
+
+// Library Includes
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Local Includes
+#include "js_cpu.h"
+#include "js_sched.h"
+
+// Defines
+#define TAG "js_diag"
+#define LARGEST_BLOCK_WARN 8192 // Below this the heap is fragmented enough to fail library allocations
+#define STACK_FREE_WARN 256     // Bytes, a task this close to the end of its stack is logged as a warning
+
+// Types
+typedef struct {
+    size_t free;
+    size_t min_free;
+    size_t largest_block;
+} heap_stats_t;
+
+// Forward Declarations
+static TaskStatus_t s_tasks[JS_DIAG_MAX_TASKS]; // Snapshot, guarded by s_snapshot_mutex (too big for the callers' stacks)
+static SemaphoreHandle_t s_snapshot_mutex = NULL;
+static StaticSemaphore_t s_snapshot_mutex_mem;
+static volatile bool s_boot_done = false;
+static atomic_uint s_late_allocs = 0;            // Allocations after boot
+static atomic_uint s_late_bytes = 0;             // Their total size
+static volatile TaskHandle_t s_late_task = NULL; // Task that made the last one
+static void log_job(void *arg);
+static int take_task_snapshot(void);
+static void read_heap(heap_stats_t *heap);
+static const char *snapshot_task_name(TaskHandle_t task, int count);
+
+/** Start the CPU sampling and the periodic log (needs js_sched) */
+esp_err_t js_diag_init(void) {
+    s_snapshot_mutex = xSemaphoreCreateMutexStatic(&s_snapshot_mutex_mem);
+    if (!s_snapshot_mutex) return ESP_ERR_NO_MEM;
+    esp_err_t err = js_cpu_init();
+    if (err != ESP_OK) return err;
+    return js_sched_every("diag", JS_DIAG_LOG_PERIOD_MS, log_job, NULL, NULL);
+}
+
+/* ************************** Global Functions ************************** */
+// Init is over, any heap allocation from here on is flagged
+void js_diag_boot_done(void) {
+    s_boot_done = true;
+}
+
+#if CONFIG_JS_HEAP_GUARD
+// Called by the heap on every successful allocation (CONFIG_HEAP_USE_HOOKS). Runs inside malloc(), so it can't
+// log, lock or allocate.
+void IRAM_ATTR esp_heap_trace_alloc_hook(void *ptr, size_t size, uint32_t caps) {
+    if (!s_boot_done) return;
+#if CONFIG_JS_HEAP_GUARD_ABORT
+    abort(); // The backtrace shows who allocated
+#endif
+    atomic_fetch_add_explicit(&s_late_allocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s_late_bytes, size, memory_order_relaxed);
+    s_late_task = xTaskGetCurrentTaskHandle();
+}
+#endif
+
+/**
+ * "heap:<free>,<min free>,<largest block>;after_boot:<allocs>,<bytes>,<last task>;stacks:<task>=<min free bytes>,..."
+ * with the tasks closest to overflowing first. after_boot is only there with CONFIG_JS_HEAP_GUARD.
+ * Returns the length written.
+ */
+size_t js_diag_format(char *out, size_t out_size) {
+    heap_stats_t heap;
+    read_heap(&heap);
+    size_t len = snprintf(out, out_size, "heap:%u,%u,%u", (unsigned)heap.free, (unsigned)heap.min_free,
+                          (unsigned)heap.largest_block);
+    if (!s_snapshot_mutex || len >= out_size) return len;
+
+    xSemaphoreTake(s_snapshot_mutex, portMAX_DELAY);
+    int count = take_task_snapshot();
+#if CONFIG_JS_HEAP_GUARD
+    len += snprintf(out + len, out_size - len, ";after_boot:%u,%u,%s", atomic_load(&s_late_allocs),
+                    atomic_load(&s_late_bytes), snapshot_task_name(s_late_task, count));
+#endif
+    for (int i = 0; i < count && len < out_size; i++) {
+        len += snprintf(out + len, out_size - len, "%s%s=%lu", i ? "," : ";stacks:", s_tasks[i].pcTaskName,
+                        (unsigned long)s_tasks[i].usStackHighWaterMark);
+    }
+    xSemaphoreGive(s_snapshot_mutex);
+    return len;
+}
+
+// Log everything, with warnings for a fragmented heap, allocations after boot and tasks close to the end of their stack
+void js_diag_log(void) {
+    heap_stats_t heap;
+    read_heap(&heap);
+    ESP_LOGI(TAG, "Heap: %u free, %u lowest, %u largest block", (unsigned)heap.free, (unsigned)heap.min_free,
+             (unsigned)heap.largest_block);
+    if (heap.largest_block < LARGEST_BLOCK_WARN) {
+        ESP_LOGW(TAG, "Largest free block is %u bytes, the heap is fragmented", (unsigned)heap.largest_block);
+    }
+
+    if (!s_snapshot_mutex) return;
+    xSemaphoreTake(s_snapshot_mutex, portMAX_DELAY);
+    int count = take_task_snapshot();
+#if CONFIG_JS_HEAP_GUARD
+    unsigned late_allocs = atomic_load(&s_late_allocs);
+    if (late_allocs) {
+        ESP_LOGW(TAG, "%u heap allocations since boot (%u bytes), the last by %s", late_allocs,
+                 atomic_load(&s_late_bytes), snapshot_task_name(s_late_task, count));
+    }
+#endif
+    ESP_LOGI(TAG, "Stacks, least free first (bytes never used):");
+    for (int i = 0; i < count; i++) {
+        printf("  %-16s %5lu\n", s_tasks[i].pcTaskName, (unsigned long)s_tasks[i].usStackHighWaterMark);
+        if (s_tasks[i].usStackHighWaterMark < STACK_FREE_WARN) {
+            ESP_LOGW(TAG, "%s has %lu bytes of stack left", s_tasks[i].pcTaskName, (unsigned long)s_tasks[i].usStackHighWaterMark);
+        }
+    }
+    xSemaphoreGive(s_snapshot_mutex);
+}
+
+/* ************************** Local Functions ************************** */
+static void log_job(void *arg) {
+    js_diag_log();
+    js_cpu_log();
+}
+
+// Fill s_tasks, sorted by stack high-water mark, lowest first (call with s_snapshot_mutex held). Returns the count.
+// The high-water mark is in bytes on ESP-IDF (StackType_t is a byte).
+static int take_task_snapshot(void) {
+    int count = uxTaskGetSystemState(s_tasks, JS_DIAG_MAX_TASKS, NULL);
+    if (count == 0 && uxTaskGetNumberOfTasks() > JS_DIAG_MAX_TASKS) ESP_LOGW(TAG, "More than %d tasks, no snapshot", JS_DIAG_MAX_TASKS);
+
+    for (int i = 1; i < count; i++) {
+        TaskStatus_t task = s_tasks[i];
+        int j = i;
+        for (; j > 0 && s_tasks[j - 1].usStackHighWaterMark > task.usStackHighWaterMark; j--) s_tasks[j] = s_tasks[j - 1];
+        s_tasks[j] = task;
+    }
+    return count;
+}
+
+static void read_heap(heap_stats_t *heap) {
+    heap->free = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+    heap->min_free = heap_caps_get_minimum_free_size(MALLOC_CAP_DEFAULT);
+    heap->largest_block = heap_caps_get_largest_free_block(MALLOC_CAP_DEFAULT);
+}
+
+// Name of a task in the snapshot ("-" for none, "?" if it's gone since)
+static const char *snapshot_task_name(TaskHandle_t task, int count) {
+    if (!task) return "-";
+    for (int i = 0; i < count; i++) {
+        if (s_tasks[i].xHandle == task) return s_tasks[i].pcTaskName;
+    }
+    return "?";
+}
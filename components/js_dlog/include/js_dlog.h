@@ -0,0 +1,62 @@
+#pragma once
+#include "esp_err.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+#include <stdint.h>
+
+#define JS_DLOG_MAX_ARGS 8
+
+// Per-component cap, define before including this header (like LOG_LOCAL_LEVEL)
+#ifndef JS_DLOG_LOCAL_LEVEL
+#define JS_DLOG_LOCAL_LEVEL CONFIG_JS_DLOG_DEFAULT_LEVEL
+#endif
+
+/**
+ * Log without formatting on the caller (CONFIG_JS_DLOG_DEFERRED). Same as ESP_LOGx(), except:
+ * - Up to JS_DLOG_MAX_ARGS arguments, each 32 bits or less (ints, chars, pointers). No floats or 64 bit values
+ * - %s only for strings that outlive the call (literals, static tables), it's read when the line is printed
+ * - The timestamp is when the call was made, the line comes out later on the jdlog task
+ * Safe from ISRs.
+ */
+#define JS_DLOGE(tag, fmt, ...) JS_DLOG(ESP_LOG_ERROR, tag, fmt, ##__VA_ARGS__)
+#define JS_DLOGW(tag, fmt, ...) JS_DLOG(ESP_LOG_WARN, tag, fmt, ##__VA_ARGS__)
+#define JS_DLOGI(tag, fmt, ...) JS_DLOG(ESP_LOG_INFO, tag, fmt, ##__VA_ARGS__)
+#define JS_DLOGD(tag, fmt, ...) JS_DLOG(ESP_LOG_DEBUG, tag, fmt, ##__VA_ARGS__)
+#define JS_DLOGV(tag, fmt, ...) JS_DLOG(ESP_LOG_VERBOSE, tag, fmt, ##__VA_ARGS__)
+
+#if CONFIG_JS_DLOG_DEFERRED
+#define JS_DLOG(level, tag, fmt, ...)                                                  \
+    do {                                                                               \
+        if ((level) <= JS_DLOG_LOCAL_LEVEL) {                                          \
+            if (0) esp_log_write(level, tag, fmt, ##__VA_ARGS__); /* Format check */   \
+            JS_DLOG_WRITE(JS_DLOG_NARGS(__VA_ARGS__), level, tag, fmt, ##__VA_ARGS__); \
+        }                                                                              \
+    } while (0)
+#else
+#define JS_DLOG(level, tag, fmt, ...)                                                      \
+    do {                                                                                   \
+        if ((level) <= JS_DLOG_LOCAL_LEVEL) ESP_LOG_LEVEL(level, tag, fmt, ##__VA_ARGS__); \
+    } while (0)
+#endif
+
+// Argument count (0 - 8) and each argument as a uint32_t, with a compile error for anything wider
+#define JS_DLOG_WRITE(n, level, tag, fmt, ...) js_dlog_write(level, tag, fmt, n JS_DLOG_ARGS(n, ##__VA_ARGS__))
+#define JS_DLOG_NARGS(...) JS_DLOG_NARGS_(0, ##__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define JS_DLOG_NARGS_(_0, _1, _2, _3, _4, _5, _6, _7, _8, n, ...) n
+#define JS_DLOG_ARG(x) , ((uint32_t)(uintptr_t)(x) + 0 * sizeof(char[sizeof(x) <= 4 ? 1 : -1]))
+#define JS_DLOG_ARGS(n, ...) JS_DLOG_CAT(JS_DLOG_ARGS_, n)(__VA_ARGS__)
+#define JS_DLOG_CAT(a, b) JS_DLOG_CAT_(a, b)
+#define JS_DLOG_CAT_(a, b) a##b
+#define JS_DLOG_ARGS_0()
+#define JS_DLOG_ARGS_1(a) JS_DLOG_ARG(a)
+#define JS_DLOG_ARGS_2(a, ...) JS_DLOG_ARG(a) JS_DLOG_ARGS_1(__VA_ARGS__)
+#define JS_DLOG_ARGS_3(a, ...) JS_DLOG_ARG(a) JS_DLOG_ARGS_2(__VA_ARGS__)
+#define JS_DLOG_ARGS_4(a, ...) JS_DLOG_ARG(a) JS_DLOG_ARGS_3(__VA_ARGS__)
+#define JS_DLOG_ARGS_5(a, ...) JS_DLOG_ARG(a) JS_DLOG_ARGS_4(__VA_ARGS__)
+#define JS_DLOG_ARGS_6(a, ...) JS_DLOG_ARG(a) JS_DLOG_ARGS_5(__VA_ARGS__)
+#define JS_DLOG_ARGS_7(a, ...) JS_DLOG_ARG(a) JS_DLOG_ARGS_6(__VA_ARGS__)
+#define JS_DLOG_ARGS_8(a, ...) JS_DLOG_ARG(a) JS_DLOG_ARGS_7(__VA_ARGS__)
+
+// Functions
+esp_err_t js_dlog_init(void);
+void js_dlog_write(esp_log_level_t level, const char *tag, const char *fmt, int nargs, ...); // Use JS_DLOGx()
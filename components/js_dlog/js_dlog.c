@@ -0,0 +1,159 @@
+/**
+ * Deferred logging
+ * ESP_LOGx() formats and writes to the console on the caller, which costs the button handler, the BLE host and
+ * the audio start a few ms each time. JS_DLOGx() stores the format string (it stays in flash, so the pointer
+ * identifies the message) and the raw arguments instead, and the jdlog task at the lowest app priority formats
+ * and prints them when nothing else needs the CPU.
+ * - A slot is claimed with one atomic add, like js_trace, so ISRs and every task can write without a lock
+ * - An entry is only printed once its sequence number shows it was written completely
+ * - When the ring laps the printer, the overwritten entries are counted and reported as dropped
+ * Lines go out through esp_log_write(), so the log level filter and the BLE log stream see them like any other.
+ */
+
+// Self Include
+#include "js_dlog.h"
+
+// Library Includes
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+// Defines
+#define TAG "js_dlog"
+#define DLOG_TASK_STACK 3072 // vsnprintf and the console write
+#define DLOG_TASK_PRIORITY 1 // Just above idle
+#define LINE_MAX 192         // Longer messages are cut off
+
+#if CONFIG_JS_DLOG_DEFERRED
+#define RING_SIZE CONFIG_JS_DLOG_RING_SIZE
+_Static_assert((RING_SIZE & (RING_SIZE - 1)) == 0, "CONFIG_JS_DLOG_RING_SIZE must be a power of 2");
+
+// Types
+typedef struct {
+    uint32_t time_ms; // esp_log_timestamp() equivalent, when the call was made
+    const char *tag;
+    const char *fmt;
+    uint8_t level;
+    uint8_t nargs;
+    uint32_t args[JS_DLOG_MAX_ARGS];
+} dlog_entry_t;
+
+// Forward Declarations
+static dlog_entry_t s_ring[RING_SIZE];
+static atomic_uint s_seq[RING_SIZE]; // Claim index + 1 once the entry is complete, 0 while it's written
+static atomic_uint s_head = 0;       // Next index to claim
+static unsigned s_tail = 0;          // Next index to print (jdlog task only)
+static TaskHandle_t s_task = NULL;
+static StaticTask_t s_task_mem;
+static StackType_t s_task_stack[DLOG_TASK_STACK];
+static void dlog_task(void *arg);
+static void print_pending(void);
+static void print_entry(const dlog_entry_t *entry);
+#endif
+
+/** Start the printing task. Lines logged before it starts are kept (up to the ring size). */
+esp_err_t js_dlog_init(void) {
+#if CONFIG_JS_DLOG_DEFERRED
+    s_task = xTaskCreateStatic(dlog_task, "jdlog", DLOG_TASK_STACK, NULL, DLOG_TASK_PRIORITY, s_task_stack, &s_task_mem);
+    if (!s_task) return ESP_ERR_NO_MEM;
+#endif
+    return ESP_OK;
+}
+
+/* ************************** Global Functions ************************** */
+#if CONFIG_JS_DLOG_DEFERRED
+// Record a line for the jdlog task (nargs uint32_t arguments follow). In IRAM for ISRs.
+void IRAM_ATTR js_dlog_write(esp_log_level_t level, const char *tag, const char *fmt, int nargs, ...) {
+    unsigned idx = atomic_fetch_add_explicit(&s_head, 1, memory_order_relaxed);
+    unsigned slot = idx & (RING_SIZE - 1);
+    dlog_entry_t *entry = &s_ring[slot];
+
+    atomic_store_explicit(&s_seq[slot], 0, memory_order_relaxed);
+    entry->time_ms = esp_timer_get_time() / 1000;
+    entry->tag = tag;
+    entry->fmt = fmt;
+    entry->level = level;
+    entry->nargs = nargs < JS_DLOG_MAX_ARGS ? nargs : JS_DLOG_MAX_ARGS;
+    va_list ap;
+    va_start(ap, nargs);
+    for (int i = 0; i < entry->nargs; i++) entry->args[i] = va_arg(ap, uint32_t);
+    va_end(ap);
+    atomic_store_explicit(&s_seq[slot], idx + 1, memory_order_release);
+
+    if (!s_task) return; // Printed once js_dlog_init() has run
+    if (xPortInIsrContext()) {
+        vTaskNotifyGiveFromISR(s_task, NULL); // No yield, the printer is the lowest priority anyway
+    } else {
+        xTaskNotifyGive(s_task);
+    }
+}
+#endif
+
+/* ************************** Local Functions ************************** */
+#if CONFIG_JS_DLOG_DEFERRED
+// Print whatever is in the ring, then wait for more
+static void dlog_task(void *arg) {
+    for (;;) {
+        print_pending();
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+}
+
+// Print the complete entries from s_tail on. Stops at one that's still being written (its writer notifies again).
+static void print_pending(void) {
+    unsigned dropped = 0;
+    for (;;) {
+        unsigned head = atomic_load_explicit(&s_head, memory_order_relaxed);
+        if (s_tail == head) break;
+        if (head - s_tail > RING_SIZE) { // Lapped, the oldest are gone
+            dropped += head - RING_SIZE - s_tail;
+            s_tail = head - RING_SIZE;
+        }
+
+        unsigned slot = s_tail & (RING_SIZE - 1);
+        unsigned seq = atomic_load_explicit(&s_seq[slot], memory_order_acquire);
+        if (seq != s_tail + 1) {
+            if (seq == 0 || (int)(seq - (s_tail + 1)) < 0) break; // Still being written
+            dropped++;                                            // Already overwritten by a newer one
+            s_tail++;
+            continue;
+        }
+
+        dlog_entry_t entry = s_ring[slot];
+        bool torn = atomic_load_explicit(&s_seq[slot], memory_order_acquire) != seq; // Overwritten while copying
+        s_tail++;
+        if (torn) {
+            dropped++;
+            continue;
+        }
+        print_entry(&entry);
+    }
+    if (dropped) ESP_LOGW(TAG, "%u deferred log lines dropped", dropped);
+}
+
+// Format like ESP_LOGx(): "I (<ms>) <tag>: <message>". The unused arguments are passed as 0 and ignored.
+// The level letter is part of each format literal, like ESP_LOGx() does it, since log hooks (js_ble_log) read
+// the level from the format's first character.
+static void print_entry(const dlog_entry_t *entry) {
+    static const char *const s_formats[] = {
+        [ESP_LOG_NONE] = "N (%lu) %s: %s\n",
+        [ESP_LOG_ERROR] = "E (%lu) %s: %s\n",
+        [ESP_LOG_WARN] = "W (%lu) %s: %s\n",
+        [ESP_LOG_INFO] = "I (%lu) %s: %s\n",
+        [ESP_LOG_DEBUG] = "D (%lu) %s: %s\n",
+        [ESP_LOG_VERBOSE] = "V (%lu) %s: %s\n",
+    };
+    uint32_t a[JS_DLOG_MAX_ARGS] = {0};
+    for (int i = 0; i < entry->nargs; i++) a[i] = entry->args[i];
+
+    char line[LINE_MAX];
+    snprintf(line, sizeof(line), entry->fmt, a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+    const char *format = entry->level <= ESP_LOG_VERBOSE ? s_formats[entry->level] : "? (%lu) %s: %s\n";
+    esp_log_write(entry->level, entry->tag, format, (unsigned long)entry->time_ms, entry->tag, line);
+}
+#endif
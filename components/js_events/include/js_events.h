@@ -1,5 +1,7 @@
 #pragma once
 #include "esp_event.h"
+#include <stddef.h>
+#include <stdint.h>
 
 // Define the event base for Jive Stick events
 ESP_EVENT_DECLARE_BASE(JS_EVENT_BASE); // Main handler
@@ -19,15 +21,18 @@ typedef enum {
     JS_EVENT_WRITE_TIMEZONE,
     JS_EVENT_READ_ALARMS,
     JS_EVENT_WRITE_ALARMS,
+    JS_EVENT_READ_SETTINGS,  // Export the settings image
+    JS_EVENT_WRITE_SETTINGS, // Provision from a settings image
 
     // Battery Events
     JS_EVENT_SHOW_BATTERY_STATUS,
     JS_EVENT_HIDE_BATTERY_STATUS,
     JS_EVENT_READ_BATTERY,
     JS_EVENT_READ_CHARGER,
+    JS_EVENT_CHARGER_CHANGED, // Charger plugged in or out (from the ISR)
 
     // Audio Events
-    JS_EVENT_EMERGENCY_BUTTON_PRESSED,
+    JS_EVENT_EMERGENCY_BUTTON_PRESSED, // int64_t esp_timer_get_time() of the press
     JS_EVENT_PLAY_AUDIO,
     JS_EVENT_STOP_AUDIO,
 
@@ -36,5 +41,71 @@ typedef enum {
     JS_EVENT_STOP_BLE,
     JS_EVENT_BLE_CONNECTED,
     JS_EVENT_BLE_DISCONNECTED,
+    JS_EVENT_BLE_ADV_TIMEOUT,
 
+    // Diagnostics
+    JS_EVENT_READ_LANE_STATS,
+    JS_EVENT_READ_TRACE,    // Latency histograms (uint8_t event ID, optional)
+    JS_EVENT_READ_DIAG,     // Heap, allocation and stack stats
+    JS_EVENT_READ_CPU,      // Per-task CPU use
+    JS_EVENT_DUMP_TRACE,    // Log the trace points (serial r)
+    JS_EVENT_RUN_BENCHMARK, // uint32_t iterations (serial B)
+
+    JS_EVENT_COUNT, // Keep last
 } app_event_id_t;
+
+// Command events (read/write commands from BLE or serial) carry a js_cmd_t (js_cmd.h) with where the response should go
+#define JS_CMD_MAX_LEN 512   // Longest command or response incl. the null (the largest BLE attribute value)
+#define JS_REPLY_NONE 0xFFFF // Serial or internal, no BLE response
+#define JS_MAX_TRACKS 16     // Built-in plus uploaded audio tracks, alarms can point at any of them
+
+// Event slot payload sizes (see js_events.c)
+#define JS_EVENT_SMALL_PAYLOAD 32                   // Indexes, times
+#define JS_EVENT_LARGE_PAYLOAD (JS_CMD_MAX_LEN + 16) // js_cmd_t
+
+// Event lanes (an event loop and task each, see js_events.c)
+typedef enum {
+    JS_LANE_SAFETY,       // Emergency button
+    JS_LANE_AUDIO,        // Alarms and playback
+    JS_LANE_CONFIG,       // Read/write commands
+    JS_LANE_HOUSEKEEPING, // Everything else
+    JS_LANE_COUNT,
+} js_lane_t;
+
+// Lane latency since boot: wait is post to handler start, run is the handler itself
+typedef struct {
+    uint32_t count;
+    uint32_t max_wait_us;
+    uint64_t total_wait_us;
+    uint32_t max_run_us;
+    uint32_t dropped; // Posts that found no free slot
+} js_lane_stats_t;
+
+// Fewest free event slots seen since boot
+typedef struct {
+    uint8_t small_free_min; // Shared small slots, not the ones kept for the safety and audio lanes
+    uint8_t large_free_min;
+} js_slot_stats_t;
+
+// Command admission counters (since boot)
+typedef struct {
+    uint32_t accepted;
+    uint32_t busy;         // Source or loop share full (NACKed)
+    uint32_t rate_limited; // Source over its rate (NACKed)
+    uint32_t loop_full;    // Admitted but the event loop queue was full
+} js_cmd_stats_t;
+
+// Functions
+esp_err_t js_events_init(void);
+esp_err_t js_events_register_handler(esp_event_handler_t handler, void *arg);
+esp_err_t js_events_post(int32_t event_id, const void *data, size_t size); // Never waits, safe from ISRs
+esp_err_t js_events_post_at(int32_t event_id, const void *data, size_t size, int64_t origin_us);
+void *js_events_claim(int32_t event_id, size_t size); // Slot to build the payload in, NULL when none is free
+esp_err_t js_events_send(void *payload, size_t size, int64_t origin_us);
+esp_err_t js_events_send_cmd(void *cmd, size_t size, int64_t origin_us); // Send a command event (admission controlled)
+void js_events_release(void *payload);                                   // Give back a slot that wasn't sent
+void js_events_release_source(uint16_t reply_to);                        // BLE connection closed
+void js_events_get_cmd_stats(js_cmd_stats_t *stats);
+void js_events_get_lane_stats(js_lane_t lane, js_lane_stats_t *stats);
+const char *js_events_lane_name(js_lane_t lane);
+void js_events_get_slot_stats(js_slot_stats_t *stats);
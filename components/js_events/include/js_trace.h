@@ -0,0 +1,22 @@
+#pragma once
+#include "esp_err.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Trace points along an event's path
+typedef enum {
+    JS_TRACE_ISR,      // Button edge (id is the GPIO)
+    JS_TRACE_POST,     // js_events_post*()
+    JS_TRACE_DISPATCH, // Lane task picked it up
+    JS_TRACE_EXIT,     // app_event_handler() returned
+} js_trace_point_t;
+
+#define JS_TRACE_HIST_BUCKETS 16 // Bucket 0 is < 64 us, then one per power of 2, the last is >= ~1 s
+#define JS_TRACE_ALL_EVENTS 0xFF // "h" without an event ID
+
+// Functions
+void js_trace_record(js_trace_point_t point, uint16_t id, int64_t origin_us, int64_t now_us); // ISR safe
+void js_trace_complete(int32_t event_id, int64_t origin_us, int64_t end_us);
+size_t js_trace_format_summary(char *out, size_t out_size);
+esp_err_t js_trace_format_hist(int32_t event_id, char *out, size_t out_size);
+void js_trace_dump(void);
@@ -1,2 +1,530 @@
+/**
+ * Events
+ * App events run on separate lanes, each its own queue and task at its own priority, routed by event ID.
+ * An emergency press is handled straight away even while the config lane is in the middle of an NVS commit or
+ * an I2C RTC read:
+ * - Safety: emergency button
+ * - Audio: alarms and playback
+ * - Config: read/write commands from BLE and serial
+ * - Housekeeping: everything else (BLE state, battery display, sleep)
+ * Each event carries its post time, so the wait in the queue and the handler run time are measured per lane.
+ * It also carries its origin (button ISR, BLE write, serial line) for the end to end trace in js_trace.c.
+ *
+ * Events live in preallocated slots, nothing is allocated on the way to the handler (and the lanes, queues and
+ * slots are all static, so nothing here is on the heap at all):
+ * - Small slots for the usual payloads (an index, a press time), large ones for js_cmd_t
+ * - The safety and audio lanes have a few small slots of their own and only use the shared ones once those are
+ *   taken, so a burst of BLE state or battery events can't leave an emergency press without a slot
+ * - The free slots and each lane's queue are FreeRTOS queues of slot pointers. A lane queue holds every slot, so
+ *   posting only fails when the pool is empty, and never waits. That makes it safe from timer callbacks and ISRs.
+ * - js_events_claim() hands out a slot to build the payload in place (js_cmd parses straight into one),
+ *   js_events_post() copies a small payload into one
+ * - Posts that find no free slot are counted per lane (js_lane_stats_t.dropped)
+ * - Everything on the posting path is in IRAM, and the lane of each event is looked up in a table filled in at
+ *   init (a switch can compile to a jump table in flash), so posting works with the flash cache off
+ *
+ * Commands from BLE and serial also go through admission control before the config lane:
+ * - Each source (serial, or a BLE connection) may only have a few commands waiting, and all sources together
+ *   leave large slots free for local events
+ * - Each source has a token bucket, writes (NVS commits) cost more than reads
+ * Rejected commands return an error so the caller can NACK ("X:BUSY") instead of dropping them silently.
+ */
+
+// Self Include
 #include "js_events.h"
-ESP_EVENT_DEFINE_BASE(JS_EVENT_BASE);
\ No newline at end of file
+
+// Library Includes
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include <stddef.h>
+#include <string.h>
+
+// Local Includes
+#include "js_trace.h"
+
+// Defines
+#define TAG "js_events"
+#define SHARED_SLOTS 16                                         // Small slots any lane can take
+#define SAFETY_SLOTS 4                                          // Small slots only the safety lane takes
+#define AUDIO_SLOTS 4                                           // Small slots only the audio lane takes
+#define SMALL_SLOTS (SHARED_SLOTS + SAFETY_SLOTS + AUDIO_SLOTS) // Button, timer and BLE state events
+#define LARGE_SLOTS 10                                          // Commands (CMD_PENDING_TOTAL) plus spare
+#define TOTAL_SLOTS (SMALL_SLOTS + LARGE_SLOTS)                 // Lane queue length, so a claimed slot can always be queued
+#define LANE_STACKS (3 * 3072 + 4096)           // The s_lane_defs stack sizes added up
+
+// Admission control
+#define CMD_MAX_SOURCES 4        // Serial plus the BLE connections
+#define CMD_PENDING_PER_SOURCE 4 // Commands one source can have waiting in the config lane
+#define CMD_PENDING_TOTAL 8      // All sources together (leaves 2 large slots)
+
+// Token bucket per source
+#define CMD_TOKENS_PER_S 10 // Sustained rate, in read commands per second
+#define CMD_BURST 20        // Bucket size: a full sync (T, L and A writes) plus a few reads at once
+#define CMD_COST_READ 1     // Answered from RAM
+#define CMD_COST_WRITE 5    // Commits to NVS or changes the clock
+#define MILLI_TOKENS 1000   // Bucket is kept in thousandths of a token so refills don't round away
+
+ESP_EVENT_DEFINE_BASE(JS_EVENT_BASE);
+
+// Types
+typedef struct {
+    const char *name;
+    uint32_t stack_size;
+    UBaseType_t priority;
+} lane_def_t;
+
+typedef struct {
+    QueueHandle_t queue; // msg_t pointers
+    js_lane_stats_t stats;
+    StaticQueue_t queue_mem;
+    uint8_t queue_storage[TOTAL_SLOTS * sizeof(void *)];
+    StaticTask_t task_mem;
+} lane_t;
+
+// A slot: header, then the payload
+typedef struct {
+    int32_t event_id;
+    uint32_t size; // Of data that's used (0: the handler gets NULL, as with esp_event_post)
+    int64_t origin_us;
+    int64_t posted_us;
+    QueueHandle_t pool; // Free list it goes back to
+    int8_t source;      // Index in s_sources of the admitted command it holds (freed when handled), -1 otherwise
+    uint8_t data[] __attribute__((aligned(8)));
+} msg_t;
+
+typedef struct {
+    bool in_use; // Connected, or closed with commands still in the loop
+    bool closed; // Its connection closed, the slot is freed once pending drains
+    uint16_t reply_to;
+    uint8_t pending; // Posted, not yet handled
+    int32_t milli_tokens;
+    int64_t last_refill_us;
+    uint32_t dropped; // Busy or rate limited
+} cmd_source_t;
+
+// Lanes, highest priority first. Safety is above every app task, config sits below the buttons and audio playback.
+static const lane_def_t s_lane_defs[JS_LANE_COUNT] = {
+    [JS_LANE_SAFETY] = {"safety", 3072, 20},
+    [JS_LANE_AUDIO] = {"audio", 3072, 15},
+    [JS_LANE_CONFIG] = {"config", 4096, 8},
+    [JS_LANE_HOUSEKEEPING] = {"housekeeping", 3072, 7},
+};
+
+// Forward Declarations
+static lane_t s_lanes[JS_LANE_COUNT];
+static uint8_t s_small_mem[SMALL_SLOTS][sizeof(msg_t) + JS_EVENT_SMALL_PAYLOAD] __attribute__((aligned(8)));
+static uint8_t s_large_mem[LARGE_SLOTS][sizeof(msg_t) + JS_EVENT_LARGE_PAYLOAD] __attribute__((aligned(8)));
+static StackType_t s_lane_stacks[LANE_STACKS] __attribute__((aligned(16))); // Split between the lanes
+static QueueHandle_t s_small_pool = NULL; // Shared
+static QueueHandle_t s_large_pool = NULL;
+static QueueHandle_t s_reserved_pools[JS_LANE_COUNT]; // NULL for lanes without their own small slots
+static StaticQueue_t s_small_pool_mem;
+static StaticQueue_t s_large_pool_mem;
+static StaticQueue_t s_safety_pool_mem;
+static StaticQueue_t s_audio_pool_mem;
+static uint8_t s_small_pool_storage[SHARED_SLOTS * sizeof(void *)];
+static uint8_t s_large_pool_storage[LARGE_SLOTS * sizeof(void *)];
+static uint8_t s_safety_pool_storage[SAFETY_SLOTS * sizeof(void *)];
+static uint8_t s_audio_pool_storage[AUDIO_SLOTS * sizeof(void *)];
+static uint8_t s_event_lanes[JS_EVENT_COUNT]; // lane_for_event() for each event, filled in at init
+static js_slot_stats_t s_slot_stats = {.small_free_min = SHARED_SLOTS, .large_free_min = LARGE_SLOTS};
+static esp_event_handler_t s_app_handler = NULL;
+static void *s_app_arg = NULL;
+static cmd_source_t s_sources[CMD_MAX_SOURCES];
+static uint8_t s_pending_total = 0;
+static js_cmd_stats_t s_stats;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static js_lane_t lane_for_event(int32_t event_id);
+static js_lane_t event_lane(int32_t event_id);
+static void lane_task(void *arg);
+static QueueHandle_t create_pool(uint8_t *mem, size_t slot_size, int count, uint8_t *storage, StaticQueue_t *queue_mem);
+static msg_t *msg_from_payload(void *payload);
+static esp_err_t admit(int32_t event_id, uint16_t reply_to, int8_t *source);
+static void release(int8_t source);
+static cmd_source_t *find_source(uint16_t reply_to, bool create);
+static int32_t cmd_cost(int32_t event_id);
+
+/** Create the slot pools and the lanes (a queue and task each, all static). Events handled before js_events_register_handler() are dropped. */
+esp_err_t js_events_init(void) {
+    s_small_pool = create_pool(&s_small_mem[0][0], sizeof(s_small_mem[0]), SHARED_SLOTS, s_small_pool_storage, &s_small_pool_mem);
+    s_reserved_pools[JS_LANE_SAFETY] = create_pool(&s_small_mem[SHARED_SLOTS][0], sizeof(s_small_mem[0]), SAFETY_SLOTS,
+                                                   s_safety_pool_storage, &s_safety_pool_mem);
+    s_reserved_pools[JS_LANE_AUDIO] = create_pool(&s_small_mem[SHARED_SLOTS + SAFETY_SLOTS][0], sizeof(s_small_mem[0]), AUDIO_SLOTS,
+                                                  s_audio_pool_storage, &s_audio_pool_mem);
+    s_large_pool = create_pool(&s_large_mem[0][0], sizeof(s_large_mem[0]), LARGE_SLOTS, s_large_pool_storage, &s_large_pool_mem);
+    if (!s_small_pool || !s_reserved_pools[JS_LANE_SAFETY] || !s_reserved_pools[JS_LANE_AUDIO] || !s_large_pool) return ESP_ERR_NO_MEM;
+
+    for (int i = 0; i < JS_EVENT_COUNT; i++) {
+        s_event_lanes[i] = lane_for_event(i);
+    }
+
+    size_t stack_offset = 0;
+    for (int i = 0; i < JS_LANE_COUNT; i++) {
+        lane_t *lane = &s_lanes[i];
+        const lane_def_t *def = &s_lane_defs[i];
+        if (stack_offset + def->stack_size > LANE_STACKS) return ESP_ERR_INVALID_SIZE; // LANE_STACKS is out of date
+
+        lane->queue = xQueueCreateStatic(TOTAL_SLOTS, sizeof(msg_t *), lane->queue_storage, &lane->queue_mem);
+        if (!lane->queue) return ESP_ERR_NO_MEM;
+        if (!xTaskCreateStatic(lane_task, def->name, def->stack_size, lane, def->priority, &s_lane_stacks[stack_offset], &lane->task_mem)) {
+            return ESP_ERR_NO_MEM;
+        }
+        stack_offset += def->stack_size;
+    }
+    return ESP_OK;
+}
+
+/* ************************** Global Functions ************************** */
+// Set the app's handler, called for every event on whichever lane it was routed to (so it runs on several tasks)
+esp_err_t js_events_register_handler(esp_event_handler_t handler, void *arg) {
+    if (s_app_handler) return ESP_ERR_INVALID_STATE;
+    s_app_arg = arg;
+    s_app_handler = handler;
+    return ESP_OK;
+}
+
+// Post an app event to its lane (takes the place of esp_event_post), starting the trace now. Never waits.
+esp_err_t IRAM_ATTR js_events_post(int32_t event_id, const void *data, size_t size) {
+    return js_events_post_at(event_id, data, size, 0);
+}
+
+// Post an app event to its lane, traced from origin_us (when the ISR or BLE write that caused it ran, 0 for now)
+esp_err_t IRAM_ATTR js_events_post_at(int32_t event_id, const void *data, size_t size, int64_t origin_us) {
+    void *payload = js_events_claim(event_id, size);
+    if (!payload) return size > JS_EVENT_LARGE_PAYLOAD ? ESP_ERR_INVALID_SIZE : ESP_ERR_NO_MEM;
+
+    if (size) memcpy(payload, data, size);
+    return js_events_send(payload, size, origin_us);
+}
+
+/**
+ * Take a free slot for an event with up to size bytes of payload, to build the payload in place. Returns NULL
+ * when the pool is empty (counted as a drop on the event's lane). Safe from ISRs and timer callbacks.
+ * Hand it to js_events_send() or give it back with js_events_release().
+ */
+void *IRAM_ATTR js_events_claim(int32_t event_id, size_t size) {
+    js_lane_t lane = event_lane(event_id);
+    QueueHandle_t pool = size <= JS_EVENT_SMALL_PAYLOAD ? s_small_pool : size <= JS_EVENT_LARGE_PAYLOAD ? s_large_pool : NULL;
+    bool in_isr = xPortInIsrContext();
+    msg_t *msg = NULL;
+
+    // The lane's own small slots first, the shared ones once those are taken
+    QueueHandle_t reserved = pool == s_small_pool ? s_reserved_pools[lane] : NULL;
+    if (reserved) {
+        if (in_isr) {
+            xQueueReceiveFromISR(reserved, &msg, NULL);
+        } else {
+            xQueueReceive(reserved, &msg, 0);
+        }
+        if (msg) pool = reserved;
+    }
+    if (pool && !msg) {
+        if (in_isr) {
+            xQueueReceiveFromISR(pool, &msg, NULL);
+        } else {
+            xQueueReceive(pool, &msg, 0);
+        }
+    }
+    UBaseType_t free_slots = !pool ? 0 : in_isr ? uxQueueMessagesWaitingFromISR(pool) : uxQueueMessagesWaiting(pool);
+
+    portENTER_CRITICAL_SAFE(&s_lock);
+    if (!msg) {
+        s_lanes[lane].stats.dropped++;
+    } else if (pool == s_small_pool) { // The low water marks leave out the reserved slots
+        if (free_slots < s_slot_stats.small_free_min) s_slot_stats.small_free_min = free_slots;
+    } else if (pool == s_large_pool) {
+        if (free_slots < s_slot_stats.large_free_min) s_slot_stats.large_free_min = free_slots;
+    }
+    portEXIT_CRITICAL_SAFE(&s_lock);
+    if (!msg) return NULL;
+
+    msg->event_id = event_id;
+    msg->pool = pool;
+    msg->source = -1;
+    return msg->data;
+}
+
+// Queue a claimed slot on its event's lane, size is the part of the payload that's used. Never waits.
+esp_err_t IRAM_ATTR js_events_send(void *payload, size_t size, int64_t origin_us) {
+    msg_t *msg = msg_from_payload(payload);
+    lane_t *lane = &s_lanes[event_lane(msg->event_id)];
+
+    msg->size = size;
+    msg->posted_us = esp_timer_get_time();
+    msg->origin_us = origin_us ? origin_us : msg->posted_us;
+    js_trace_record(JS_TRACE_POST, msg->event_id, msg->origin_us, msg->posted_us);
+
+    // Can't be full, the lane queue has room for every slot
+    BaseType_t woken = pdFALSE;
+    BaseType_t sent = xPortInIsrContext() ? xQueueSendFromISR(lane->queue, &msg, &woken) : xQueueSend(lane->queue, &msg, 0);
+    if (sent != pdTRUE) {
+        js_events_release(payload);
+        return ESP_ERR_TIMEOUT;
+    }
+    if (woken) portYIELD_FROM_ISR();
+    return ESP_OK;
+}
+
+// Give back a claimed slot that wasn't sent
+void IRAM_ATTR js_events_release(void *payload) {
+    msg_t *msg = msg_from_payload(payload);
+    if (xPortInIsrContext()) {
+        xQueueSendFromISR(msg->pool, &msg, NULL);
+    } else {
+        xQueueSend(msg->pool, &msg, 0);
+    }
+}
+
+/**
+ * Send a claimed slot holding a command. cmd starts with the uint16_t reply_to (js_cmd_t does), size is the part
+ * of it that's used, origin_us is when the line was received. The slot is given back if it isn't sent.
+ * Returns ESP_ERR_NO_MEM when the source is saturated and ESP_ERR_INVALID_STATE when the source is over its rate,
+ * so the caller can NACK.
+ */
+esp_err_t js_events_send_cmd(void *cmd, size_t size, int64_t origin_us) {
+    msg_t *msg = msg_from_payload(cmd);
+    uint16_t reply_to = *(const uint16_t *)cmd;
+    int8_t source;
+    esp_err_t err = admit(msg->event_id, reply_to, &source);
+    if (err != ESP_OK) {
+        js_events_release(cmd);
+        return err;
+    }
+
+    // The slot carries the source, so the command is counted off the slot that admitted it even after a reconnect
+    msg->source = source;
+    err = js_events_send(cmd, size, origin_us);
+    if (err != ESP_OK) {
+        release(source);
+        taskENTER_CRITICAL(&s_lock);
+        s_stats.loop_full++;
+        taskEXIT_CRITICAL(&s_lock);
+    }
+    return err;
+}
+
+// A BLE connection closed: log what it had dropped and free its slot once its commands in the loop are handled
+void js_events_release_source(uint16_t reply_to) {
+    taskENTER_CRITICAL(&s_lock);
+    cmd_source_t *src = find_source(reply_to, false);
+    uint32_t dropped = src ? src->dropped : 0;
+    if (src) {
+        src->closed = true;
+        if (src->pending == 0) src->in_use = false;
+    }
+    taskEXIT_CRITICAL(&s_lock);
+
+    if (dropped) ESP_LOGW(TAG, "Source %u dropped %lu commands", reply_to, (unsigned long)dropped);
+}
+
+// Copy one lane's latency stats
+void js_events_get_lane_stats(js_lane_t lane, js_lane_stats_t *stats) {
+    taskENTER_CRITICAL(&s_lock);
+    *stats = s_lanes[lane].stats;
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+const char *js_events_lane_name(js_lane_t lane) {
+    return s_lane_defs[lane].name;
+}
+
+// Copy the slot pool low water marks
+void js_events_get_slot_stats(js_slot_stats_t *stats) {
+    taskENTER_CRITICAL(&s_lock);
+    *stats = s_slot_stats;
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+// Copy the command counters
+void js_events_get_cmd_stats(js_cmd_stats_t *stats) {
+    taskENTER_CRITICAL(&s_lock);
+    *stats = s_stats;
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+/* ************************** Local Functions ************************** */
+// Which lane an event runs on (copied into s_event_lanes at init, use event_lane() on the posting path)
+static js_lane_t lane_for_event(int32_t event_id) {
+    switch (event_id) {
+    case JS_EVENT_EMERGENCY_BUTTON_PRESSED:
+        return JS_LANE_SAFETY;
+
+    case JS_EVENT_PLAY_AUDIO:
+    case JS_EVENT_STOP_AUDIO:
+        return JS_LANE_AUDIO;
+
+    // Everything that reads or writes the settings or the timezone runs here, one at a time, so they need no lock
+    // (js_user_settings_get_alarms() returns a static buffer, and the TZ is set with setenv)
+    case JS_EVENT_SET_NEXT_ALARM:
+    case JS_EVENT_READ_SYSTEM_TIME:
+    case JS_EVENT_WRITE_SYSTEM_TIME:
+    case JS_EVENT_READ_TIMEZONE:
+    case JS_EVENT_WRITE_TIMEZONE:
+    case JS_EVENT_READ_ALARMS:
+    case JS_EVENT_WRITE_ALARMS:
+    case JS_EVENT_READ_SETTINGS:
+    case JS_EVENT_WRITE_SETTINGS:
+    case JS_EVENT_READ_BATTERY:
+    case JS_EVENT_READ_CHARGER:
+    case JS_EVENT_READ_LANE_STATS:
+    case JS_EVENT_READ_TRACE:
+    case JS_EVENT_READ_DIAG:
+    case JS_EVENT_READ_CPU:
+    case JS_EVENT_DUMP_TRACE:
+    case JS_EVENT_RUN_BENCHMARK:
+        return JS_LANE_CONFIG;
+
+    default:
+        return JS_LANE_HOUSEKEEPING;
+    }
+}
+
+// Lane of an event from the table, safe from ISRs with the flash cache off
+static js_lane_t IRAM_ATTR event_lane(int32_t event_id) {
+    return event_id >= 0 && event_id < JS_EVENT_COUNT ? s_event_lanes[event_id] : JS_LANE_HOUSEKEEPING;
+}
+
+// Lane task: take each event off the queue, call the app handler, record the latency and free the slot
+static void lane_task(void *arg) {
+    lane_t *lane = arg;
+    msg_t *msg;
+
+    for (;;) {
+        if (xQueueReceive(lane->queue, &msg, portMAX_DELAY) != pdTRUE) continue;
+
+        int64_t start_us = esp_timer_get_time();
+        js_trace_record(JS_TRACE_DISPATCH, msg->event_id, msg->origin_us, start_us);
+        if (s_app_handler) s_app_handler(s_app_arg, JS_EVENT_BASE, msg->event_id, msg->size ? msg->data : NULL);
+        int64_t end_us = esp_timer_get_time();
+        js_trace_record(JS_TRACE_EXIT, msg->event_id, msg->origin_us, end_us);
+        js_trace_complete(msg->event_id, msg->origin_us, end_us);
+
+        uint32_t wait_us = start_us - msg->posted_us;
+        uint32_t run_us = end_us - start_us;
+        taskENTER_CRITICAL(&s_lock);
+        js_lane_stats_t *stats = &lane->stats;
+        stats->count++;
+        stats->total_wait_us += wait_us;
+        if (wait_us > stats->max_wait_us) stats->max_wait_us = wait_us;
+        if (run_us > stats->max_run_us) stats->max_run_us = run_us;
+        taskEXIT_CRITICAL(&s_lock);
+
+        if (msg->source >= 0) release(msg->source);
+        xQueueSend(msg->pool, &msg, 0);
+    }
+}
+
+// Free list of count slots of slot_size bytes each (storage has room for count pointers)
+static QueueHandle_t create_pool(uint8_t *mem, size_t slot_size, int count, uint8_t *storage, StaticQueue_t *queue_mem) {
+    QueueHandle_t pool = xQueueCreateStatic(count, sizeof(msg_t *), storage, queue_mem);
+    if (!pool) return NULL;
+    for (int i = 0; i < count; i++) {
+        msg_t *msg = (msg_t *)(mem + i * slot_size);
+        xQueueSend(pool, &msg, 0);
+    }
+    return pool;
+}
+
+static msg_t *IRAM_ATTR msg_from_payload(void *payload) {
+    return (msg_t *)((uint8_t *)payload - offsetof(msg_t, data));
+}
+
+// Check the source's queue and token bucket, and count the command as pending if it's let through
+static esp_err_t admit(int32_t event_id, uint16_t reply_to, int8_t *source) {
+    int64_t now = esp_timer_get_time();
+    int32_t cost = cmd_cost(event_id) * MILLI_TOKENS;
+    esp_err_t err = ESP_OK;
+
+    taskENTER_CRITICAL(&s_lock);
+    cmd_source_t *src = find_source(reply_to, true);
+    if (src) {
+        // Refill the bucket for the time since the last command
+        int64_t refill = (now - src->last_refill_us) * CMD_TOKENS_PER_S * MILLI_TOKENS / 1000000;
+        src->milli_tokens = refill >= CMD_BURST * MILLI_TOKENS - src->milli_tokens ? CMD_BURST * MILLI_TOKENS : src->milli_tokens + refill;
+        src->last_refill_us = now;
+    }
+
+    if (!src || src->pending >= CMD_PENDING_PER_SOURCE || s_pending_total >= CMD_PENDING_TOTAL) {
+        err = ESP_ERR_NO_MEM;
+        s_stats.busy++;
+    } else if (src->milli_tokens < cost) {
+        err = ESP_ERR_INVALID_STATE;
+        s_stats.rate_limited++;
+    } else {
+        src->milli_tokens -= cost;
+        src->pending++;
+        s_pending_total++;
+        s_stats.accepted++;
+    }
+    if (err != ESP_OK && src) src->dropped++;
+    uint32_t dropped = src ? src->dropped : 0;
+    *source = src ? src - s_sources : -1;
+    taskEXIT_CRITICAL(&s_lock);
+
+    // The first drop and then every 10th, a flooding client shouldn't flood the log too
+    if (err != ESP_OK && dropped % 10 == 1) {
+        ESP_LOGW(TAG, "Command %ld from %u rejected (%s), %lu dropped", (long)event_id, reply_to, err == ESP_ERR_NO_MEM ? "busy" : "rate", (unsigned long)dropped);
+    }
+    return err;
+}
+
+// The command was handled (or never made it into the loop). The last one of a closed source frees its slot.
+static void release(int8_t source) {
+    taskENTER_CRITICAL(&s_lock);
+    cmd_source_t *src = &s_sources[source];
+    if (src->pending) src->pending--;
+    if (src->closed && src->pending == 0) src->in_use = false;
+    if (s_pending_total) s_pending_total--;
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+/**
+ * Find the source slot (call with s_lock held). A new source takes over the last slot its reply_to had, closed or
+ * freed, with its bucket and any commands still in the loop, so reconnecting doesn't refill the bucket.
+ * Otherwise it gets a free slot with a full bucket.
+ */
+static cmd_source_t *find_source(uint16_t reply_to, bool create) {
+    cmd_source_t *free_slot = NULL;
+    cmd_source_t *last_slot = NULL;
+    for (int i = 0; i < CMD_MAX_SOURCES; i++) {
+        cmd_source_t *src = &s_sources[i];
+        bool used = src->last_refill_us != 0; // Slots that never had a source are all zero
+        if (src->in_use && !src->closed && src->reply_to == reply_to) return src;
+        if (used && (src->closed || !src->in_use) && src->reply_to == reply_to) last_slot = src;
+        if (!src->in_use && !free_slot) free_slot = src;
+    }
+    if (!create) return NULL;
+
+    if (last_slot) {
+        last_slot->in_use = true;
+        last_slot->closed = false;
+        last_slot->dropped = 0; // Logged per connection
+        return last_slot;
+    }
+    if (!free_slot) return NULL;
+
+    *free_slot = (cmd_source_t){
+        .in_use = true,
+        .reply_to = reply_to,
+        .milli_tokens = CMD_BURST * MILLI_TOKENS,
+        .last_refill_us = esp_timer_get_time(),
+    };
+    return free_slot;
+}
+
+// Writes cost more than reads since they commit to NVS or touch the RTC
+static int32_t cmd_cost(int32_t event_id) {
+    switch (event_id) {
+    case JS_EVENT_WRITE_SYSTEM_TIME:
+    case JS_EVENT_WRITE_TIMEZONE:
+    case JS_EVENT_WRITE_ALARMS:
+    case JS_EVENT_WRITE_SETTINGS:
+        return CMD_COST_WRITE;
+    default:
+        return CMD_COST_READ;
+    }
+}
@@ -0,0 +1,140 @@
+/**
+ * Event tracing
+ * Follows an event from where it started (button ISR, BLE write or serial line) through the post and the lane
+ * to the end of app_event_handler(), to check the emergency button's response time under load.
+ * - Trace points go into a ring buffer, a slot is claimed with one atomic add so ISRs and every task can record
+ *   without a lock. Only the last TRACE_RING_SIZE points are kept, and a dump taken while something records may
+ *   show one torn entry.
+ * - Each event ID has a histogram of origin to handler exit. An event ID always runs on the same lane, so each
+ *   histogram has a single writer.
+ */
+
+// Self Include
+#include "js_trace.h"
+
+// Library Includes
+#include "esp_attr.h"
+#include "esp_log.h"
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+// Local Includes
+#include "js_events.h"
+
+// Defines
+#define TAG "js_trace"
+#define TRACE_RING_SIZE 256 // Power of 2
+#define HIST_FIRST_SHIFT 6  // Bucket 0 is below 2^6 us
+
+// Types
+typedef struct {
+    uint32_t time_us;         // Low 32 bits of esp_timer_get_time()
+    uint32_t since_origin_us; // 0 for the ISR point
+    uint16_t id;              // Event ID, or the GPIO for the ISR point
+    uint8_t point;            // js_trace_point_t
+    uint8_t valid;
+} trace_entry_t;
+
+typedef struct {
+    uint32_t count;
+    uint32_t max_us;
+    uint32_t buckets[JS_TRACE_HIST_BUCKETS];
+} trace_hist_t;
+
+// Forward Declarations
+static trace_entry_t s_ring[TRACE_RING_SIZE];
+static atomic_uint s_head = 0;
+static trace_hist_t s_hist[JS_EVENT_COUNT];
+static const char *const s_point_names[] = {"isr", "post", "dispatch", "exit"};
+static int hist_bucket(uint32_t us);
+static uint32_t hist_percentile(const trace_hist_t *hist, uint32_t percent);
+
+/* ************************** Global Functions ************************** */
+// Add a trace point to the ring. In IRAM for button_isr().
+void IRAM_ATTR js_trace_record(js_trace_point_t point, uint16_t id, int64_t origin_us, int64_t now_us) {
+    unsigned idx = atomic_fetch_add_explicit(&s_head, 1, memory_order_relaxed) & (TRACE_RING_SIZE - 1);
+    trace_entry_t *entry = &s_ring[idx];
+    entry->time_us = (uint32_t)now_us;
+    entry->since_origin_us = origin_us ? (uint32_t)(now_us - origin_us) : 0;
+    entry->id = id;
+    entry->point = point;
+    entry->valid = 1;
+}
+
+// The handler for an event returned, add it to the event's histogram
+void js_trace_complete(int32_t event_id, int64_t origin_us, int64_t end_us) {
+    if (event_id < 0 || event_id >= JS_EVENT_COUNT) return;
+
+    int64_t total = end_us - origin_us;
+    uint32_t us = total > UINT32_MAX ? UINT32_MAX : (uint32_t)total;
+    trace_hist_t *hist = &s_hist[event_id];
+    hist->buckets[hist_bucket(us)]++;
+    if (us > hist->max_us) hist->max_us = us;
+    hist->count++;
+}
+
+/**
+ * Every event that has run: "<id>:<count>,<p50 us>,<p99 us>,<max us>;..."
+ * The percentiles are the upper edge of their bucket. Returns the length written.
+ */
+size_t js_trace_format_summary(char *out, size_t out_size) {
+    size_t len = 0;
+    out[0] = '\0';
+    for (int i = 0; i < JS_EVENT_COUNT && len < out_size; i++) {
+        const trace_hist_t *hist = &s_hist[i];
+        if (!hist->count) continue;
+        len += snprintf(out + len, out_size - len, "%s%d:%lu,%lu,%lu,%lu", len ? ";" : "", i,
+                        (unsigned long)hist->count, (unsigned long)hist_percentile(hist, 50),
+                        (unsigned long)hist_percentile(hist, 99), (unsigned long)hist->max_us);
+    }
+    return len;
+}
+
+// One event's bucket counts: "<id>:<b0>,<b1>,...,<b15>" (bucket 0 is < 64 us, bucket n < 2^(n+6) us)
+esp_err_t js_trace_format_hist(int32_t event_id, char *out, size_t out_size) {
+    if (event_id < 0 || event_id >= JS_EVENT_COUNT) return ESP_ERR_INVALID_ARG;
+
+    const trace_hist_t *hist = &s_hist[event_id];
+    size_t len = snprintf(out, out_size, "%ld", (long)event_id);
+    for (int b = 0; b < JS_TRACE_HIST_BUCKETS && len < out_size; b++) {
+        len += snprintf(out + len, out_size - len, "%c%lu", b ? ',' : ':', (unsigned long)hist->buckets[b]);
+    }
+    return ESP_OK;
+}
+
+// Print the ring to the console, oldest first
+void js_trace_dump(void) {
+    unsigned head = atomic_load(&s_head);
+    unsigned count = head < TRACE_RING_SIZE ? head : TRACE_RING_SIZE;
+
+    ESP_LOGI(TAG, "Last %u trace points (time us, point, event ID or GPIO, us since origin)", count);
+    for (unsigned n = head - count; n != head; n++) {
+        trace_entry_t entry = s_ring[n & (TRACE_RING_SIZE - 1)];
+        if (!entry.valid || entry.point >= sizeof(s_point_names) / sizeof(s_point_names[0])) continue;
+        printf("%10" PRIu32 " %-8s %3u %8" PRIu32 "\n", entry.time_us, s_point_names[entry.point], entry.id,
+               entry.since_origin_us);
+    }
+}
+
+/* ************************** Local Functions ************************** */
+// Bucket 0 below 64 us, then one per power of 2, the last one open ended
+static int hist_bucket(uint32_t us) {
+    if (us < (1U << HIST_FIRST_SHIFT)) return 0;
+    int bucket = (31 - __builtin_clz(us)) - HIST_FIRST_SHIFT + 1;
+    return bucket < JS_TRACE_HIST_BUCKETS ? bucket : JS_TRACE_HIST_BUCKETS - 1;
+}
+
+// Upper edge of the bucket the percentile falls in (the max for the open ended one)
+static uint32_t hist_percentile(const trace_hist_t *hist, uint32_t percent) {
+    uint32_t target = (hist->count * percent + 99) / 100;
+    uint32_t seen = 0;
+    for (int b = 0; b < JS_TRACE_HIST_BUCKETS - 1; b++) {
+        seen += hist->buckets[b];
+        if (seen >= target) {
+            uint32_t edge = 1U << (b + HIST_FIRST_SHIFT);
+            return edge < hist->max_us ? edge : hist->max_us;
+        }
+    }
+    return hist->max_us;
+}
@@ -10,7 +10,8 @@
 #include "led_strip.h"
 
 // Local Includes
-#include "js_ble.h"
+#include "js_sched.h"
+#include "js_state.h"
 
 // Defines
 #define TAG "js_leds"
@@ -18,10 +19,17 @@
 #define PIN_LED_BLE GPIO_NUM_7
 #define LED_BLE_ON 0 // LED is on when low
 #define PIN_MASK ((1ULL << PIN_LED_BLE))
+#define BLE_LED_BLINK_MS 500 // Toggle period while pairing
+#define NO_JOB -1
 
 // Forward Declarations
 static led_strip_handle_t led_strip;
-static void ble_led_task(void *arg);
+static js_sched_id_t s_blink_job = NO_JOB; // Only scheduled while pairing
+static bool s_ble_led_on = false;
+static void on_ble_state_changed(js_state_field_t field, void *arg);
+static void ble_led_update_job(void *arg);
+static void ble_led_blink_job(void *arg);
+static void set_ble_led(bool on);
 
 /** Initialize JS LEDs
  * Init the pins and code for the Neopixel LED
@@ -41,8 +49,9 @@ esp_err_t js_leds_init(void) {
     gpio_config(&led_config);
     gpio_set_level(PIN_LED_BLE, !LED_BLE_ON); // Start off
 
-    // Task to handle BLE LED
-    xTaskCreate(ble_led_task, "ble_led_task", 2048, NULL, 5, NULL);
+    // BLE LED follows the BLE state as it's published
+    esp_err_t err = js_state_subscribe(JS_STATE_BIT(JS_STATE_BLE), on_ble_state_changed, NULL);
+    if (err != ESP_OK) return err;
 
     /* LED strip config */
     led_strip_config_t strip_config = {
@@ -79,36 +88,36 @@ void js_leds_clear(void) {
 }
 
 /* ************************** Local Functions ************************** */
-// Set the ble_led based on the ble status
-static void ble_led_task(void *arg) {
-    bool led_was_on = false;
-
-    while (1) {
-        // Delay 500mS
-        vTaskDelay(pdMS_TO_TICKS(500));
-
-        // Get the BLE state
-        ble_state_t ble_state = js_ble_get_state();
-
-        // If connected, turn on the LED
-        if (ble_state == BLE_STATE_CONNECTED) {
-            gpio_set_level(PIN_LED_BLE, LED_BLE_ON);
-            led_was_on = true;
-            continue;
-        }
-
-        // If pairing, toggle the LED
-        if (ble_state == BLE_STATE_PAIRING) {
-            gpio_set_level(PIN_LED_BLE, led_was_on ? !LED_BLE_ON : LED_BLE_ON);
-            led_was_on = !led_was_on;
-            continue;
-        }
-
-        // If disconnected, turn off the LED
-        if (ble_state == BLE_STATE_DISCONNECTED) {
-            gpio_set_level(PIN_LED_BLE, !LED_BLE_ON);
-            led_was_on = false;
-            continue;
-        }
+// BLE state changed (on the BLE host or an event lane). The LED is only touched from js_sched, so the update
+// and the blink job never race.
+static void on_ble_state_changed(js_state_field_t field, void *arg) {
+    js_sched_after("ble_led", 0, ble_led_update_job, NULL, NULL);
+}
+
+// Connected: on, pairing: blinking, disconnected: off
+static void ble_led_update_job(void *arg) {
+    ble_state_t ble_state = js_state_get_ble();
+
+    if (ble_state == BLE_STATE_PAIRING) {
+        if (s_blink_job != NO_JOB) return; // Already blinking
+        set_ble_led(true);
+        js_sched_every("ble_blink", BLE_LED_BLINK_MS, ble_led_blink_job, NULL, &s_blink_job);
+        return;
+    }
+
+    if (s_blink_job != NO_JOB) {
+        js_sched_cancel(s_blink_job);
+        s_blink_job = NO_JOB;
     }
+    set_ble_led(ble_state == BLE_STATE_CONNECTED);
+}
+
+// Toggle the BLE LED (every 500mS while pairing, from js_sched)
+static void ble_led_blink_job(void *arg) {
+    set_ble_led(!s_ble_led_on);
+}
+
+static void set_ble_led(bool on) {
+    gpio_set_level(PIN_LED_BLE, on ? LED_BLE_ON : !LED_BLE_ON);
+    s_ble_led_on = on;
 }
@@ -0,0 +1,16 @@
+#pragma once
+#include "esp_err.h"
+#include <stdint.h>
+
+#define JS_SCHED_TICK_MS 10 // Wheel resolution, periods and delays are rounded up to it
+
+// Job callback, runs on the scheduler task. Has to return quickly, every other job waits for it.
+typedef void (*js_sched_fn_t)(void *arg);
+
+typedef int js_sched_id_t; // Job slot, -1 for none
+
+// Functions
+esp_err_t js_sched_init(void);
+esp_err_t js_sched_every(const char *name, uint32_t period_ms, js_sched_fn_t fn, void *arg, js_sched_id_t *id);
+esp_err_t js_sched_after(const char *name, uint32_t delay_ms, js_sched_fn_t fn, void *arg, js_sched_id_t *id);
+void js_sched_cancel(js_sched_id_t id);
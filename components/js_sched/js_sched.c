@@ -0,0 +1,217 @@
+/**
+ * Scheduler
+ * Periodic jobs (LED blinking, battery sampling, serial polling) and one-shot deadlines all run on one task from
+ * a timer wheel, instead of a task each waking on its own.
+ * - The wheel has WHEEL_SLOTS slots of JS_SCHED_TICK_MS. A job sits in the slot its expiry tick falls in, and a
+ *   slot only runs the jobs that are actually due (the rest are one or more turns of the wheel away).
+ * - The task sleeps until the earliest expiry (or a new job), so there is no fixed wakeup while idle.
+ * - Periodic jobs are rescheduled from their expiry, not from when they ran, so they don't drift.
+ * Jobs are cooperative: they run one after another and must not block.
+ */
+
+// Self Include
+#include "js_sched.h"
+
+// Library Includes
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// Defines
+#define TAG "js_sched"
+#define MAX_JOBS 16
+#define WHEEL_SLOTS 64                // Power of 2, one turn is 640 ms
+#define SCHED_STACK 4096              // Serial commands are routed from here
+#define SCHED_PRIORITY 5              // Where the LED and serial tasks were
+#define MAX_SLEEP_MS (60 * 60 * 1000) // Longest single wait, well inside TickType_t
+#define NO_JOB -1
+
+// Types
+typedef struct {
+    const char *name;
+    js_sched_fn_t fn;
+    void *arg;
+    uint32_t period_ticks; // 0: one-shot
+    int64_t expires;       // Absolute tick
+    int next;              // Next job in the same wheel slot
+    bool in_use;
+} job_t;
+
+// Forward Declarations
+static job_t s_jobs[MAX_JOBS];
+static int s_wheel[WHEEL_SLOTS]; // First job in each slot
+static int64_t s_next_tick = 0;  // First tick the wheel hasn't run yet
+static TaskHandle_t s_task = NULL;
+static StaticTask_t s_task_mem;
+static StackType_t s_task_stack[SCHED_STACK];
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static void sched_task(void *arg);
+static esp_err_t add_job(const char *name, uint32_t ms, uint32_t period_ms, js_sched_fn_t fn, void *arg, js_sched_id_t *id);
+static void wheel_insert(int job);
+static void wheel_remove(int job);
+static int64_t earliest_expiry(void);
+static int64_t current_tick(void);
+static uint32_t ms_to_ticks(uint32_t ms);
+
+/** Start the scheduler task */
+esp_err_t js_sched_init(void) {
+    for (int i = 0; i < WHEEL_SLOTS; i++) s_wheel[i] = NO_JOB;
+    s_next_tick = current_tick();
+    s_task = xTaskCreateStatic(sched_task, "sched", SCHED_STACK, NULL, SCHED_PRIORITY, s_task_stack, &s_task_mem);
+    if (!s_task) return ESP_ERR_NO_MEM;
+    return ESP_OK;
+}
+
+/* ************************** Global Functions ************************** */
+// Run fn every period_ms, first after one period. id (optional) is for js_sched_cancel().
+esp_err_t js_sched_every(const char *name, uint32_t period_ms, js_sched_fn_t fn, void *arg, js_sched_id_t *id) {
+    if (period_ms == 0) return ESP_ERR_INVALID_ARG;
+    return add_job(name, period_ms, period_ms, fn, arg, id);
+}
+
+// Run fn once after delay_ms
+esp_err_t js_sched_after(const char *name, uint32_t delay_ms, js_sched_fn_t fn, void *arg, js_sched_id_t *id) {
+    return add_job(name, delay_ms, 0, fn, arg, id);
+}
+
+// Stop a job (a one-shot that already ran is a no-op)
+void js_sched_cancel(js_sched_id_t id) {
+    if (id < 0 || id >= MAX_JOBS) return;
+    taskENTER_CRITICAL(&s_lock);
+    if (s_jobs[id].in_use) {
+        wheel_remove(id);
+        s_jobs[id].in_use = false;
+    }
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+/* ************************** Local Functions ************************** */
+static esp_err_t add_job(const char *name, uint32_t ms, uint32_t period_ms, js_sched_fn_t fn, void *arg, js_sched_id_t *id) {
+    if (!fn) return ESP_ERR_INVALID_ARG;
+    if (!s_task) return ESP_ERR_INVALID_STATE;
+
+    int job = NO_JOB;
+    taskENTER_CRITICAL(&s_lock);
+    for (int i = 0; i < MAX_JOBS && job == NO_JOB; i++) {
+        if (!s_jobs[i].in_use) job = i;
+    }
+    if (job != NO_JOB) {
+        s_jobs[job] = (job_t){
+            .name = name,
+            .fn = fn,
+            .arg = arg,
+            .period_ticks = ms_to_ticks(period_ms),
+            .expires = current_tick() + ms_to_ticks(ms),
+            .in_use = true,
+        };
+        if (s_jobs[job].expires < s_next_tick) s_jobs[job].expires = s_next_tick; // That slot's turn has passed
+        wheel_insert(job);
+    }
+    taskEXIT_CRITICAL(&s_lock);
+
+    if (job == NO_JOB) {
+        ESP_LOGE(TAG, "No free job slot for %s", name);
+        return ESP_ERR_NO_MEM;
+    }
+    if (id) *id = job;
+    xTaskNotifyGive(s_task); // Might be due before the task's current sleep ends
+    return ESP_OK;
+}
+
+// Turn the wheel up to now, run what's due, then sleep until the next expiry
+static void sched_task(void *arg) {
+    for (;;) {
+        int64_t now = current_tick();
+        for (;;) {
+            // Take the due jobs off the next slot first (a job may add or cancel jobs), and move the wheel on
+            int due[MAX_JOBS];
+            int due_count = 0;
+            taskENTER_CRITICAL(&s_lock);
+            int64_t earliest = earliest_expiry();
+            if (earliest > s_next_tick) s_next_tick = earliest <= now ? earliest : now + 1; // Skip the empty ticks
+            if (s_next_tick > now) {
+                taskEXIT_CRITICAL(&s_lock);
+                break;
+            }
+            int64_t tick = s_next_tick++;
+            for (int job = s_wheel[tick & (WHEEL_SLOTS - 1)], next; job != NO_JOB; job = next) {
+                next = s_jobs[job].next;
+                if (s_jobs[job].expires > tick) continue; // A later turn
+                wheel_remove(job);
+                due[due_count++] = job;
+            }
+            taskEXIT_CRITICAL(&s_lock);
+
+            for (int i = 0; i < due_count; i++) {
+                job_t *job = &s_jobs[due[i]];
+                js_sched_fn_t fn = NULL;
+                void *fn_arg = NULL;
+
+                taskENTER_CRITICAL(&s_lock);
+                if (job->in_use) { // Not cancelled since
+                    fn = job->fn;
+                    fn_arg = job->arg;
+                    if (job->period_ticks) {
+                        job->expires += job->period_ticks;
+                        if (job->expires < s_next_tick) job->expires = s_next_tick; // Fell behind, skip the missed runs
+                        wheel_insert(due[i]);
+                    } else {
+                        job->in_use = false;
+                    }
+                }
+                taskEXIT_CRITICAL(&s_lock);
+
+                if (fn) fn(fn_arg);
+            }
+        }
+
+        // Sleep until the earliest job, or until add_job() wakes us
+        taskENTER_CRITICAL(&s_lock);
+        int64_t next = earliest_expiry();
+        taskEXIT_CRITICAL(&s_lock);
+
+        TickType_t wait = portMAX_DELAY;
+        if (next != INT64_MAX) {
+            int64_t wait_ms = (next - current_tick()) * JS_SCHED_TICK_MS;
+            if (wait_ms > MAX_SLEEP_MS) wait_ms = MAX_SLEEP_MS;
+            wait = wait_ms > 0 ? pdMS_TO_TICKS(wait_ms) : 0;
+        }
+        ulTaskNotifyTake(pdTRUE, wait);
+    }
+}
+
+// Add a job to the slot of its expiry tick (call with s_lock held)
+static void wheel_insert(int job) {
+    int slot = s_jobs[job].expires & (WHEEL_SLOTS - 1);
+    s_jobs[job].next = s_wheel[slot];
+    s_wheel[slot] = job;
+}
+
+// Unlink a job from its slot (call with s_lock held)
+static void wheel_remove(int job) {
+    int *link = &s_wheel[s_jobs[job].expires & (WHEEL_SLOTS - 1)];
+    while (*link != NO_JOB && *link != job) link = &s_jobs[*link].next;
+    if (*link == job) *link = s_jobs[job].next;
+}
+
+// Expiry of the earliest job, INT64_MAX for none (call with s_lock held). There's at most MAX_JOBS, a scan is
+// cheaper than keeping them sorted.
+static int64_t earliest_expiry(void) {
+    int64_t earliest = INT64_MAX;
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (s_jobs[i].in_use && s_jobs[i].expires < earliest) earliest = s_jobs[i].expires;
+    }
+    return earliest;
+}
+
+static int64_t current_tick(void) {
+    return esp_timer_get_time() / (JS_SCHED_TICK_MS * 1000);
+}
+
+// Round up, so a job never runs early
+static uint32_t ms_to_ticks(uint32_t ms) {
+    return (ms + JS_SCHED_TICK_MS - 1) / JS_SCHED_TICK_MS;
+}
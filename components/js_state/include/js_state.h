@@ -0,0 +1,56 @@
+#pragma once
+
+// Includes
+#include "esp_err.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Defines
+#define JS_STATE_ALARMS_MAX 512 // Largest alarms string (JS_MAX_ALARMS in the `a` format)
+#define JS_STATE_MAX_SUBSCRIBERS 8
+#define JS_STATE_BIT(field) (1UL << (field)) // For the subscribe mask
+#define JS_STATE_ALL 0xFFFFFFFFUL
+
+// State values (owned by other components, read without going through the event loop or the hardware)
+typedef enum {
+    JS_STATE_BATTERY,    // Battery mV and charging
+    JS_STATE_TIMEZONE,   // POSIX TZ string
+    JS_STATE_ALARMS,     // Alarms string (same format as the `a` command)
+    JS_STATE_AUDIO,      // What the speaker is playing
+    JS_STATE_NEXT_ALARM, // Unix time of the next alarm
+    JS_STATE_BLE,        // BLE link state
+} js_state_field_t;
+
+// Audio playback state
+typedef enum {
+    JS_AUDIO_IDLE,
+    JS_AUDIO_SONG,
+    JS_AUDIO_EMERGENCY,
+} js_audio_state_t;
+
+// BLE link state
+typedef enum {
+    BLE_STATE_DISCONNECTED,
+    BLE_STATE_PAIRING, // Advertising
+    BLE_STATE_CONNECTED,
+} ble_state_t;
+
+// Called after a value changes, on the task that changed it (not from ISR, not while holding the cache lock).
+// Has to return quickly, anything slow should be handed to the subscriber's own task or a js_sched job.
+typedef void (*js_state_change_cb_t)(js_state_field_t field, void *arg);
+
+// Functions
+esp_err_t js_state_subscribe(uint32_t fields, js_state_change_cb_t cb, void *arg); // fields: JS_STATE_BIT() mask
+void js_state_set_battery(int battery_mv, bool charging);
+void js_state_get_battery(int *battery_mv, bool *charging);
+void js_state_set_timezone(const char *tz);
+size_t js_state_get_timezone(char *out, size_t out_size);
+void js_state_set_alarms(const char *alarms);
+size_t js_state_get_alarms(char *out, size_t out_size);
+void js_state_set_audio(js_audio_state_t audio);
+js_audio_state_t js_state_get_audio(void);
+void js_state_set_next_alarm(uint32_t unix_time);
+uint32_t js_state_get_next_alarm(void);
+void js_state_set_ble(ble_state_t ble);
+ble_state_t js_state_get_ble(void);
@@ -0,0 +1,177 @@
+/**
+ * State store
+ * One copy of the values other components react to (battery, BLE link, audio, settings), each owned and
+ * published by one component. Consumers read it instead of polling the owner or the hardware, and subscribe
+ * to the fields they care about to hear about a change as soon as it's published.
+ * - A set only notifies when the value actually changed
+ * - Subscriptions are made at init and never removed, so notifying walks them without a lock
+ */
+
+// Self Include
+#include "js_state.h"
+
+// Library Includes
+#include "freertos/FreeRTOS.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Defines
+#define TAG "js_state"
+#define BATTERY_CHANGE_MV 25 // Ignore ADC noise smaller than this when deciding if the battery changed
+
+// Types
+typedef struct {
+    int battery_mv;
+    bool charging;
+    char timezone[64];
+    char alarms[JS_STATE_ALARMS_MAX];
+    js_audio_state_t audio;
+    uint32_t next_alarm; // Unix time, 0 if no alarm is enabled
+    ble_state_t ble;
+} js_state_cache_t;
+
+typedef struct {
+    uint32_t fields; // JS_STATE_BIT() mask
+    js_state_change_cb_t cb;
+    void *arg;
+} subscriber_t;
+
+// Forward Declarations
+static js_state_cache_t s_cache;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static subscriber_t s_subs[JS_STATE_MAX_SUBSCRIBERS];
+static volatile int s_sub_count = 0;
+static bool set_string(char *dst, size_t dst_size, const char *src);
+static size_t get_string(const char *src, char *out, size_t out_size);
+static void notify_change(js_state_field_t field);
+
+/* ************************** Global Functions ************************** */
+// Call cb after any of the fields in the mask changes (for good, there's no unsubscribe)
+esp_err_t js_state_subscribe(uint32_t fields, js_state_change_cb_t cb, void *arg) {
+    if (!cb || !fields) return ESP_ERR_INVALID_ARG;
+
+    esp_err_t ret = ESP_OK;
+    taskENTER_CRITICAL(&s_lock);
+    if (s_sub_count < JS_STATE_MAX_SUBSCRIBERS) {
+        s_subs[s_sub_count] = (subscriber_t){.fields = fields, .cb = cb, .arg = arg};
+        s_sub_count++; // Only counted once it's filled in, notify_change() may be walking the list
+    } else {
+        ret = ESP_ERR_NO_MEM;
+    }
+    taskEXIT_CRITICAL(&s_lock);
+    return ret;
+}
+
+// Update the battery voltage and charging state
+void js_state_set_battery(int battery_mv, bool charging) {
+    taskENTER_CRITICAL(&s_lock);
+    bool changed = charging != s_cache.charging || abs(battery_mv - s_cache.battery_mv) >= BATTERY_CHANGE_MV;
+    s_cache.battery_mv = battery_mv;
+    s_cache.charging = charging;
+    taskEXIT_CRITICAL(&s_lock);
+
+    if (changed) notify_change(JS_STATE_BATTERY);
+}
+
+void js_state_get_battery(int *battery_mv, bool *charging) {
+    taskENTER_CRITICAL(&s_lock);
+    if (battery_mv) *battery_mv = s_cache.battery_mv;
+    if (charging) *charging = s_cache.charging;
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+// Update the timezone string
+void js_state_set_timezone(const char *tz) {
+    if (set_string(s_cache.timezone, sizeof(s_cache.timezone), tz)) notify_change(JS_STATE_TIMEZONE);
+}
+
+// Copy the timezone string to out and return its length
+size_t js_state_get_timezone(char *out, size_t out_size) {
+    return get_string(s_cache.timezone, out, out_size);
+}
+
+// Update the alarms string
+void js_state_set_alarms(const char *alarms) {
+    if (set_string(s_cache.alarms, sizeof(s_cache.alarms), alarms)) notify_change(JS_STATE_ALARMS);
+}
+
+// Copy the alarms string to out and return its length
+size_t js_state_get_alarms(char *out, size_t out_size) {
+    return get_string(s_cache.alarms, out, out_size);
+}
+
+// Update the audio playback state
+void js_state_set_audio(js_audio_state_t audio) {
+    taskENTER_CRITICAL(&s_lock);
+    bool changed = audio != s_cache.audio;
+    s_cache.audio = audio;
+    taskEXIT_CRITICAL(&s_lock);
+
+    if (changed) notify_change(JS_STATE_AUDIO);
+}
+
+js_audio_state_t js_state_get_audio(void) {
+    return s_cache.audio;
+}
+
+// Update the next alarm time (0 = no alarm enabled)
+void js_state_set_next_alarm(uint32_t unix_time) {
+    taskENTER_CRITICAL(&s_lock);
+    bool changed = unix_time != s_cache.next_alarm;
+    s_cache.next_alarm = unix_time;
+    taskEXIT_CRITICAL(&s_lock);
+
+    if (changed) notify_change(JS_STATE_NEXT_ALARM);
+}
+
+uint32_t js_state_get_next_alarm(void) {
+    return s_cache.next_alarm;
+}
+
+// Update the BLE link state
+void js_state_set_ble(ble_state_t ble) {
+    taskENTER_CRITICAL(&s_lock);
+    bool changed = ble != s_cache.ble;
+    s_cache.ble = ble;
+    taskEXIT_CRITICAL(&s_lock);
+
+    if (changed) notify_change(JS_STATE_BLE);
+}
+
+ble_state_t js_state_get_ble(void) {
+    return s_cache.ble;
+}
+
+/* ************************** Local Functions ************************** */
+// Copy a string into the cache under the lock. Returns true if it changed.
+static bool set_string(char *dst, size_t dst_size, const char *src) {
+    if (!src) src = "";
+
+    taskENTER_CRITICAL(&s_lock);
+    bool changed = strncmp(dst, src, dst_size) != 0;
+    strncpy(dst, src, dst_size - 1);
+    dst[dst_size - 1] = '\0';
+    taskEXIT_CRITICAL(&s_lock);
+
+    return changed;
+}
+
+// Copy a string out of the cache under the lock
+static size_t get_string(const char *src, char *out, size_t out_size) {
+    if (!out || out_size == 0) return 0;
+
+    taskENTER_CRITICAL(&s_lock);
+    strncpy(out, src, out_size - 1);
+    out[out_size - 1] = '\0';
+    taskEXIT_CRITICAL(&s_lock);
+
+    return strlen(out);
+}
+
+// Call every subscriber to the field, in the order they subscribed
+static void notify_change(js_state_field_t field) {
+    int count = s_sub_count;
+    for (int i = 0; i < count; i++) {
+        if (s_subs[i].fields & JS_STATE_BIT(field)) s_subs[i].cb(field, s_subs[i].arg);
+    }
+}
@@ -12,6 +12,7 @@
 #include <time.h>
 
 // Local Includes
+#include "js_dlog.h"
 #include "js_events.h"
 #include "js_i2c.h"
 #include "js_user_settings.h"
@@ -118,7 +119,7 @@ esp_err_t js_time_read_rtc(uint64_t *unix_seconds) {
     }
 
     // Print in human-readable format
-    ESP_LOGI(TAG, "RTC Time: 20%02d-%02d-%02d %02d:%02d:%02d",
+    JS_DLOGI(TAG, "RTC Time: 20%02d-%02d-%02d %02d:%02d:%02d",
              time_data[6], time_data[5], time_data[3], time_data[2], time_data[1], time_data[0]);
 
     // Build the time struct tm
@@ -301,11 +302,11 @@ static time_t tm_to_utc(const struct tm *t) {
 
 /*********************** Alarm Timer Callback *************************/
 static void alarm_timer_callback(void *arg) {
-    ESP_LOGI(TAG, "Alarm timer callback triggered! Playing alarm song index: %d", alarm_song_index);
+    JS_DLOGI(TAG, "Alarm timer callback triggered! Playing alarm song index: %d", alarm_song_index);
     // Call to play the song
     uint8_t song_idx = alarm_song_index;
-    esp_event_post(JS_EVENT_BASE, JS_EVENT_PLAY_AUDIO, &song_idx, sizeof(song_idx), portMAX_DELAY);
+    js_events_post(JS_EVENT_PLAY_AUDIO, &song_idx, sizeof(song_idx));
 
     // Set the next alarm based on user settings
-    esp_event_post(JS_EVENT_BASE, JS_EVENT_SET_NEXT_ALARM, NULL, 0, portMAX_DELAY);
+    js_events_post(JS_EVENT_SET_NEXT_ALARM, NULL, 0);
 }
\ No newline at end of file
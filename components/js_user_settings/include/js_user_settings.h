@@ -3,27 +3,44 @@
 // Includes
 #include "esp_err.h"
 #include <stdbool.h>
+#include <stdint.h>
+
+// Defines
+#define JS_MAX_ALARMS 32                      // Fits in one 512 byte BLE write ("A:" + up to 11 chars per alarm)
+#define JS_ALARMS_STR_MAX (JS_MAX_ALARMS * 12) // Read back string ("HH:MM,E,S;" per alarm)
+
+// Settings image for bulk provisioning (sent as hex after "S:", see README)
+#define JS_SETTINGS_IMAGE_VERSION 1
+#define JS_SETTINGS_IMAGE_HEADER 77                                              // Version, flags, length, unix time, timezone, alarm count
+#define JS_SETTINGS_IMAGE_MAX (JS_SETTINGS_IMAGE_HEADER + JS_MAX_ALARMS * 4 + 4) // Plus 4 bytes per alarm and the CRC32
+#define JS_SETTINGS_IMAGE_FLAG_TIME 0x01                                         // Unix time field is valid
 
 // Types
 typedef struct {
     uint8_t hour;       // 0–23 (local time)
     uint8_t minute;     // 0–59
-    uint8_t song_index; // 0–3
+    uint8_t song_index; // Track index, below JS_MAX_TRACKS (checked against the tracks there are when it plays)
     bool enabled;
 } js_alarm_t;
 
 typedef struct {
     char timezone[64]; // POSIX TZ string
     uint8_t alarm_count;
-    js_alarm_t alarms[10]; // Support up to 10 alarms for now.
+    js_alarm_t alarms[JS_MAX_ALARMS]; // Grown from 10, older NVS blobs are a prefix of this and still load
 } js_user_prefs_t;
 
+// Sets the clock and timezone from an imported settings image before it's saved (unix_time 0: the image has no time)
+typedef esp_err_t (*js_settings_apply_cb_t)(const char *tz, uint64_t unix_time);
+
 // Functions
 esp_err_t js_user_settings_init(void);
 const char *js_user_settings_get_timezone();
 esp_err_t js_user_settings_set_timezone(const char *tz);
 const char *js_user_settings_get_alarms();
-esp_err_t js_user_settings_set_alarms(const char *alarm_str);
+esp_err_t js_user_settings_parse_alarms(const char *alarm_str, js_alarm_t *alarms, uint8_t *count);
+esp_err_t js_user_settings_set_alarms(const js_alarm_t *alarms, uint8_t count);
+esp_err_t js_user_settings_import(const char *image_hex, js_settings_apply_cb_t apply);
+const char *js_user_settings_export(void);
 esp_err_t js_user_settings_seconds_until_next_alarm(uint64_t *seconds_until_alarm, int *next_alarm_song_index);
 
 /*
@@ -4,12 +4,17 @@
 // Library Includes
 #include "esp_check.h"
 #include "esp_log.h"
+#include "esp_rom_crc.h"
 #include "nvs.h"
 #include "nvs_flash.h"
+#include <ctype.h>
+#include <string.h>
 #include <sys/time.h>
 #include <time.h>
 
 // Local Includes
+#include "js_events.h"
+#include "js_state.h"
 
 // Defines
 #define TAG "js_user_settings"
@@ -18,6 +23,7 @@
 // Forward Declarations
 js_user_prefs_t user_prefs;
 esp_err_t save_to_nvs(void);
+static int hex_to_bytes(const char *hex, uint8_t *out, size_t max);
 
 /** Initialize JS User Settings */
 esp_err_t js_user_settings_init(void) {
@@ -31,6 +37,10 @@ esp_err_t js_user_settings_init(void) {
     size_t required_size = sizeof(user_prefs);
     ESP_ERROR_CHECK_WITHOUT_ABORT(nvs_get_blob(nvs_handle, "prefs", &user_prefs, &required_size));
 
+    // Publish the loaded settings to the state cache
+    js_state_set_timezone(js_user_settings_get_timezone());
+    js_state_set_alarms(js_user_settings_get_alarms());
+
     return ESP_OK;
 }
 
@@ -54,6 +64,9 @@ esp_err_t js_user_settings_set_timezone(const char *tz) {
     // Save to NVS
     ESP_RETURN_ON_ERROR(save_to_nvs(), TAG, "Failed to save user preferences to NVS");
 
+    // Update the state cache
+    js_state_set_timezone(user_prefs.timezone);
+
     return ESP_OK;
 }
 
@@ -62,7 +75,7 @@ esp_err_t js_user_settings_set_timezone(const char *tz) {
  * Format: "HH:MM,enabled,song_index;HH:MM,enabled,song_index;..."
  */
 const char *js_user_settings_get_alarms() {
-    static char buffer[256]; // TODO: Calculate required size based on alarm count
+    static char buffer[JS_ALARMS_STR_MAX];
     size_t offset = 0;
     buffer[0] = '\0'; // Ensure buffer is empty
 
@@ -85,45 +98,141 @@ const char *js_user_settings_get_alarms() {
 }
 
 /**
- * Fully overwrite the alarm settings from a passed in string
+ * Parse an alarm string into alarms (room for JS_MAX_ALARMS), without changing the settings
  * Format: "HH:MM,enabled,song_index;HH:MM,enabled,song_index;..."
  */
-esp_err_t js_user_settings_set_alarms(const char *alarm_str) {
-    ESP_LOGI(TAG, "Setting alarms from string: %s", alarm_str);
-    js_alarm_t new_alarms[10];
+esp_err_t js_user_settings_parse_alarms(const char *alarm_str, js_alarm_t *alarms, uint8_t *count) {
     uint8_t new_alarm_count = 0;
 
-    // Parse the input string
-    char *input_copy = strdup(alarm_str);  // Create a temp copy to work from
-    char *token = strtok(input_copy, ";"); // Split by semicolon to get each alarm
+    // Parse in place, one alarm per ";" (sscanf stops at the ";"), empty ones are skipped
+    for (const char *token = alarm_str; *token; token++) {
+        if (*token == ';') continue;
+
+        // Reject rather than silently drop the extra alarms
+        if (new_alarm_count >= JS_MAX_ALARMS) return ESP_ERR_INVALID_SIZE;
 
-    // Loop through each alarm token and parse the details
-    while (token != NULL && new_alarm_count < 10) {
         int hour, minute, enabled, song_index;
-        if (sscanf(token, "%d:%d,%d,%d", &hour, &minute, &enabled, &song_index) == 4) {
-            if (hour < 0 || hour > 23 || minute < 0 || minute > 59 || enabled < 0 || enabled > 1 || song_index < 0 || song_index > 3) {
-                free(input_copy);
-                return ESP_ERR_INVALID_ARG; // Invalid alarm format
-            }
-            new_alarms[new_alarm_count++] = (js_alarm_t){.hour = hour, .minute = minute, .enabled = enabled, .song_index = song_index};
-        } else {
-            free(input_copy);
+        if (sscanf(token, "%d:%d,%d,%d", &hour, &minute, &enabled, &song_index) != 4) return ESP_ERR_INVALID_ARG; // Invalid alarm format
+        if (hour < 0 || hour > 23 || minute < 0 || minute > 59 || enabled < 0 || enabled > 1 || song_index < 0 ||
+            song_index >= JS_MAX_TRACKS) {
             return ESP_ERR_INVALID_ARG; // Invalid alarm format
         }
-        token = strtok(NULL, ";");
+        alarms[new_alarm_count++] = (js_alarm_t){.hour = hour, .minute = minute, .enabled = enabled, .song_index = song_index};
+
+        token = strchr(token, ';'); // Next alarm
+        if (!token) break;
     }
-    free(input_copy);
+
+    *count = new_alarm_count;
+    return ESP_OK;
+}
+
+// Fully overwrite the alarm settings (already parsed and checked by js_user_settings_parse_alarms)
+esp_err_t js_user_settings_set_alarms(const js_alarm_t *alarms, uint8_t count) {
+    ESP_LOGI(TAG, "Setting %d alarms", count);
+    if (count > JS_MAX_ALARMS) return ESP_ERR_INVALID_SIZE;
 
     // Update the in-memory prefs
-    user_prefs.alarm_count = new_alarm_count;
-    memcpy(user_prefs.alarms, new_alarms, sizeof(js_alarm_t) * new_alarm_count);
+    user_prefs.alarm_count = count;
+    memcpy(user_prefs.alarms, alarms, sizeof(js_alarm_t) * count);
 
     // Save to NVS
     ESP_RETURN_ON_ERROR(save_to_nvs(), TAG, "Failed to save user preferences to NVS");
 
+    // Update the state cache
+    js_state_set_alarms(js_user_settings_get_alarms());
+
+    return ESP_OK;
+}
+
+/**
+ * Apply a whole settings image (hex) at once: everything is checked first, then apply() sets the clock and timezone,
+ * and only then is it saved with a single NVS commit. If apply() fails nothing is saved, if the commit fails the old
+ * settings are kept and apply() puts the old timezone back (the clock stays set, it isn't part of the settings).
+ * Image (LE): [u8 version][u8 flags][u16 length][u64 unix time][char timezone[64]][u8 alarm count]
+ *             [hour, minute, enabled, song_index per alarm][u32 CRC32 of everything before it]
+ */
+esp_err_t js_user_settings_import(const char *image_hex, js_settings_apply_cb_t apply) {
+    uint8_t image[JS_SETTINGS_IMAGE_MAX];
+    int len = hex_to_bytes(image_hex, image, sizeof(image));
+    if (len < JS_SETTINGS_IMAGE_HEADER + 4) return ESP_ERR_INVALID_SIZE;
+
+    // Header and integrity
+    if (image[0] != JS_SETTINGS_IMAGE_VERSION) return ESP_ERR_NOT_SUPPORTED;
+    if ((image[2] | (image[3] << 8)) != len) return ESP_ERR_INVALID_SIZE;
+    uint32_t crc = image[len - 4] | (image[len - 3] << 8) | (image[len - 2] << 16) | ((uint32_t)image[len - 1] << 24);
+    if (esp_rom_crc32_le(0, image, len - 4) != crc) return ESP_ERR_INVALID_CRC;
+
+    // Timezone must be null terminated inside its field
+    const char *tz = (const char *)image + 12;
+    if (memchr(tz, '\0', sizeof(user_prefs.timezone)) == NULL) return ESP_ERR_INVALID_ARG;
+
+    // Alarms, same limits as the A: command
+    uint8_t alarm_count = image[76];
+    if (alarm_count > JS_MAX_ALARMS || len != JS_SETTINGS_IMAGE_HEADER + alarm_count * 4 + 4) return ESP_ERR_INVALID_SIZE;
+    js_alarm_t new_alarms[JS_MAX_ALARMS];
+    for (uint8_t i = 0; i < alarm_count; i++) {
+        const uint8_t *a = image + JS_SETTINGS_IMAGE_HEADER + i * 4;
+        if (a[0] > 23 || a[1] > 59 || a[2] > 1 || a[3] >= JS_MAX_TRACKS) return ESP_ERR_INVALID_ARG;
+        new_alarms[i] = (js_alarm_t){.hour = a[0], .minute = a[1], .enabled = a[2], .song_index = a[3]};
+    }
+
+    uint64_t image_time = 0;
+    if (image[1] & JS_SETTINGS_IMAGE_FLAG_TIME) {
+        for (int i = 7; i >= 0; i--) image_time = (image_time << 8) | image[4 + i];
+    }
+
+    // Everything checked, set the clock and timezone first so nothing is saved if that fails
+    if (apply) ESP_RETURN_ON_ERROR(apply(tz, image_time), TAG, "Failed to apply the time and timezone");
+
+    // Then save it all with one commit
+    static js_user_prefs_t prev_prefs; // Static: it's big, and imports only run on the config lane
+    prev_prefs = user_prefs;
+    strncpy(user_prefs.timezone, tz, sizeof(user_prefs.timezone));
+    user_prefs.alarm_count = alarm_count;
+    memcpy(user_prefs.alarms, new_alarms, sizeof(js_alarm_t) * alarm_count);
+    esp_err_t err = save_to_nvs();
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to save user preferences to NVS, keeping the old settings");
+        user_prefs = prev_prefs;
+        if (apply) apply(js_user_settings_get_timezone(), 0);
+        return err;
+    }
+
+    // Update the state cache
+    js_state_set_timezone(js_user_settings_get_timezone());
+    js_state_set_alarms(js_user_settings_get_alarms());
+
+    ESP_LOGI(TAG, "Imported settings image: %d bytes, %d alarms", len, alarm_count);
     return ESP_OK;
 }
 
+// Export the current settings as an image (hex) in the same format js_user_settings_import() takes, without a time
+const char *js_user_settings_export(void) {
+    static char hex[JS_SETTINGS_IMAGE_MAX * 2 + 1];
+    uint8_t image[JS_SETTINGS_IMAGE_MAX] = {0};
+    uint16_t len = JS_SETTINGS_IMAGE_HEADER + user_prefs.alarm_count * 4 + 4;
+
+    image[0] = JS_SETTINGS_IMAGE_VERSION;
+    image[1] = 0; // No time
+    image[2] = len & 0xFF;
+    image[3] = len >> 8;
+    strncpy((char *)image + 12, user_prefs.timezone, sizeof(user_prefs.timezone) - 1);
+    image[76] = user_prefs.alarm_count;
+    for (uint8_t i = 0; i < user_prefs.alarm_count; i++) {
+        uint8_t *a = image + JS_SETTINGS_IMAGE_HEADER + i * 4;
+        a[0] = user_prefs.alarms[i].hour;
+        a[1] = user_prefs.alarms[i].minute;
+        a[2] = user_prefs.alarms[i].enabled;
+        a[3] = user_prefs.alarms[i].song_index;
+    }
+    uint32_t crc = esp_rom_crc32_le(0, image, len - 4);
+    for (int i = 0; i < 4; i++) image[len - 4 + i] = crc >> (8 * i);
+
+    for (uint16_t i = 0; i < len; i++) snprintf(hex + i * 2, 3, "%02X", image[i]);
+    return hex;
+}
+
 esp_err_t js_user_settings_seconds_until_next_alarm(uint64_t *seconds_until_alarm, int *next_alarm_song_index) {
     // Get the current unix time
     time_t now = time(NULL);
@@ -174,6 +283,18 @@ esp_err_t js_user_settings_seconds_until_next_alarm(uint64_t *seconds_until_alar
 }
 
 /* ************************** Local Functions ************************** */
+// Decode a hex string into bytes. Returns the byte count, or -1 if it isn't valid hex or doesn't fit.
+static int hex_to_bytes(const char *hex, uint8_t *out, size_t max) {
+    size_t hex_len = strlen(hex);
+    if (hex_len % 2 != 0 || hex_len / 2 > max) return -1;
+    for (size_t i = 0; i < hex_len / 2; i++) {
+        unsigned int byte;
+        if (!isxdigit((unsigned char)hex[i * 2]) || !isxdigit((unsigned char)hex[i * 2 + 1]) || sscanf(hex + i * 2, "%2x", &byte) != 1) return -1;
+        out[i] = byte;
+    }
+    return hex_len / 2;
+}
+
 esp_err_t save_to_nvs(void) {
     nvs_handle_t nvs_handle;
     ESP_RETURN_ON_ERROR(nvs_open(SETTINGS_NAMESPACE, NVS_READWRITE, &nvs_handle), TAG, "Failed to open NVS namespace");
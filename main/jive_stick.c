@@ -4,6 +4,8 @@
 #include "esp_err.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "nvs_flash.h"
@@ -22,24 +24,80 @@
 #include "js_battery.h"
 #include "js_ble.h"
 #include "js_ble_gatt.h"
+#include "js_boot.h"
 #include "js_buttons.h"
+#include "js_cmd.h"
+#include "js_cpu.h"
+#include "js_diag.h"
+#include "js_dlog.h"
 #include "js_events.h"
 #include "js_i2c.h"
 #include "js_leds.h"
+#include "js_sched.h"
 #include "js_serial_input.h"
 #include "js_sleep.h"
+#include "js_state.h"
 #include "js_time.h"
+#include "js_trace.h"
 #include "js_user_settings.h"
 
 // Defines
 #define TAG "main"
 
+// Init steps, see js_boot.c. Each runs once the steps in its deps are done.
+typedef enum {
+    BOOT_DLOG,
+    BOOT_NVS,
+    BOOT_ISR,
+    BOOT_ADC,
+    BOOT_I2C,
+    BOOT_EVENTS,
+    BOOT_SCHED,
+    BOOT_DIAG,
+    BOOT_FS,
+    BOOT_SERIAL,
+    BOOT_SETTINGS,
+    BOOT_LEDS,
+    BOOT_BUTTONS,
+    BOOT_BATTERY,
+    BOOT_AUDIO,
+    BOOT_TRACKS,
+    BOOT_BLE,
+    BOOT_TIME,
+    BOOT_STEP_COUNT,
+} boot_step_id_t;
+
 // Forward Declarations
-static esp_err_t init_system(void);
-static esp_err_t init_components(void);
+static esp_err_t init_isr_service(void);
+static esp_err_t init_events(void);
+static esp_err_t init_fs(void);
+static esp_err_t init_audio_tracks(void);
+static esp_err_t apply_settings_time(const char *tz, uint64_t unix_time);
+static void confirm_running_image(bool healthy);
 static void app_event_handler(void *arg, esp_event_base_t base, int32_t id, void *data);
-static esp_err_t ble_write_response(const char *prefix, esp_err_t err);
-static esp_err_t ble_read_response(const char *prefix, const char *value);
+static esp_err_t ble_write_response(uint16_t reply_to, const char *prefix, esp_err_t err);
+static esp_err_t ble_read_response(uint16_t reply_to, const char *prefix, const char *value);
+
+static const js_boot_step_t s_boot_steps[BOOT_STEP_COUNT] = {
+    [BOOT_DLOG] = {"dlog", js_dlog_init, 0},
+    [BOOT_NVS] = {"nvs", nvs_flash_init, 0},
+    [BOOT_ISR] = {"isr_service", init_isr_service, 0},
+    [BOOT_ADC] = {"adc", js_adc_init, 0},
+    [BOOT_I2C] = {"i2c", js_i2c_init, 0},
+    [BOOT_EVENTS] = {"events", init_events, 0},
+    [BOOT_SCHED] = {"sched", js_sched_init, 0},
+    [BOOT_DIAG] = {"diag", js_diag_init, BIT(BOOT_SCHED)},
+    [BOOT_FS] = {"littlefs", init_fs, 0},
+    [BOOT_SERIAL] = {"serial", js_serial_input_init, BIT(BOOT_EVENTS)},
+    [BOOT_SETTINGS] = {"user_settings", js_user_settings_init, BIT(BOOT_NVS)},
+    [BOOT_LEDS] = {"leds", js_leds_init, BIT(BOOT_SCHED)},
+    [BOOT_BUTTONS] = {"buttons", js_buttons_init, BIT(BOOT_ISR) | BIT(BOOT_EVENTS)},
+    [BOOT_BATTERY] = {"battery", js_battery_init, BIT(BOOT_ISR) | BIT(BOOT_ADC) | BIT(BOOT_EVENTS) | BIT(BOOT_LEDS) | BIT(BOOT_SCHED)},
+    [BOOT_AUDIO] = {"audio", js_audio_init, 0},
+    [BOOT_TRACKS] = {"audio_tracks", init_audio_tracks, BIT(BOOT_AUDIO) | BIT(BOOT_FS)},
+    [BOOT_BLE] = {"ble", js_ble_init, BIT(BOOT_NVS) | BIT(BOOT_EVENTS) | BIT(BOOT_SETTINGS) | BIT(BOOT_FS)},
+    [BOOT_TIME] = {"time", js_time_init, BIT(BOOT_I2C) | BIT(BOOT_EVENTS) | BIT(BOOT_SETTINGS)},
+};
 
 /*************************** Main Loop ***************************/
 void app_main(void) {
@@ -47,84 +105,95 @@ void app_main(void) {
     // vTaskDelay(pdMS_TO_TICKS(1500));
     printf("%s: Starting Jive Stick Firmware...\n", TAG);
 
-    // Inits
-    ESP_ERROR_CHECK_WITHOUT_ABORT(init_system());
-    ESP_ERROR_CHECK_WITHOUT_ABORT(init_components());
+    // Inits (independent ones run at the same time)
+    esp_err_t init_err = js_boot_run(s_boot_steps, BOOT_STEP_COUNT);
+    ESP_ERROR_CHECK_WITHOUT_ABORT(init_err);
+    js_boot_print_timeline();
+
+    // Keep a new OTA image only if it made it through init, otherwise roll back
+    confirm_running_image(init_err == ESP_OK);
 
     // Handle Wake-Up Reason
     js_sleep_handle_wakeup();
 
     // Set the next alarm based on user settings
-    esp_event_post(JS_EVENT_BASE, JS_EVENT_SET_NEXT_ALARM, NULL, 0, portMAX_DELAY);
+    js_events_post(JS_EVENT_SET_NEXT_ALARM, NULL, 0);
 
     // *************** Temp ******************
-    esp_vfs_littlefs_conf_t conf = {
-        .base_path = "/fs",
-        .partition_label = "storage",
-        .format_if_mount_failed = false,
-    };
-    ESP_ERROR_CHECK_WITHOUT_ABORT(esp_vfs_littlefs_register(&conf));
-
     DIR *dir = opendir("/fs");
     struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
+    while (dir && (entry = readdir(dir)) != NULL) {
         printf("  - %s\n", entry->d_name);
     }
-    closedir(dir);
+    if (dir) closedir(dir);
 
     // *************** Temp END ******************
 
-    // Run the app
-    while (1) {
-        vTaskDelay(pdMS_TO_TICKS(500));
-    }
+    // Everything is allocated by now, flag any heap use from here on
+    js_diag_boot_done();
+
+    // The app runs on the event lanes and js_sched from here, returning frees the main task
 }
 
 /*************************** Local Functions ***************************/
 
-/** Init system functionality needed for multiple components */
-static esp_err_t init_system(void) {
-    esp_err_t ret = ESP_FAIL;
-    ESP_LOGI(TAG, "init_system starting...");
-
-    // Inits
-    ESP_GOTO_ON_ERROR(nvs_flash_init(), error, TAG, "init_system: Failed to initialize NVS");
-    ESP_GOTO_ON_ERROR(gpio_install_isr_service(0), error, TAG, "init_system: Failed to install ISR service");
-    ESP_GOTO_ON_ERROR(js_adc_init(), error, TAG, "init_system: Failed to initialize JS ADC");
-    ESP_GOTO_ON_ERROR(js_i2c_init(), error, TAG, "init_system: Failed to initialize JS I2C");
-    ESP_GOTO_ON_ERROR(esp_event_loop_create_default(), error, TAG, "init_system:Failed to create default event loop");
-    ESP_GOTO_ON_ERROR(esp_event_handler_register(JS_EVENT_BASE, ESP_EVENT_ANY_ID, app_event_handler, NULL), error, TAG, "init_system:Failed to register event handler");
-    ESP_GOTO_ON_ERROR(js_serial_input_init(), error, TAG, "init_system: Failed to initialize JS Serial Input");
-    return ESP_OK;
+// Wrappers for the init steps that take arguments
+static esp_err_t init_isr_service(void) {
+    return gpio_install_isr_service(0);
+}
+
+static esp_err_t init_events(void) {
+    ESP_RETURN_ON_ERROR(js_events_init(), TAG, "Failed to create the event lanes");
+    return js_events_register_handler(app_event_handler, NULL);
+}
 
-error:
-    return ret;
+// Not fatal (and no OTA rollback) without the file system, the built-in tracks still play
+static esp_err_t init_fs(void) {
+    esp_vfs_littlefs_conf_t conf = {
+        .base_path = "/fs",
+        .partition_label = "storage",
+        .format_if_mount_failed = false,
+    };
+    ESP_ERROR_CHECK_WITHOUT_ABORT(esp_vfs_littlefs_register(&conf));
+    return ESP_OK;
 }
 
-/** Init components */
-static esp_err_t init_components(void) {
-    esp_err_t ret = ESP_FAIL;
-    ESP_LOGI(TAG, "init_components starting...");
-
-    // Inits
-    ESP_GOTO_ON_ERROR(js_user_settings_init(), error, TAG, "init_components: Failed to initialize JS User Settings");
-    ESP_GOTO_ON_ERROR(js_leds_init(), error, TAG, "init_components: Failed to initialize JS LEDs");
-    ESP_GOTO_ON_ERROR(js_buttons_init(), error, TAG, "init_components: Failed to initialize JS Buttons");
-    ESP_GOTO_ON_ERROR(js_battery_init(), error, TAG, "init_components: Failed to initialize JS Battery");
-    ESP_GOTO_ON_ERROR(js_audio_init(), error, TAG, "init_components: Failed to initialize JS Audio");
-    ESP_GOTO_ON_ERROR(js_ble_init(), error, TAG, "init_components: Failed to initialize JS BLE");
-    ESP_GOTO_ON_ERROR(js_time_init(), error, TAG, "init_components: Failed to initialize JS RTC");
+// Pick up any tracks uploaded over BLE, and open the emergency track for the rest of the run
+static esp_err_t init_audio_tracks(void) {
+    js_audio_refresh_tracks();
+    js_audio_open_emergency_track();
     return ESP_OK;
+}
 
-error:
-    return ret;
+// Clock and timezone from a settings image, set by js_user_settings_import() before it saves anything
+static esp_err_t apply_settings_time(const char *tz, uint64_t unix_time) {
+    if (unix_time != 0) ESP_RETURN_ON_ERROR(js_time_set(unix_time), TAG, "Failed to set the time");
+    return js_time_set_timezone(tz);
+}
+/**
+ * After a BLE update the new image boots as pending verify.
+ * Mark it valid if init passed, otherwise roll back to the previous slot and reboot.
+ */
+static void confirm_running_image(bool healthy) {
+    esp_ota_img_states_t state;
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    if (esp_ota_get_state_partition(running, &state) != ESP_OK || state != ESP_OTA_IMG_PENDING_VERIFY) return;
+
+    if (healthy) {
+        ESP_LOGI(TAG, "New firmware in %s passed init, marking valid", running->label);
+        esp_ota_mark_app_valid_cancel_rollback();
+    } else {
+        ESP_LOGE(TAG, "New firmware in %s failed init, rolling back", running->label);
+        esp_ota_mark_app_invalid_rollback_and_reboot();
+    }
 }
 
 /*************************** Event Handler ***************************/
 static void app_event_handler(void *arg, esp_event_base_t base, int32_t id,
                               void *data) {
-    ESP_LOGI(TAG, "Event received: base=%s, id=%ld", base, id);
+    JS_DLOGD(TAG, "Event received: id=%ld", id);
     esp_err_t err;
+    const js_cmd_t *cmd = (const js_cmd_t *)data; // Only valid for the read/write command events
 
     // Skip if not our event base
     if (base != JS_EVENT_BASE) return;
@@ -152,18 +221,16 @@ static void app_event_handler(void *arg, esp_event_base_t base, int32_t id,
             ESP_LOGE(TAG, "Failed to read time from system");
             offset += snprintf(response + offset, sizeof(response) - offset, "/SYS:error");
         }
-        js_ble_notify(response); // Send the combined response over BLE
+        js_ble_notify_conn(cmd->reply_to, response); // Send the combined response to the phone that asked
         break;
 
     case JS_EVENT_WRITE_SYSTEM_TIME:
-        // ESP_LOGI(TAG, "Set time command received with data: %s", (char *)data);
-        uint64_t new_time = strtoull((char *)data, NULL, 10);
-        printf("Setting system time to: %lld\n", new_time);
-        err = js_time_set(new_time);
-        ble_write_response("T", err);
+        printf("Setting system time to: %lld\n", cmd->unix_time);
+        err = js_time_set(cmd->unix_time);
+        ble_write_response(cmd->reply_to, "T", err);
         if (err != ESP_OK) ESP_LOGE(TAG, "Failed to set system time: %s", esp_err_to_name(err));
         // Update the next alarm since the time has changed
-        esp_event_post(JS_EVENT_BASE, JS_EVENT_SET_NEXT_ALARM, NULL, 0, portMAX_DELAY);
+        js_events_post(JS_EVENT_SET_NEXT_ALARM, NULL, 0);
         break;
 
     case JS_EVENT_SET_NEXT_ALARM:
@@ -173,10 +240,18 @@ static void app_event_handler(void *arg, esp_event_base_t base, int32_t id,
         if (js_user_settings_seconds_until_next_alarm(&seconds_until_alarm, &next_alarm_song_index) == ESP_OK) {
             if (seconds_until_alarm == UINT64_MAX) {
                 printf("No enabled alarms found\n");
+                js_state_set_next_alarm(0);
             } else {
                 printf("Seconds until next alarm: %lld\n", seconds_until_alarm);
                 printf("Next alarm song index: %d\n", next_alarm_song_index);
+                // Alarms can point at an upload that's not there (any index below JS_MAX_TRACKS is accepted),
+                // ring with the first track rather than not at all
+                if (next_alarm_song_index >= js_audio_track_count()) {
+                    ESP_LOGW(TAG, "Alarm track %d doesn't exist, using track 0", next_alarm_song_index);
+                    next_alarm_song_index = 0;
+                }
                 js_time_set_next_alarm(seconds_until_alarm, next_alarm_song_index);
+                js_state_set_next_alarm(time(NULL) + seconds_until_alarm);
             }
         } else {
             ESP_LOGE(TAG, "Failed to calculate seconds until next alarm");
@@ -188,32 +263,43 @@ static void app_event_handler(void *arg, esp_event_base_t base, int32_t id,
         // ESP_LOGI(TAG, "Read timezone command received");
         const char *tz = js_user_settings_get_timezone();
         // printf("Current timezone: %s\n", tz);
-        ble_read_response("l", tz);
+        ble_read_response(cmd->reply_to, "l", tz);
         break;
 
     case JS_EVENT_WRITE_TIMEZONE:
-        // ESP_LOGI(TAG, "Write timezone command received with data: %s", (char *)data);
-        js_user_settings_set_timezone((char *)data); // Set the timezone in user settings (and nvs)
-        err = js_time_set_timezone((char *)data);    // Update the system time settings
-        ble_write_response("L", err);                // Send BLE response
+        // ESP_LOGI(TAG, "Write timezone command received with data: %s", cmd->text);
+        js_user_settings_set_timezone(cmd->text);    // Set the timezone in user settings (and nvs)
+        err = js_time_set_timezone(cmd->text);       // Update the system time settings
+        ble_write_response(cmd->reply_to, "L", err); // Send BLE response
         // Update the next alarm since the timezone has changed
-        esp_event_post(JS_EVENT_BASE, JS_EVENT_SET_NEXT_ALARM, NULL, 0, portMAX_DELAY);
+        js_events_post(JS_EVENT_SET_NEXT_ALARM, NULL, 0);
         break;
 
     case JS_EVENT_READ_ALARMS:
         // ESP_LOGI(TAG, "Read alarms command received");
         const char *alarms = js_user_settings_get_alarms();
         // printf("Current Alarms: %s\n", alarms);
-        ble_read_response("a", alarms);
+        ble_read_response(cmd->reply_to, "a", alarms);
         break;
 
     case JS_EVENT_WRITE_ALARMS:
-        // ESP_LOGI(TAG, "Write alarms command received with data: %s", (char *)data);
-        err = js_user_settings_set_alarms((char *)data);
-        ble_write_response("A", err);
+        err = js_user_settings_set_alarms(cmd->alarms.list, cmd->alarms.count);
+        ble_write_response(cmd->reply_to, "A", err);
 
         // Update the next alarm since the alarms have changed
-        esp_event_post(JS_EVENT_BASE, JS_EVENT_SET_NEXT_ALARM, NULL, 0, portMAX_DELAY);
+        js_events_post(JS_EVENT_SET_NEXT_ALARM, NULL, 0);
+        break;
+
+    case JS_EVENT_READ_SETTINGS:
+        ble_read_response(cmd->reply_to, "s", js_user_settings_export());
+        break;
+
+    case JS_EVENT_WRITE_SETTINGS:
+        // The clock and timezone are set first, then timezone and alarms are saved together and the next alarm updated once
+        err = js_user_settings_import(cmd->text, apply_settings_time);
+        if (err == ESP_OK) js_events_post(JS_EVENT_SET_NEXT_ALARM, NULL, 0);
+        ble_write_response(cmd->reply_to, "S", err);
+        if (err != ESP_OK) ESP_LOGE(TAG, "Failed to apply settings image: %s", esp_err_to_name(err));
         break;
 
     // ******************** Battery Events ********************
@@ -229,28 +315,110 @@ static void app_event_handler(void *arg, esp_event_base_t base, int32_t id,
 
     case JS_EVENT_READ_BATTERY:
         ESP_LOGI(TAG, "JS_EVENT_READ_BATTERY command received");
-        int batterymv = js_battery_read_voltage();
+        int batterymv;
+        js_state_get_battery(&batterymv, NULL);
         char batterymv_str[8];
         snprintf(batterymv_str, sizeof(batterymv_str), "%d", batterymv);
-        ble_read_response("b", batterymv_str);
+        ble_read_response(cmd->reply_to, "b", batterymv_str);
         break;
 
     case JS_EVENT_READ_CHARGER:
         ESP_LOGI(TAG, "JS_EVENT_READ_CHARGER command received");
-        bool charging = js_battery_is_charging();
-        ble_read_response("c", charging ? "1" : "0");
+        bool charging;
+        js_state_get_battery(NULL, &charging);
+        ble_read_response(cmd->reply_to, "c", charging ? "1" : "0");
+        break;
+
+    case JS_EVENT_CHARGER_CHANGED:
+        js_battery_update();
         break;
 
     // ******************** Audio Events ********************
     case JS_EVENT_PLAY_AUDIO: // Data will be uint8_t index of the song to play
-        ESP_LOGI(TAG, "Play audio command received with data: %d", *(uint8_t *)data);
+        JS_DLOGI(TAG, "Play audio command received with data: %d", *(uint8_t *)data);
         // Convert the data to an index (e.g. "1" -> 1) and play the corresponding song
         js_audio_play_pause_song(*(uint8_t *)data);
         break;
 
-    case JS_EVENT_EMERGENCY_BUTTON_PRESSED:
-        ESP_LOGI(TAG, "Emergency button pressed");
+    case JS_EVENT_EMERGENCY_BUTTON_PRESSED: {
+        JS_DLOGI(TAG, "Emergency button pressed");
+        int64_t press_us = data ? *(int64_t *)data : esp_timer_get_time();
+        bool starting = !js_audio_is_emergency_playing(); // js_audio's own flag, not the derived state
+
+        // Audio first. The BLE side only queues a request for the NimBLE host task, which sends the alert to the
+        // connected phones with one try each, so nothing here waits on BLE
         js_audio_play_pause_emergency_audio();
+        if (starting) {
+            js_ble_start_emergency(press_us);
+        } else {
+            js_ble_stop_emergency();
+        }
+        break;
+    }
+
+    // ******************** Diagnostics ********************
+    case JS_EVENT_READ_LANE_STATS: {
+        // "q:safety:<n>,<avg wait us>,<max wait us>,<max run us>,<dropped>;audio:...;slots:<small>,<large>"
+        char stats_str[256];
+        size_t len = 0;
+        for (int i = 0; i < JS_LANE_COUNT; i++) {
+            js_lane_stats_t stats;
+            js_events_get_lane_stats(i, &stats);
+            len += snprintf(stats_str + len, sizeof(stats_str) - len, "%s%s:%lu,%lu,%lu,%lu,%lu", i ? ";" : "",
+                            js_events_lane_name(i), (unsigned long)stats.count,
+                            (unsigned long)(stats.count ? stats.total_wait_us / stats.count : 0),
+                            (unsigned long)stats.max_wait_us, (unsigned long)stats.max_run_us, (unsigned long)stats.dropped);
+            if (len >= sizeof(stats_str)) break;
+        }
+        js_slot_stats_t slots;
+        js_events_get_slot_stats(&slots);
+        if (len < sizeof(stats_str)) {
+            snprintf(stats_str + len, sizeof(stats_str) - len, ";slots:%u,%u", slots.small_free_min, slots.large_free_min);
+        }
+        ble_read_response(cmd->reply_to, "q", stats_str);
+        break;
+    }
+
+    case JS_EVENT_READ_TRACE: {
+        // Static like ble_read_response(), the summary can be long. Config lane only.
+        static char trace_str[JS_CMD_MAX_LEN - 2];
+        if (cmd->index == JS_TRACE_ALL_EVENTS) {
+            js_trace_format_summary(trace_str, sizeof(trace_str));
+        } else {
+            js_trace_format_hist(cmd->index, trace_str, sizeof(trace_str));
+        }
+        ble_read_response(cmd->reply_to, "h", trace_str);
+        break;
+    }
+
+    case JS_EVENT_READ_DIAG: {
+        // Static like the trace summary, the stack list is long. Config lane only.
+        static char diag_str[JS_CMD_MAX_LEN - 2];
+        js_diag_format(diag_str, sizeof(diag_str));
+        ble_read_response(cmd->reply_to, "m", diag_str);
+        js_diag_log(); // The full list on the console too
+        break;
+    }
+
+    case JS_EVENT_READ_CPU: {
+        static char cpu_str[JS_CMD_MAX_LEN - 2];
+        esp_err_t err = js_cpu_format(cpu_str, sizeof(cpu_str));
+        if (err != ESP_OK) {
+            ble_write_response(cmd->reply_to, "u", err);
+            break;
+        }
+        ble_read_response(cmd->reply_to, "u", cpu_str);
+        js_cpu_log();
+        break;
+    }
+
+    // Serial only, slow (a long log, or seconds of parsing) so they run here and not on the serial task
+    case JS_EVENT_DUMP_TRACE:
+        js_trace_dump();
+        break;
+
+    case JS_EVENT_RUN_BENCHMARK: // Data will be uint32_t iterations
+        js_cmd_benchmark(*(uint32_t *)data);
         break;
 
     // BLE.....
@@ -264,6 +432,10 @@ static void app_event_handler(void *arg, esp_event_base_t base, int32_t id,
         js_ble_stop();
         break;
 
+    case JS_EVENT_BLE_ADV_TIMEOUT:
+        ESP_LOGI(TAG, "JS_EVENT_BLE_ADV_TIMEOUT received, advertising stopped");
+        break;
+
         // Battery.....
 
         // ***************** User Settings Events ****************
@@ -274,8 +446,8 @@ static void app_event_handler(void *arg, esp_event_base_t base, int32_t id,
     }
 }
 
-// BLE Write Response helper function
-static esp_err_t ble_write_response(const char *prefix, esp_err_t err) {
+// BLE Write Response helper function (reply_to is JS_REPLY_NONE for serial commands, which only log)
+static esp_err_t ble_write_response(uint16_t reply_to, const char *prefix, esp_err_t err) {
     char resp[128];
 
     if (err == ESP_OK) {
@@ -288,14 +460,14 @@ static esp_err_t ble_write_response(const char *prefix, esp_err_t err) {
         ESP_LOGE(TAG, "%s", resp);
     }
 
-    return js_ble_notify(resp);
+    return js_ble_notify_conn(reply_to, resp);
 }
 
 // BLE Read Response helper function
-static esp_err_t ble_read_response(const char *prefix, const char *value) {
-    char resp[128];
+static esp_err_t ble_read_response(uint16_t reply_to, const char *prefix, const char *value) {
+    static char resp[JS_CMD_MAX_LEN]; // Static: the alarms list can be long and the event loop stack is small
     snprintf(resp, sizeof(resp), "%s:%s", prefix, value);
     ESP_LOGI(TAG, "%s", resp);
 
-    return js_ble_notify(resp);
+    return js_ble_notify_conn(reply_to, resp);
 }
\ No newline at end of file